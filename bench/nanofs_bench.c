@@ -0,0 +1,882 @@
+//
+// Benchmarks for the NanoFS core. Every scenario runs against a fresh image
+// in a temporary directory and reports its results as JSON on stdout.
+//
+// Usage: nanofs_bench [create|lookup|small|large|remove|rmdir|allocate|checksum|stripe|direct|defrag|durability|walk|import|export|send|tails]...
+// With no arguments every scenario runs.
+//
+
+#define NANOFS_NO_MAIN
+#include "../main.c"
+
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ROUNDS 20
+// The most files a single directory can hold next to . and ..
+#define BENCH_FILE_COUNT (NUM_BLOCK_POINTERS * DEFAULT_BLOCK_SIZE / sizeof(struct dentry) - 2)
+#define BENCH_LOOKUP_DEPTH 24
+#define BENCH_LOOKUPS 2000
+#define BENCH_SMALL_FILE_SIZE 100
+#define BENCH_ALLOCATIONS 2000
+#define BENCH_LARGE_FILE_NAME "bench_large_input"
+#define BENCH_CHECKSUM_BLOCKS 512
+#define BENCH_CHECKSUM_PASSES 50
+#define BENCH_AGED_FILES 40
+#define BENCH_WALK_FANOUT 4 // Subdirectories of every directory at the top two levels
+#define BENCH_WALK_FILES 12 // Files in every directory at the bottom level
+#define BENCH_IMPORT_DIRECTORY "bench_import_input"
+#define BENCH_EXPORT_DIRECTORY "bench_export_output"
+#define BENCH_IMPORT_DIRECTORIES 5
+#define BENCH_IMPORT_FILES 40 // In every directory
+#define BENCH_IMPORT_FILE_SIZE 2000
+#define BENCH_STREAM_FILE "bench.stream"
+#define BENCH_SEND_CHANGES 4 // Files changed between incremental sends
+
+struct bench_result {
+    const char* name;
+    uint64_t* latencies; // In nanoseconds, one per operation
+    int num_ops;
+    int capacity;
+    uint64_t total_ns;
+    uint64_t bytes; // Payload bytes moved, 0 if the scenario doesn't move data
+};
+
+bool first_result = true;
+
+uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+void result_init(struct bench_result* result, const char* name) {
+    *result = (struct bench_result) {name};
+    result->capacity = 1024;
+    result->latencies = malloc(result->capacity * sizeof(uint64_t));
+}
+
+void result_record(struct bench_result* result, const uint64_t start, const uint64_t end) {
+    // Every recorded operation is a command, so its scratch memory is given back like after a command in the shell
+    arena_reset();
+
+    if (result->num_ops == result->capacity) {
+        result->capacity *= 2;
+        result->latencies = realloc(result->latencies, result->capacity * sizeof(uint64_t));
+    }
+
+    result->latencies[result->num_ops++] = end - start;
+    result->total_ns += end - start;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    const auto x = *(const uint64_t*) a;
+    const auto y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(const struct bench_result* result, const double fraction) {
+    auto index = (int) (fraction * result->num_ops);
+    if (index >= result->num_ops) index = result->num_ops - 1;
+    return result->latencies[index];
+}
+
+void result_report(struct bench_result* result) {
+    qsort(result->latencies, result->num_ops, sizeof(uint64_t), compare_latencies);
+
+    const double seconds = (double) result->total_ns / 1e9;
+    const double ops_per_sec = seconds > 0 ? result->num_ops / seconds : 0;
+    const double mb_per_sec = seconds > 0 ? (double) result->bytes / (1024.0 * 1024.0) / seconds : 0;
+
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+        "\"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}}",
+        first_result ? "" : ",", result->name, result->num_ops, ops_per_sec, mb_per_sec,
+        (unsigned long long) percentile(result, 0.50),
+        (unsigned long long) percentile(result, 0.99),
+        (unsigned long long) percentile(result, 0.999));
+    first_result = false;
+
+    free(result->latencies);
+}
+
+void fresh_image() {
+    run_command_init(DEFAULT_DISK_NAME, 1, 1);
+    arena_reset();
+}
+
+// Creating many files in one directory, every create scans the whole directory first
+void bench_create_files() {
+    struct bench_result result;
+    result_init(&result, "create_files");
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+
+            const auto start = now_ns();
+            run_command_create(name);
+            result_record(&result, start, now_ns());
+        }
+    }
+
+    result_report(&result);
+}
+
+// Resolving a path that is BENCH_LOOKUP_DEPTH directories deep
+void bench_deep_lookup() {
+    struct bench_result result;
+    result_init(&result, "deep_lookup");
+
+    fresh_image();
+
+    char path[MAX_PATH_LEN] = "";
+    for (int i = 0; i < BENCH_LOOKUP_DEPTH; i++) {
+        if (i > 0) strcat(path, "/");
+        strcat(path, "d");
+        run_command_mkdir(path);
+    }
+    strcat(path, "/file");
+    run_command_create(path);
+
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        int inode_number;
+
+        const auto start = now_ns();
+        get_inode_number_of_path(path, TYPE_FILE, &inode_number);
+        result_record(&result, start, now_ns());
+    }
+
+    result_report(&result);
+}
+
+// Writing and then reading back small single-block files
+void bench_small_files() {
+    struct bench_result write_result;
+    struct bench_result read_result;
+    result_init(&write_result, "small_file_write");
+    result_init(&read_result, "small_file_read");
+
+    char content[BENCH_SMALL_FILE_SIZE + 1];
+    memset(content, 'x', BENCH_SMALL_FILE_SIZE);
+    content[BENCH_SMALL_FILE_SIZE] = '\0';
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+            run_command_create(name);
+
+            auto start = now_ns();
+            run_command_write(name, content);
+            result_record(&write_result, start, now_ns());
+            write_result.bytes += BENCH_SMALL_FILE_SIZE;
+
+            // Same steps as the read command, without printing the contents
+            start = now_ns();
+            int inode_number;
+            get_inode_number_of_path(name, TYPE_FILE, &inode_number);
+            struct inode inode;
+            read_inode(inode_number, &inode);
+            char data[BENCH_SMALL_FILE_SIZE];
+            read_data_from_block(inode.block_pointers[0], data, inode.file_size);
+            result_record(&read_result, start, now_ns());
+            read_result.bytes += inode.file_size;
+        }
+    }
+
+    result_report(&write_result);
+    result_report(&read_result);
+}
+
+// Saving and opening files that use every block pointer
+void bench_large_files() {
+    struct bench_result save_result;
+    struct bench_result open_result;
+    result_init(&save_result, "large_file_save");
+    result_init(&open_result, "large_file_open");
+
+    const int file_size = NUM_BLOCK_POINTERS * DEFAULT_BLOCK_SIZE;
+    FILE* input = fopen(BENCH_LARGE_FILE_NAME, "wb");
+    for (int i = 0; i < file_size; i++) fputc('a' + i % 26, input);
+    fclose(input);
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        // Stay well below the number of free data blocks
+        for (int i = 0; i < 40; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "large%d", i);
+            run_command_create(name);
+
+            auto start = now_ns();
+            run_command_save(BENCH_LARGE_FILE_NAME, name);
+            result_record(&save_result, start, now_ns());
+            save_result.bytes += file_size;
+
+            start = now_ns();
+            run_command_open(name);
+            result_record(&open_result, start, now_ns());
+            open_result.bytes += file_size;
+
+            char output_name[MAX_ARG_LEN + 5];
+            snprintf(output_name, sizeof(output_name), "%s.txt", name);
+            remove(output_name);
+        }
+    }
+
+    remove(BENCH_LARGE_FILE_NAME);
+
+    result_report(&save_result);
+    result_report(&open_result);
+}
+
+// Saving and opening whole files on a volume striped over some number of members, one block per stripe unit
+// Every member is a separate file here, so this measures the per-member queues rather than separate devices
+// Runs with O_DIRECT if direct_io is set
+void bench_striped_files(const int stripe_members) {
+    char save_name[64];
+    char open_name[64];
+    snprintf(save_name, sizeof(save_name), "stripe_save_%d%s", stripe_members, direct_io ? "_direct" : "");
+    snprintf(open_name, sizeof(open_name), "stripe_open_%d%s", stripe_members, direct_io ? "_direct" : "");
+
+    struct bench_result save_result;
+    struct bench_result open_result;
+    result_init(&save_result, save_name);
+    result_init(&open_result, open_name);
+
+    const int file_size = NUM_BLOCK_POINTERS * DEFAULT_BLOCK_SIZE;
+    FILE* input = fopen(BENCH_LARGE_FILE_NAME, "wb");
+    for (int i = 0; i < file_size; i++) fputc('a' + i % 26, input);
+    fclose(input);
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        run_command_init(DEFAULT_DISK_NAME, stripe_members, 1);
+
+        for (int i = 0; i < 40; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "large%d", i);
+            run_command_create(name);
+
+            auto start = now_ns();
+            run_command_save(BENCH_LARGE_FILE_NAME, name);
+            result_record(&save_result, start, now_ns());
+            save_result.bytes += file_size;
+
+            start = now_ns();
+            run_command_open(name);
+            result_record(&open_result, start, now_ns());
+            open_result.bytes += file_size;
+
+            char output_name[MAX_ARG_LEN + 5];
+            snprintf(output_name, sizeof(output_name), "%s.txt", name);
+            remove(output_name);
+        }
+    }
+
+    close_volume();
+    for (int member = 1; member < stripe_members; member++) {
+        char member_name[MAX_ARG_LEN + 8];
+        get_member_file_name(DEFAULT_DISK_NAME, member, member_name, sizeof(member_name));
+        remove(member_name);
+    }
+    remove(BENCH_LARGE_FILE_NAME);
+
+    result_report(&save_result);
+    result_report(&open_result);
+}
+
+// Removing every file from a full directory, one at a time
+void bench_remove_files() {
+    struct bench_result result;
+    result_init(&result, "remove_files");
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+            run_command_create(name);
+        }
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+
+            const auto start = now_ns();
+            run_command_rm(name);
+            result_record(&result, start, now_ns());
+        }
+    }
+
+    result_report(&result);
+}
+
+// Recursively removing a single directory holding many files, and a long chain of directories
+void bench_rmdir() {
+    struct bench_result wide_result;
+    struct bench_result deep_result;
+    result_init(&wide_result, "rmdir_wide");
+    result_init(&deep_result, "rmdir_deep");
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        char wide[] = "wide";
+        run_command_mkdir(wide);
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "wide/file%d", i);
+            run_command_create(name);
+        }
+
+        auto start = now_ns();
+        run_command_rmdir(wide);
+        result_record(&wide_result, start, now_ns());
+
+        char path[MAX_PATH_LEN] = "deep";
+        run_command_mkdir(path);
+        for (int i = 1; i < 100; i++) {
+            strcat(path, "/d");
+            run_command_mkdir(path);
+        }
+
+        char deep[] = "deep";
+        start = now_ns();
+        run_command_rmdir(deep);
+        result_record(&deep_result, start, now_ns());
+    }
+
+    result_report(&wide_result);
+    result_report(&deep_result);
+}
+
+// Allocating and freeing a data block when the first fill_percent% of the disk is in use
+void bench_allocator(const int fill_percent) {
+    char name[MAX_ARG_LEN + 1];
+    snprintf(name, sizeof(name), "allocate_fill_%d", fill_percent);
+
+    struct bench_result result;
+    result_init(&result, name);
+
+    fresh_image();
+    const int blocks_to_fill = superblock.block_count * fill_percent / 100;
+    for (int i = 1; i < blocks_to_fill; i++) set_data_block_status(i, DATA_BLOCK_USED);
+
+    for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+        const auto start = now_ns();
+        const auto block_number = find_next_free_data_block();
+        set_data_block_status(block_number, DATA_BLOCK_USED);
+        set_data_block_status(block_number, DATA_BLOCK_FREE);
+        result_record(&result, start, now_ns());
+    }
+
+    result_report(&result);
+}
+
+// CRC32C of single data blocks, without any disk I/O
+void bench_crc32c(const char* name, uint32_t (*implementation)(uint32_t crc, const uint8_t* data, size_t size)) {
+    struct bench_result result;
+    result_init(&result, name);
+
+    pthread_once(&crc32c_once, init_crc32c);
+    uint8_t block[DEFAULT_BLOCK_SIZE];
+    for (int i = 0; i < DEFAULT_BLOCK_SIZE; i++) block[i] = (uint8_t) (i * 31);
+
+    // Keep the results live so the calls aren't optimized away
+    volatile uint32_t sink = 0;
+    for (int i = 0; i < BENCH_CHECKSUM_BLOCKS * BENCH_CHECKSUM_PASSES; i++) {
+        const auto start = now_ns();
+        sink = implementation(sink, block, sizeof(block));
+        result_record(&result, start, now_ns());
+        result.bytes += sizeof(block);
+    }
+
+    result_report(&result);
+}
+
+// Reading with checksum verification off and strict, both whole blocks through an already open disk
+// (the worst case, as only the checksum is left next to the copy) and files the way 'read' does
+// The passes alternate between the two policies so both see the same page cache state
+void bench_checksum_reads() {
+    struct bench_result block_results[2];
+    struct bench_result file_results[2];
+    result_init(&block_results[0], "block_read_verify_off");
+    result_init(&block_results[1], "block_read_verify_strict");
+    result_init(&file_results[0], "file_read_verify_off");
+    result_init(&file_results[1], "file_read_verify_strict");
+
+    fresh_image();
+
+    uint8_t block[DEFAULT_BLOCK_SIZE];
+    memset(block, 'x', sizeof(block));
+    block[sizeof(block) - 1] = '\0';
+
+    // Full single-block files, so the data blocks are the ones that get read
+    for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+        char name[MAX_ARG_LEN + 1];
+        snprintf(name, sizeof(name), "file%d", i);
+        run_command_create(name);
+        run_command_write(name, (char*) block);
+    }
+
+    const auto original_policy = checksum_policy;
+    for (int pass = 0; pass < BENCH_CHECKSUM_PASSES * 2; pass++) {
+        const int verify = pass % 2;
+        checksum_policy = verify ? CHECKSUM_VERIFY_STRICT : CHECKSUM_VERIFY_OFF;
+
+        FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+        for (int i = 1; i <= (int) BENCH_FILE_COUNT; i++) {
+            const auto start = now_ns();
+            read_data_from_block_disk(disk, i, block, sizeof(block));
+            result_record(&block_results[verify], start, now_ns());
+            block_results[verify].bytes += sizeof(block);
+        }
+        fclose(disk);
+
+        // Same steps as the read command, without printing the contents
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+
+            const auto start = now_ns();
+            int inode_number;
+            get_inode_number_of_path(name, TYPE_FILE, &inode_number);
+            struct inode inode;
+            read_inode(inode_number, &inode);
+            read_data_from_block(inode.block_pointers[0], block, inode.file_size);
+            result_record(&file_results[verify], start, now_ns());
+            file_results[verify].bytes += inode.file_size;
+        }
+    }
+    checksum_policy = original_policy;
+
+    for (int i = 0; i < 2; i++) result_report(&block_results[i]);
+    for (int i = 0; i < 2; i++) result_report(&file_results[i]);
+}
+
+// Opening files whose blocks were written round robin, so no two blocks of a file are next to each other,
+// before and after defrag puts every file's blocks into one run
+void bench_defrag() {
+    struct bench_result results[2];
+    struct bench_result defrag_result;
+    result_init(&results[0], "aged_file_open");
+    result_init(&results[1], "defragmented_file_open");
+    result_init(&defrag_result, "defrag");
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        char names[BENCH_AGED_FILES][MAX_ARG_LEN + 1];
+        for (int i = 0; i < BENCH_AGED_FILES; i++) {
+            snprintf(names[i], sizeof(names[i]), "aged%d", i);
+            run_command_create(names[i]);
+        }
+
+        // The last block only holds the written bytes
+        for (int block = 0; block < NUM_BLOCK_POINTERS; block++) {
+            for (int i = 0; i < BENCH_AGED_FILES; i++) run_command_write_at(names[i], block * DEFAULT_BLOCK_SIZE, "aged");
+        }
+        const int file_size = (NUM_BLOCK_POINTERS - 1) * DEFAULT_BLOCK_SIZE + 4;
+
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) {
+                const auto start = now_ns();
+                run_command_defrag(nullptr, DEFRAG_UNLIMITED_BUDGET);
+                result_record(&defrag_result, start, now_ns());
+            }
+
+            for (int i = 0; i < BENCH_AGED_FILES; i++) {
+                const auto start = now_ns();
+                run_command_open(names[i]);
+                result_record(&results[pass], start, now_ns());
+                results[pass].bytes += file_size;
+
+                char output_name[MAX_ARG_LEN + 5];
+                snprintf(output_name, sizeof(output_name), "aged%d.txt", i);
+                remove(output_name);
+            }
+        }
+    }
+
+    result_report(&results[0]);
+    result_report(&results[1]);
+    result_report(&defrag_result);
+}
+
+// Creating and writing small files with each durability mode, every command is committed as in the shell
+// Fewer rounds, a strict command can wait on several fsyncs
+void bench_durability(const enum durability_mode mode) {
+    char name[64];
+    snprintf(name, sizeof(name), "durability_%s_create_write", DURABILITY_MODE_NAMES[mode]);
+
+    struct bench_result result;
+    result_init(&result, name);
+
+    char content[BENCH_SMALL_FILE_SIZE + 1];
+    memset(content, 'x', BENCH_SMALL_FILE_SIZE);
+    content[BENCH_SMALL_FILE_SIZE] = '\0';
+
+    for (int round = 0; round < BENCH_ROUNDS / 4; round++) {
+        fresh_image();
+        durability_mode = mode;
+        start_committer();
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char file_name[MAX_ARG_LEN + 1];
+            snprintf(file_name, sizeof(file_name), "file%d", i);
+
+            const auto start = now_ns();
+            pthread_mutex_lock(&commit_lock);
+            run_command_create(file_name);
+            commit_command();
+            run_command_write(file_name, content);
+            commit_command();
+            pthread_mutex_unlock(&commit_lock);
+            result_record(&result, start, now_ns());
+            result.bytes += BENCH_SMALL_FILE_SIZE;
+        }
+
+        durability_mode = DURABILITY_NONE;
+    }
+
+    result_report(&result);
+}
+
+// du and find over a tree that fills the inode table, with up to the given number of threads
+void bench_walk(const int workers) {
+    char names[2][64];
+    snprintf(names[0], sizeof(names[0]), "du_%d_threads", workers);
+    snprintf(names[1], sizeof(names[1]), "find_%d_threads", workers);
+
+    struct bench_result results[2];
+    result_init(&results[0], names[0]);
+    result_init(&results[1], names[1]);
+
+    fresh_image();
+    for (int i = 0; i < BENCH_WALK_FANOUT; i++) {
+        char path[MAX_ARG_LEN + 1];
+        snprintf(path, sizeof(path), "d%d", i);
+        run_command_mkdir(path);
+
+        for (int j = 0; j < BENCH_WALK_FANOUT; j++) {
+            snprintf(path, sizeof(path), "d%d/d%d", i, j);
+            run_command_mkdir(path);
+
+            for (int k = 0; k < BENCH_WALK_FILES; k++) {
+                snprintf(path, sizeof(path), "d%d/d%d/file%d", i, j, k);
+                run_command_create(path);
+            }
+        }
+    }
+
+    max_walk_workers = workers;
+    for (int i = 0; i < BENCH_LOOKUPS / 10; i++) {
+        struct walk_result walk;
+
+        auto start = now_ns();
+        walk_tree(0, ".", nullptr, &walk);
+        result_record(&results[0], start, now_ns());
+
+        start = now_ns();
+        walk_tree(0, ".", "file1*", &walk);
+        result_record(&results[1], start, now_ns());
+    }
+    max_walk_workers = MAX_WORKER_THREADS;
+
+    result_report(&results[0]);
+    result_report(&results[1]);
+}
+
+// Host tree of BENCH_IMPORT_DIRECTORIES directories of BENCH_IMPORT_FILES files each, under directory
+void make_host_tree(const char* directory) {
+    char content[BENCH_IMPORT_FILE_SIZE];
+    for (int i = 0; i < BENCH_IMPORT_FILE_SIZE; i++) content[i] = 'a' + i % 26;
+
+    char path[MAX_ARG_LEN + 1];
+    mkdir(directory, 0755);
+    for (int i = 0; i < BENCH_IMPORT_DIRECTORIES; i++) {
+        snprintf(path, sizeof(path), "%s/d%d", directory, i);
+        mkdir(path, 0755);
+
+        for (int j = 0; j < BENCH_IMPORT_FILES; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/file%d", directory, i, j);
+            FILE* file = fopen(path, "wb");
+            fwrite(content, 1, sizeof(content), file);
+            fclose(file);
+        }
+    }
+}
+
+void remove_host_tree(const char* directory, const char* file_suffix) {
+    char path[MAX_ARG_LEN + 1];
+    for (int i = 0; i < BENCH_IMPORT_DIRECTORIES; i++) {
+        for (int j = 0; j < BENCH_IMPORT_FILES; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/file%d%s", directory, i, j, file_suffix);
+            remove(path);
+        }
+        snprintf(path, sizeof(path), "%s/d%d", directory, i);
+        rmdir(path);
+    }
+    // The bench's own directory is removed at the end
+    if (strcmp(directory, ".") != 0) rmdir(directory);
+}
+
+// Loading a host tree of small files with import, and with mkdir, create and save for every entry
+// Every round loads the whole tree into a fresh image
+void bench_import() {
+    struct bench_result results[2];
+    result_init(&results[0], "import_tree");
+    result_init(&results[1], "create_save_tree");
+
+    make_host_tree(BENCH_IMPORT_DIRECTORY);
+    const uint64_t tree_bytes = BENCH_IMPORT_DIRECTORIES * BENCH_IMPORT_FILES * BENCH_IMPORT_FILE_SIZE;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+
+        auto start = now_ns();
+        run_command_import(BENCH_IMPORT_DIRECTORY, ".");
+        result_record(&results[0], start, now_ns());
+        results[0].bytes += tree_bytes;
+
+        fresh_image();
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_IMPORT_DIRECTORIES; i++) {
+            char path[MAX_ARG_LEN + 1];
+            snprintf(path, sizeof(path), "d%d", i);
+            run_command_mkdir(path);
+
+            for (int j = 0; j < BENCH_IMPORT_FILES; j++) {
+                char host_path[MAX_ARG_LEN + 1];
+                snprintf(host_path, sizeof(host_path), BENCH_IMPORT_DIRECTORY "/d%d/file%d", i, j);
+                snprintf(path, sizeof(path), "d%d/file%d", i, j);
+                run_command_create(path);
+                run_command_save(host_path, path);
+            }
+        }
+        result_record(&results[1], start, now_ns());
+        results[1].bytes += tree_bytes;
+    }
+
+    remove_host_tree(BENCH_IMPORT_DIRECTORY, "");
+
+    result_report(&results[0]);
+    result_report(&results[1]);
+}
+
+// Copying the imported tree back out with export, and with open for every file
+void bench_export() {
+    struct bench_result results[2];
+    result_init(&results[0], "export_tree");
+    result_init(&results[1], "open_tree");
+
+    make_host_tree(BENCH_IMPORT_DIRECTORY);
+    const uint64_t tree_bytes = BENCH_IMPORT_DIRECTORIES * BENCH_IMPORT_FILES * BENCH_IMPORT_FILE_SIZE;
+
+    fresh_image();
+    run_command_import(BENCH_IMPORT_DIRECTORY, ".");
+    remove_host_tree(BENCH_IMPORT_DIRECTORY, "");
+
+    // open writes <path>.txt, so the directories have to exist on the host
+    for (int i = 0; i < BENCH_IMPORT_DIRECTORIES; i++) {
+        char path[MAX_ARG_LEN + 1];
+        snprintf(path, sizeof(path), "d%d", i);
+        mkdir(path, 0755);
+    }
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        auto start = now_ns();
+        run_command_export(".", BENCH_EXPORT_DIRECTORY);
+        result_record(&results[0], start, now_ns());
+        results[0].bytes += tree_bytes;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_IMPORT_DIRECTORIES; i++) {
+            for (int j = 0; j < BENCH_IMPORT_FILES; j++) {
+                char path[MAX_ARG_LEN + 1];
+                snprintf(path, sizeof(path), "d%d/file%d", i, j);
+                run_command_open(path);
+            }
+        }
+        result_record(&results[1], start, now_ns());
+        results[1].bytes += tree_bytes;
+    }
+
+    remove_host_tree(BENCH_EXPORT_DIRECTORY, "");
+    remove_host_tree(".", ".txt");
+
+    result_report(&results[0]);
+    result_report(&results[1]);
+}
+
+// Sending the whole disk against sending only what changed since the last send, with a few files changed in between
+void bench_send() {
+    struct bench_result results[2];
+    result_init(&results[0], "send_full");
+    result_init(&results[1], "send_incremental");
+
+    make_host_tree(BENCH_IMPORT_DIRECTORY);
+    fresh_image();
+    run_command_import(BENCH_IMPORT_DIRECTORY, ".");
+    remove_host_tree(BENCH_IMPORT_DIRECTORY, "");
+
+    // Stream bytes are counted as the data moved
+    struct stat status;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        const auto start = now_ns();
+        run_command_send(BENCH_STREAM_FILE, 0);
+        result_record(&results[0], start, now_ns());
+        if (stat(BENCH_STREAM_FILE, &status) == 0) results[0].bytes += status.st_size;
+    }
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        // Every send starts a new generation, so the last send's is the one before the current
+        const uint32_t since = superblock.generation - 1;
+        for (int i = 0; i < BENCH_SEND_CHANGES; i++) {
+            char path[MAX_ARG_LEN + 1];
+            snprintf(path, sizeof(path), "d%d/file%d", i % BENCH_IMPORT_DIRECTORIES, round);
+            run_command_write(path, "changed");
+        }
+        arena_reset();
+
+        const auto start = now_ns();
+        run_command_send(BENCH_STREAM_FILE, since);
+        result_record(&results[1], start, now_ns());
+        if (stat(BENCH_STREAM_FILE, &status) == 0) results[1].bytes += status.st_size;
+    }
+
+    remove(BENCH_STREAM_FILE);
+
+    result_report(&results[0]);
+    result_report(&results[1]);
+}
+
+// Writing and reading small files with and without tail packing, packed files share fragment blocks
+void bench_tail_packing(const bool packed) {
+    struct bench_result write_result;
+    struct bench_result read_result;
+    result_init(&write_result, packed ? "packed_small_file_write" : "unpacked_small_file_write");
+    result_init(&read_result, packed ? "packed_small_file_read" : "unpacked_small_file_read");
+
+    char content[BENCH_SMALL_FILE_SIZE + 1];
+    memset(content, 'x', BENCH_SMALL_FILE_SIZE);
+    content[BENCH_SMALL_FILE_SIZE] = '\0';
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+        if (packed) {
+            superblock.flags |= SUPERBLOCK_FLAG_PACK_TAILS;
+            write_superblock();
+        }
+
+        for (int i = 0; i < (int) BENCH_FILE_COUNT; i++) {
+            char name[MAX_ARG_LEN + 1];
+            snprintf(name, sizeof(name), "file%d", i);
+            run_command_create(name);
+
+            auto start = now_ns();
+            run_command_write(name, content);
+            result_record(&write_result, start, now_ns());
+            write_result.bytes += BENCH_SMALL_FILE_SIZE;
+
+            // Same steps as the read command, without printing the contents
+            start = now_ns();
+            int inode_number;
+            get_inode_number_of_path(name, TYPE_FILE, &inode_number);
+            struct inode inode;
+            read_inode(inode_number, &inode);
+            char data[BENCH_SMALL_FILE_SIZE];
+            FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+            if (inode.tail_block != 0) {
+                read_data_from_block_at_disk(disk, inode.tail_block, inode.tail_offset, data, inode.file_size);
+            } else {
+                read_data_from_block_disk(disk, inode.block_pointers[0], data, inode.file_size);
+            }
+            fclose(disk);
+            result_record(&read_result, start, now_ns());
+            read_result.bytes += inode.file_size;
+        }
+    }
+
+    result_report(&write_result);
+    result_report(&read_result);
+}
+
+bool should_run(const int argc, char const *argv[], const char* scenario) {
+    if (argc < 2) return true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], scenario) == 0) return true;
+    }
+
+    return false;
+}
+
+int main(const int argc, char const *argv[]) {
+    // Never touch an image in the current directory
+    char directory[] = "/tmp/nanofs_bench_XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) != 0) {
+        fprintf(stderr, "Failed to create temporary directory for benchmark\n");
+        return 1;
+    }
+
+    printf("{\n  \"block_size\": %d,\n  \"disk_size\": %d,\n  \"scenarios\": [", DEFAULT_BLOCK_SIZE, DEFAULT_SIZE);
+
+    if (should_run(argc, argv, "create")) bench_create_files();
+    if (should_run(argc, argv, "lookup")) bench_deep_lookup();
+    if (should_run(argc, argv, "small")) bench_small_files();
+    if (should_run(argc, argv, "large")) bench_large_files();
+    if (should_run(argc, argv, "remove")) bench_remove_files();
+    if (should_run(argc, argv, "rmdir")) bench_rmdir();
+    if (should_run(argc, argv, "allocate")) {
+        bench_allocator(0);
+        bench_allocator(50);
+        bench_allocator(95);
+    }
+    if (should_run(argc, argv, "checksum")) {
+        if (crc32c_hardware_available()) bench_crc32c("crc32c_hardware", crc32c_hardware);
+        bench_crc32c("crc32c_software", crc32c_software);
+        bench_checksum_reads();
+    }
+    if (should_run(argc, argv, "stripe")) {
+        bench_striped_files(1);
+        bench_striped_files(2);
+        bench_striped_files(4);
+    }
+    if (should_run(argc, argv, "direct")) {
+        direct_io = true;
+        bench_striped_files(1);
+        bench_striped_files(4);
+        direct_io = false;
+    }
+    if (should_run(argc, argv, "defrag")) bench_defrag();
+    if (should_run(argc, argv, "durability")) {
+        for (int mode = 0; mode < NUM_DURABILITY_MODES; mode++) bench_durability(mode);
+    }
+    if (should_run(argc, argv, "walk")) {
+        bench_walk(1);
+        bench_walk(2);
+        bench_walk(4);
+    }
+    if (should_run(argc, argv, "import")) bench_import();
+    if (should_run(argc, argv, "export")) bench_export();
+    if (should_run(argc, argv, "send")) bench_send();
+    if (should_run(argc, argv, "tails")) {
+        bench_tail_packing(false);
+        bench_tail_packing(true);
+    }
+
+    printf("\n  ]\n}\n");
+
+    remove(DEFAULT_DISK_NAME);
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,475 @@
+//
+// Replays a workload log written by the shell's 'record' command against a fresh image, or a copy of an existing
+// one, in a temporary directory and reports throughput and latencies as JSON on stdout.
+//
+// Usage: nanofs_replay <log> [--timed] [--threads <n>] [--image <disk>] [--host-dir <directory>]
+// --timed issues every command at its recorded offset from the start of the log, otherwise commands run back to back
+// --threads spreads the commands over worker threads. Commands that work in the same directory stay on the same
+//   thread in their recorded order, every other command runs on its own once all commands before it are done
+// --image copies the given disk and its member files instead of starting from an empty disk
+// --host-dir is where relative host paths that commands read from are found, by default the directory the shell
+//   was recorded in, as noted in the log
+//
+// Host files that commands read (save, import, receive) are taken from the temporary directory when the replay
+// wrote them itself, and from the host directory otherwise. Host files that commands write (open, export, send)
+// always go to the temporary directory. Commands still run one at a time like in the shell, latencies include the
+// time spent waiting for another thread's command
+//
+
+#define NANOFS_NO_MAIN
+#include "../main.c"
+
+#include <limits.h>
+
+#define MAX_REPLAY_PATH 4096
+
+struct replay_command {
+    uint64_t offset_ns; // From the start of the recording
+    int recorded_result;
+    char* line;
+    char* directory; // The shell's cwd when the command ran, as a path from the root
+    int worker; // -1 for commands that run on their own
+    int result;
+    uint64_t latency_ns;
+};
+
+struct replay_state {
+    struct replay_command* commands;
+    const char* host_directory; // Relative host paths that commands read from are resolved against it, "" if unknown
+    int first, last; // The commands of the phase being replayed
+    bool timed;
+    uint64_t start_ns; // When the first command of the log was issued
+    uint64_t first_offset_ns;
+    pthread_mutex_t lock; // Held while a command runs
+};
+
+struct replay_worker {
+    struct replay_state* state;
+    int id;
+};
+
+// Joins path onto directory and resolves . and .., the result has no leading or trailing /
+void join_path(const char* directory, const char* path, char* destination) {
+    char joined[2 * MAX_REPLAY_PATH];
+    snprintf(joined, sizeof(joined), "%s/%s", directory, path);
+
+    size_t length = 0;
+    destination[0] = '\0';
+    for (char* name = strtok(joined, "/"); name; name = strtok(nullptr, "/")) {
+        if (strcmp(name, ".") == 0) continue;
+
+        if (strcmp(name, "..") == 0) {
+            // The root is its own parent
+            char* last = strrchr(destination, '/');
+            length = last ? (size_t) (last - destination) : 0;
+            destination[length] = '\0';
+            continue;
+        }
+
+        length += snprintf(destination + length, MAX_REPLAY_PATH - length, "%s%s", length ? "/" : "", name);
+        if (length >= MAX_REPLAY_PATH) length = MAX_REPLAY_PATH - 1;
+    }
+}
+
+// Which argument names the file a command works on, 0 for commands that work on the cwd itself
+// Returns -1 for commands that may touch more than one directory
+int get_path_argument(const char* command) {
+    if (strcmp(command, "ls") == 0) return 0;
+    if (strcmp(command, "save") == 0) return 2;
+
+    const char* const commands[] = {"create", "write", "append", "truncate", "read", "open", "rm", "cd"};
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strcmp(command, commands[i]) == 0) return 1;
+    }
+
+    return -1;
+}
+
+// 32-bit FNV-1a
+uint32_t hash_directory(const char* directory) {
+    uint32_t hash = 2166136261u;
+    for (; *directory; directory++) hash = (hash ^ (uint8_t) *directory) * 16777619u;
+    return hash;
+}
+
+// Which argument names a host file the command reads, 0 if it doesn't read one
+int get_host_input_argument(const char* command) {
+    if (strcmp(command, "save") == 0 || strcmp(command, "import") == 0 || strcmp(command, "receive") == 0) return 1;
+    return 0;
+}
+
+// Reads the log, following cd to know the directory every command ran in
+// The host directory noted in the log's header is copied to host_directory, which is left alone if there is none
+// Returns the number of commands, or -1 if the log can't be read
+int load_log(const char* log_name, const int num_workers, struct replay_command** destination, char* host_directory) {
+    FILE* log = fopen(log_name, "r");
+    if (!log) {
+        fprintf(stderr, "Could not open workload log %s\n", log_name);
+        return -1;
+    }
+
+    int num_commands = 0, capacity = 1024;
+    struct replay_command* commands = malloc(capacity * sizeof(struct replay_command));
+    char cwd[MAX_REPLAY_PATH] = "";
+
+    char* buffer = nullptr;
+    size_t buffer_size = 0;
+    ssize_t length;
+    while ((length = getline(&buffer, &buffer_size, log)) != -1) {
+        if (length > 0 && buffer[length - 1] == '\n') buffer[length - 1] = '\0';
+        if (strncmp(buffer, "# host_directory ", 17) == 0) {
+            snprintf(host_directory, PATH_MAX, "%s", buffer + 17);
+            continue;
+        }
+        if (buffer[0] == '#' || buffer[0] == '\0') continue;
+
+        unsigned long long offset_ns, latency_ns;
+        int recorded_result, consumed;
+        if (sscanf(buffer, "%llu %llu %d %n", &offset_ns, &latency_ns, &recorded_result, &consumed) != 3) {
+            fprintf(stderr, "Skipping malformed line in %s: %s\n", log_name, buffer);
+            continue;
+        }
+
+        char line[MAX_ARGS * MAX_ARG_LEN];
+        snprintf(line, sizeof(line), "%s", buffer + consumed);
+        char args[MAX_ARGS][MAX_ARG_LEN + 1];
+        const int argc = split_command_line(line, args);
+        if (argc == 0 || strcmp(args[0], "exit") == 0 || strcmp(args[0], "record") == 0) continue;
+
+        if (num_commands == capacity) {
+            capacity *= 2;
+            commands = realloc(commands, capacity * sizeof(struct replay_command));
+        }
+        auto command = &commands[num_commands++];
+        *command = (struct replay_command) {offset_ns, recorded_result, strdup(buffer + consumed), strdup(cwd), -1};
+
+        // Commands are kept together by the directory they change or list
+        const int path_argument = get_path_argument(args[0]);
+        if (path_argument != -1) {
+            char directory[MAX_REPLAY_PATH];
+            join_path(cwd, path_argument > 0 && path_argument < argc ? args[path_argument] : ".", directory);
+            if (path_argument > 0) {
+                char* last = strrchr(directory, '/');
+                *(last ? last : directory) = '\0';
+            }
+            command->worker = (int) (hash_directory(directory) % num_workers);
+        }
+
+        if (strcmp(args[0], "cd") == 0 && argc > 1 && recorded_result == 0) {
+            char directory[MAX_REPLAY_PATH];
+            join_path(cwd, args[1], directory);
+            strcpy(cwd, directory);
+        } else if (strcmp(args[0], "init") == 0) {
+            cwd[0] = '\0';
+        }
+    }
+
+    free(buffer);
+    fclose(log);
+    *destination = commands;
+    return num_commands;
+}
+
+void run_replay_command(struct replay_state* state, struct replay_command* command) {
+    // Commands that are late are timed from when they should have been issued, like a client would see them
+    uint64_t issue_ns = monotonic_now_ns();
+    if (state->timed) {
+        const uint64_t scheduled_ns = state->start_ns + command->offset_ns - state->first_offset_ns;
+        if (issue_ns < scheduled_ns) {
+            const struct timespec time = {scheduled_ns / 1000000000ull, scheduled_ns % 1000000000ull};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, nullptr) != 0) {}
+            issue_ns = monotonic_now_ns();
+        } else {
+            issue_ns = scheduled_ns;
+        }
+    }
+
+    pthread_mutex_lock(&state->lock);
+
+    // Finding the command's directory isn't part of the command
+    const uint64_t resolve_start_ns = monotonic_now_ns();
+    current_working_directory = 0;
+    int directory;
+    if (command->directory[0] && strlen(command->directory) < MAX_PATH_LEN &&
+        get_inode_number_of_path(command->directory, TYPE_DIRECTORY, &directory) == 0) {
+        current_working_directory = directory;
+    }
+    const uint64_t resolve_ns = monotonic_now_ns() - resolve_start_ns;
+
+    char line[MAX_ARGS * MAX_ARG_LEN];
+    snprintf(line, sizeof(line), "%s", command->line);
+    char args[MAX_ARGS][MAX_ARG_LEN + 1];
+    const int argc = split_command_line(line, args);
+
+    // A relative host file the replay didn't write itself is read from where the shell ran
+    const int input_argument = argc > 0 ? get_host_input_argument(args[0]) : 0;
+    if (input_argument > 0 && input_argument < argc && state->host_directory[0] && args[input_argument][0] != '/' &&
+        access(args[input_argument], F_OK) != 0) {
+        char resolved[PATH_MAX + MAX_ARG_LEN + 2];
+        const int length = snprintf(resolved, sizeof(resolved), "%s/%s", state->host_directory, args[input_argument]);
+        if (length <= MAX_ARG_LEN) strcpy(args[input_argument], resolved);
+    }
+
+    command->result = run_shell_command(argc, args, DEFAULT_DISK_NAME);
+
+    pthread_mutex_unlock(&state->lock);
+    command->latency_ns = monotonic_now_ns() - issue_ns - resolve_ns;
+}
+
+void* run_replay_worker(void* argument) {
+    const struct replay_worker* worker = argument;
+    const auto state = worker->state;
+
+    for (int i = state->first; i < state->last; i++) {
+        if (state->commands[i].worker == worker->id) run_replay_command(state, &state->commands[i]);
+    }
+
+    return nullptr;
+}
+
+// Runs the log in phases, the commands between two commands that run on their own are spread over the workers
+void replay(struct replay_state* state, const int num_commands, const int num_workers) {
+    for (int first = 0; first < num_commands;) {
+        if (state->commands[first].worker == -1) {
+            run_replay_command(state, &state->commands[first++]);
+            continue;
+        }
+
+        int last = first;
+        while (last < num_commands && state->commands[last].worker != -1) last++;
+        state->first = first;
+        state->last = last;
+
+        pthread_t threads[MAX_WORKER_THREADS];
+        struct replay_worker workers[MAX_WORKER_THREADS];
+        bool started[MAX_WORKER_THREADS] = {false};
+        for (int i = 1; i < num_workers; i++) {
+            workers[i] = (struct replay_worker) {state, i};
+            started[i] = pthread_create(&threads[i], nullptr, run_replay_worker, &workers[i]) == 0;
+        }
+        workers[0] = (struct replay_worker) {state, 0};
+        run_replay_worker(&workers[0]);
+        for (int i = 1; i < num_workers; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], nullptr);
+            } else {
+                // The commands of a worker that failed to start are replayed here, still in order
+                run_replay_worker(&workers[i]);
+            }
+        }
+
+        first = last;
+    }
+}
+
+int copy_file(const char* source, const char* destination) {
+    FILE* input = fopen(source, "rb");
+    FILE* output = input ? fopen(destination, "wb") : nullptr;
+    bool copied = input && output;
+
+    char buffer[65536];
+    size_t size;
+    while (copied && (size = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        copied = fwrite(buffer, 1, size, output) == size;
+    }
+    if (input) copied = copied && !ferror(input);
+
+    if (input) fclose(input);
+    if (output && fclose(output) != 0) copied = false;
+    return copied ? 0 : -1;
+}
+
+// Copies every member file of the disk into the current directory under the default disk name
+int copy_image(const char* disk_name) {
+    struct superblock source;
+    if (get_superblock(disk_name, &source) != 0) {
+        fprintf(stderr, "Could not load disk %s\n", disk_name);
+        return -1;
+    }
+
+    for (int member = 0; member < source.stripe_members; member++) {
+        char source_name[PATH_MAX + 16], destination_name[PATH_MAX + 16];
+        get_member_file_name(disk_name, member, source_name, sizeof(source_name));
+        get_member_file_name(DEFAULT_DISK_NAME, member, destination_name, sizeof(destination_name));
+        if (copy_file(source_name, destination_name) != 0) {
+            fprintf(stderr, "Could not copy %s\n", source_name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    const auto x = *(const uint64_t*) a;
+    const auto y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// latencies must be sorted
+void print_latencies(const uint64_t* latencies, const int count) {
+    const double fractions[] = {0.50, 0.90, 0.99, 0.999};
+    const char* const names[] = {"p50", "p90", "p99", "p999"};
+
+    printf("{");
+    for (int i = 0; i < 4; i++) {
+        auto index = (int) (fractions[i] * count);
+        if (index >= count) index = count - 1;
+        printf("\"%s\": %llu, ", names[i], (unsigned long long) latencies[index]);
+    }
+    printf("\"max\": %llu}", (unsigned long long) latencies[count - 1]);
+}
+
+void report(const char* log_name, const struct replay_command* commands, const int num_commands,
+    const struct replay_state* state, const int num_workers, const char* image, const uint64_t elapsed_ns) {
+    int failed = 0, diverged = 0;
+    uint64_t* latencies = malloc(MAX(1, num_commands) * sizeof(uint64_t));
+    for (int i = 0; i < num_commands; i++) {
+        if (commands[i].result != 0) failed++;
+        if (commands[i].result != commands[i].recorded_result) diverged++;
+        latencies[i] = commands[i].latency_ns;
+    }
+
+    const double seconds = (double) elapsed_ns / 1e9;
+    const double recorded_seconds = num_commands > 0
+        ? (double) (commands[num_commands - 1].offset_ns - commands[0].offset_ns) / 1e9 : 0;
+    printf("{\n  \"log\": \"%s\",\n  \"timing\": \"%s\",\n  \"threads\": %d,\n  \"image\": \"%s\",\n", log_name,
+        state->timed ? "recorded" : "fast", num_workers, image ? image : "fresh");
+    printf("  \"commands\": %d,\n  \"failed\": %d,\n  \"diverged\": %d,\n", num_commands, failed, diverged);
+    printf("  \"recorded_seconds\": %.6f,\n  \"elapsed_seconds\": %.6f,\n  \"ops_per_sec\": %.1f", recorded_seconds,
+        seconds, seconds > 0 ? num_commands / seconds : 0);
+
+    if (num_commands > 0) {
+        qsort(latencies, num_commands, sizeof(uint64_t), compare_latencies);
+        printf(",\n  \"latency_ns\": ");
+        print_latencies(latencies, num_commands);
+    }
+
+    // Every command name gets its own distribution, in order of first appearance
+    printf(",\n  \"by_command\": [");
+    bool* reported = calloc(MAX(1, num_commands), sizeof(bool));
+    bool first_name = true;
+    for (int i = 0; i < num_commands; i++) {
+        if (reported[i]) continue;
+
+        char name[MAX_ARG_LEN + 1];
+        sscanf(commands[i].line, "%252s", name);
+        int count = 0;
+        for (int j = i; j < num_commands; j++) {
+            char other[MAX_ARG_LEN + 1];
+            sscanf(commands[j].line, "%252s", other);
+            if (strcmp(name, other) != 0) continue;
+
+            reported[j] = true;
+            latencies[count++] = commands[j].latency_ns;
+        }
+
+        qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"latency_ns\": ", first_name ? "" : ",", name, count);
+        print_latencies(latencies, count);
+        printf("}");
+        first_name = false;
+    }
+    printf("\n  ]\n}\n");
+
+    free(reported);
+    free(latencies);
+}
+
+int main(const int argc, char const *argv[]) {
+    const char* log_argument = nullptr;
+    const char* image_argument = nullptr;
+    const char* host_directory_argument = nullptr;
+    bool timed = false;
+    int num_workers = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--timed") == 0) {
+            timed = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+            num_workers = MAX(1, MIN(num_workers, MAX_WORKER_THREADS));
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_argument = argv[++i];
+        } else if (strcmp(argv[i], "--host-dir") == 0 && i + 1 < argc) {
+            host_directory_argument = argv[++i];
+        } else if (!log_argument) {
+            log_argument = argv[i];
+        }
+    }
+    if (!log_argument) {
+        fprintf(stderr,
+            "Usage: nanofs_replay <log> [--timed] [--threads <n>] [--image <disk>] [--host-dir <directory>]\n");
+        return 1;
+    }
+
+    struct replay_command* commands;
+    char host_directory[PATH_MAX] = "";
+    const int num_commands = load_log(log_argument, num_workers, &commands, host_directory);
+    if (num_commands < 0) return 1;
+
+    // The option wins over the log, it is made absolute before the replay moves to the temporary directory
+    if (host_directory_argument && !realpath(host_directory_argument, host_directory)) {
+        fprintf(stderr, "Could not find host directory %s\n", host_directory_argument);
+        return 1;
+    }
+
+    char image[PATH_MAX];
+    if (image_argument && !realpath(image_argument, image)) {
+        fprintf(stderr, "Could not find disk %s\n", image_argument);
+        return 1;
+    }
+
+    // Never touch an image in the current directory
+    char directory[] = "/tmp/nanofs_replay_XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) != 0) {
+        fprintf(stderr, "Failed to create temporary directory for the replay\n");
+        return 1;
+    }
+
+    bool ready;
+    if (image_argument) {
+        ready = copy_image(image) == 0 && load_disk(DEFAULT_DISK_NAME) == 0;
+    } else {
+        ready = run_command_init(DEFAULT_DISK_NAME, 1, 1) == 0;
+    }
+    arena_reset();
+    reset_io_stats();
+
+    struct replay_state state = {commands, host_directory, 0, 0, timed, 0, num_commands > 0 ? commands[0].offset_ns : 0,
+        PTHREAD_MUTEX_INITIALIZER};
+    uint64_t elapsed_ns = 0;
+    if (ready) {
+        // Only the report goes to stdout, whatever the commands print is dropped
+        fflush(stdout);
+        const int saved_stdout = dup(STDOUT_FILENO);
+        const int null_output = open("/dev/null", O_WRONLY);
+        if (null_output != -1) dup2(null_output, STDOUT_FILENO);
+
+        state.start_ns = monotonic_now_ns();
+        replay(&state, num_commands, num_workers);
+        elapsed_ns = monotonic_now_ns() - state.start_ns;
+
+        fflush(stdout);
+        if (saved_stdout != -1) dup2(saved_stdout, STDOUT_FILENO);
+        if (null_output != -1) close(null_output);
+        if (saved_stdout != -1) close(saved_stdout);
+
+        report(log_argument, commands, num_commands, &state, num_workers, image_argument, elapsed_ns);
+    } else {
+        fprintf(stderr, "Could not prepare the disk for the replay\n");
+    }
+
+    for (int member = 0; member < MAX_STRIPE_MEMBERS; member++) {
+        char name[64];
+        get_member_file_name(DEFAULT_DISK_NAME, member, name, sizeof(name));
+        remove(name);
+    }
+    rmdir(directory);
+
+    for (int i = 0; i < num_commands; i++) {
+        free(commands[i].line);
+        free(commands[i].directory);
+    }
+    free(commands);
+    return ready ? 0 : 1;
+}
@@ -1,30 +1,60 @@
+// O_DIRECT and statx are Linux extensions
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
 
 #include "system_structures.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // DISK STRUCTURE
-// Superblock -> inodes -> free space bitmap -> data blocks
+// Superblock -> inodes -> free space bitmap -> block info -> data blocks
 
 #define DEFAULT_SIZE 1048576    // 1MB
 #define DEFAULT_BLOCK_SIZE 1024 // 1KB
 #define DEFAULT_INODE_COUNT (DEFAULT_SIZE / 4096) // 1 inode / 4KB (256 inodes default)
 #define DEFAULT_DISK_NAME "nanofs_disk"
+#define IO_BUFFER_ALIGNMENT 4096 // A multiple of the sector size of any device, the data region starts on one too
+#define MAX_FILE_SIZE (NUM_BLOCK_POINTERS * DEFAULT_BLOCK_SIZE)
 
 /* DEFAULTS:
- * INODE_TABLE_START:  0x14
- * FREE_BITMAP_START:  0x3c14
- * DATA_START:         0x3c92
+ * INODE_TABLE_START:  0x24
+ * FREE_BITMAP_START:  0x2824
+ * BLOCK_INFO_START:   0x28a0
+ * DATA_START:         0x7000
  * DENTRIES_PER_BLOCK: 4
  */
 
 #define MAX_ARGS 5
 #define MAX_ARG_LEN 252
+#define MAX_PATH_LEN (MAX_ARG_LEN - 3) // Size of the buffer a path is looked up in, terminator included
+
+#define MAX_WORKER_THREADS 16
 
 
 // Keeps track of the inode representing the current working directory
@@ -37,7 +67,259 @@ bool verbose = false;
 bool superblock_loaded = false;
 struct superblock superblock;
 
+// In-memory index of content hash -> data block, built from the block info region
+// Only populated while deduplication is enabled
+struct dedup_entry {
+    uint32_t hash;
+    int32_t block_number; // DEDUP_ENTRY_EMPTY or DEDUP_ENTRY_DELETED if the slot holds no block
+};
+
+#define DEDUP_ENTRY_EMPTY (-1)
+#define DEDUP_ENTRY_DELETED (-2)
+
+struct dedup_entry* dedup_index = nullptr;
+uint32_t dedup_index_capacity = 0; // Always a power of 2
+
+// I/O ACCOUNTING
+// Every open, seek, read and write of the disk is counted, both in total and for the running command
+// Seeks, reads and writes are attributed to the region of the disk they start in
+
+enum io_region {
+    IO_REGION_SUPERBLOCK,
+    IO_REGION_INODE_TABLE,
+    IO_REGION_FREE_BITMAP,
+    IO_REGION_BLOCK_INFO,
+    IO_REGION_DATA,
+    NUM_IO_REGIONS
+};
+
+const char* const IO_REGION_NAMES[NUM_IO_REGIONS] = {
+    "superblock", "inode table", "free bitmap", "block info", "data"
+};
+
+struct io_region_stats {
+    uint64_t seeks, reads, writes, bytes_read, bytes_written;
+};
+
+struct io_stats {
+    uint64_t opens;
+    struct io_region_stats regions[NUM_IO_REGIONS];
+};
+
+#define MAX_TRACKED_COMMANDS 32
+
+struct command_io_stats {
+    char command[16];
+    struct io_stats stats;
+};
+
+struct io_stats total_io_stats;
+struct command_io_stats command_io_stats[MAX_TRACKED_COMMANDS];
+int num_tracked_commands = 0;
+
+// Stats of the command currently being run, nullptr outside of commands
+struct io_stats* current_command_io_stats = nullptr;
+
+// Offset in the disk that the next sequential read or write will happen at
+uint32_t disk_position = 0;
+
+// Set by every write, cleared once the writes are synced and once the command is over
+bool unsynced_writes = false;
+bool command_wrote = false;
+
+enum io_region get_io_region(const uint32_t location) {
+    if (location < INODE_TABLE_START) return IO_REGION_SUPERBLOCK;
+    if (location < FREE_BITMAP_START) return IO_REGION_INODE_TABLE;
+    if (location < BLOCK_INFO_START) return IO_REGION_FREE_BITMAP;
+    if (location < DATA_START) return IO_REGION_BLOCK_INFO;
+    return IO_REGION_DATA;
+}
+
+void count_disk_seek(const uint32_t location) {
+    const auto region = get_io_region(location);
+    total_io_stats.regions[region].seeks++;
+    if (current_command_io_stats) current_command_io_stats->regions[region].seeks++;
+}
+
+void count_disk_transfer(const uint32_t location, const size_t size, const bool is_write) {
+    const auto region = get_io_region(location);
+    struct io_region_stats* stats[] = {
+        &total_io_stats.regions[region],
+        current_command_io_stats ? &current_command_io_stats->regions[region] : nullptr
+    };
+
+    if (is_write) unsynced_writes = command_wrote = true;
+
+    for (int i = 0; i < 2 && stats[i]; i++) {
+        if (is_write) {
+            stats[i]->writes++;
+            stats[i]->bytes_written += size;
+        } else {
+            stats[i]->reads++;
+            stats[i]->bytes_read += size;
+        }
+    }
+}
+
+// Selects the stats entry for the given command, creating it on first use
+void start_command_io_stats(const char* command) {
+    current_command_io_stats = nullptr;
+
+    for (int i = 0; i < num_tracked_commands; i++) {
+        if (strncmp(command_io_stats[i].command, command, sizeof(command_io_stats[i].command) - 1) == 0) {
+            current_command_io_stats = &command_io_stats[i].stats;
+            return;
+        }
+    }
+
+    if (num_tracked_commands == MAX_TRACKED_COMMANDS) return;
+
+    auto entry = &command_io_stats[num_tracked_commands++];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->command, command, sizeof(entry->command) - 1);
+    current_command_io_stats = &entry->stats;
+}
+
+void reset_io_stats() {
+    memset(&total_io_stats, 0, sizeof(total_io_stats));
+    num_tracked_commands = 0;
+    current_command_io_stats = nullptr;
+}
+
+FILE* open_disk(const char* disk_name, const char* mode) {
+    total_io_stats.opens++;
+    if (current_command_io_stats) current_command_io_stats->opens++;
+
+    disk_position = 0;
+    return fopen(disk_name, mode);
+}
+
+// TRACING
+// When compiled with NANOFS_TRACE, timed spans are recorded into a ring buffer while tracing is on
+// The ring can be dumped as Chrome trace JSON, and every command's latency goes into a log2 histogram
+// Without NANOFS_TRACE the TRACE_* macros expand to nothing
+
+#ifdef NANOFS_TRACE
+
+#define TRACE_RING_SIZE 16384 // Must be a power of 2
+#define NUM_LATENCY_BUCKETS 64
+
+struct trace_event {
+    char name[24];
+    const char* category;
+    uint64_t start_ns, duration_ns;
+    uint32_t thread_id;
+};
+
+struct trace_span {
+    const char* name;
+    const char* category;
+    uint64_t start_ns; // 0 if tracing was off when the span began
+};
+
+struct latency_histogram {
+    char command[16];
+    uint64_t count;
+    uint64_t buckets[NUM_LATENCY_BUCKETS]; // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+};
+
+bool tracing_enabled = false;
+
+struct trace_event trace_ring[TRACE_RING_SIZE];
+_Atomic uint64_t trace_next_event = 0;
+
+struct latency_histogram latency_histograms[MAX_TRACKED_COMMANDS];
+int num_latency_histograms = 0;
+
+_Atomic uint32_t trace_next_thread_id = 1;
+thread_local uint32_t trace_thread_id = 0;
+
+uint64_t trace_now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+void record_trace_event(const char* name, const char* category, const uint64_t start_ns, const uint64_t duration_ns) {
+    if (trace_thread_id == 0) trace_thread_id = atomic_fetch_add(&trace_next_thread_id, 1);
+
+    const auto index = atomic_fetch_add_explicit(&trace_next_event, 1, memory_order_relaxed);
+    auto event = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+    strncpy(event->name, name, sizeof(event->name) - 1);
+    event->name[sizeof(event->name) - 1] = '\0';
+    event->category = category;
+    event->start_ns = start_ns;
+    event->duration_ns = duration_ns;
+    event->thread_id = trace_thread_id;
+}
+
+void record_command_latency(const char* command, const uint64_t duration_ns) {
+    struct latency_histogram* histogram = nullptr;
+    for (int i = 0; i < num_latency_histograms && !histogram; i++) {
+        if (strncmp(latency_histograms[i].command, command, sizeof(histogram->command) - 1) == 0) {
+            histogram = &latency_histograms[i];
+        }
+    }
+
+    if (!histogram) {
+        if (num_latency_histograms == MAX_TRACKED_COMMANDS) return;
+
+        histogram = &latency_histograms[num_latency_histograms++];
+        memset(histogram, 0, sizeof(*histogram));
+        strncpy(histogram->command, command, sizeof(histogram->command) - 1);
+    }
+
+    histogram->count++;
+    histogram->buckets[63 - __builtin_clzll(duration_ns | 1)]++;
+}
+
+struct trace_span trace_span_begin(const char* name, const char* category) {
+    return (struct trace_span) {name, category, tracing_enabled ? trace_now_ns() : 0};
+}
+
+void trace_span_end(const struct trace_span* span) {
+    if (span->start_ns == 0) return;
+    record_trace_event(span->name, span->category, span->start_ns, trace_now_ns() - span->start_ns);
+}
+
+void trace_command_end(const struct trace_span* span) {
+    if (span->start_ns == 0) return;
+
+    const auto duration_ns = trace_now_ns() - span->start_ns;
+    record_trace_event(span->name, span->category, span->start_ns, duration_ns);
+    record_command_latency(span->name, duration_ns);
+}
+
+// Times everything from this point to the end of the enclosing scope
+#define TRACE_SCOPE(name, category) \
+    const struct trace_span trace_span_ __attribute__((cleanup(trace_span_end))) = trace_span_begin(name, category)
+#define TRACE_COMMAND_SCOPE(command) \
+    const struct trace_span trace_span_ __attribute__((cleanup(trace_command_end))) = trace_span_begin(command, "command")
+
+#else
+
+#define TRACE_SCOPE(name, category)
+#define TRACE_COMMAND_SCOPE(command)
+
+#endif //NANOFS_TRACE
+
+int disk_seek(FILE* disk, const uint32_t location) {
+    count_disk_seek(location);
+
+    if (fseek(disk, (long) location, SEEK_SET) != 0) {
+        printf("Error: failed to seek to position %u.\n", location);
+        return -1;
+    }
+
+    disk_position = location;
+    return 0;
+}
+
 int disk_read(FILE* disk, void* buffer, const size_t size) {
+    count_disk_transfer(disk_position, size, false);
+    disk_position += size;
+
     const auto bytes_read = fread(buffer, 1, size, disk);
     if (bytes_read != size) {
         printf("Error: failed to read %zu byte(s) (read %zu).\n", size, bytes_read);
@@ -48,15 +330,15 @@ int disk_read(FILE* disk, void* buffer, const size_t size) {
 }
 
 int disk_read_at(FILE* disk, const uint32_t location, void* buffer, const size_t size) {
-    if (fseek(disk, (long) location, SEEK_SET) != 0) {
-        printf("Error: failed to seek to position %u.\n", location);
-        return -1;
-    }
+    if (disk_seek(disk, location) != 0) return -1;
 
     return disk_read(disk, buffer, size);
 }
 
 int disk_write(FILE* disk, const void* data, const size_t size) {
+    count_disk_transfer(disk_position, size, true);
+    disk_position += size;
+
     const auto bytes_written = fwrite(data, 1, size, disk);
     if (bytes_written != size) {
         printf("Error: failed to write %zu byte(s) (wrote %zu).\n", size, bytes_written);
@@ -67,1011 +349,6236 @@ int disk_write(FILE* disk, const void* data, const size_t size) {
 }
 
 int disk_write_at(FILE* disk, const uint32_t location, const void* data, const size_t size) {
-    if (fseek(disk, (long) location, SEEK_SET) != 0) {
-        printf("Error: failed to seek to position %u.\n", location);
-        return -1;
-    }
+    if (disk_seek(disk, location) != 0) return -1;
 
     return disk_write(disk, data, size);
 }
 
-// Returns -1 if the given disk does not exist
-int get_superblock(const char* disk, struct superblock* destination) {
-    FILE* file = fopen(disk, "r");
-    if (!file) {
-        return -1;
+// CHECKSUMS
+// The superblock and every inode carry a CRC32C of their fields, data blocks have theirs in the block info region
+// CRC32C uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them, and slicing-by-8 tables otherwise
+// A stored checksum of 0 means none was recorded, so blocks and inodes that were never written aren't verified
+
+enum checksum_policy {
+    CHECKSUM_VERIFY_OFF, // Checksums are kept up to date but never checked
+    CHECKSUM_VERIFY_WARN, // Mismatches are reported, the data is used anyway
+    CHECKSUM_VERIFY_STRICT, // Mismatches are reported and the read fails
+    NUM_CHECKSUM_POLICIES
+};
+
+const char* const CHECKSUM_POLICY_NAMES[NUM_CHECKSUM_POLICIES] = {"off", "warn", "strict"};
+
+enum checksum_policy checksum_policy = CHECKSUM_VERIFY_STRICT;
+
+// Checksum of every data block, a copy of the block info region's so reads don't have to fetch it
+// nullptr until a disk is loaded
+uint32_t* block_checksums = nullptr;
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 // Reversed Castagnoli polynomial
+// The CRC instructions have a latency of several cycles, so the hardware versions work on three lanes at once
+// Three lanes cover all but the last 16 bytes of a 1KB block
+#define CRC32C_LANE_SIZE 336
+
+uint32_t crc32c_tables[8][256];
+uint32_t crc32c_lane_shift_tables[4][256];
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t size) = nullptr;
+
+// Slicing-by-8, every table lookup handles one of the 8 bytes in a word
+uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+
+        crc = crc32c_tables[7][word & 0xff] ^ crc32c_tables[6][(word >> 8) & 0xff] ^
+            crc32c_tables[5][(word >> 16) & 0xff] ^ crc32c_tables[4][(word >> 24) & 0xff] ^
+            crc32c_tables[3][(word >> 32) & 0xff] ^ crc32c_tables[2][(word >> 40) & 0xff] ^
+            crc32c_tables[1][(word >> 48) & 0xff] ^ crc32c_tables[0][word >> 56];
+        data += 8;
+        size -= 8;
     }
 
-    const auto result = disk_read_at(file, 0, destination, sizeof(struct superblock));
-    fclose(file);
-
-    if (result != 0) printf("Error reading superblock\n");
-
-    return result;
+    while (size-- > 0) crc = (crc >> 8) ^ crc32c_tables[0][(crc ^ *data++) & 0xff];
+    return crc;
 }
 
-int calculate_block_count(const int total_size, const int block_size, const int inode_count) {
-    const auto data_size = total_size - sizeof(struct superblock) - inode_count * sizeof(struct inode);
-    // Divide by block_size + 0.125 because every data block needs a corresponding bit in the bitmap
-    return floor((double) data_size / (block_size + 0.125));
+// Advances crc over CRC32C_LANE_SIZE zero bytes, which is what combining it with the next lane's CRC needs
+uint32_t crc32c_shift_lane(const uint32_t crc) {
+    return crc32c_lane_shift_tables[0][crc & 0xff] ^ crc32c_lane_shift_tables[1][(crc >> 8) & 0xff] ^
+        crc32c_lane_shift_tables[2][(crc >> 16) & 0xff] ^ crc32c_lane_shift_tables[3][crc >> 24];
 }
 
-// Calculates the disk structure based on the current superblock
-void calculate_disk_structure() {
-    constexpr uint32_t inode_table_start = sizeof(struct superblock);
-    const uint32_t free_bitmap_start = inode_table_start +
-        superblock.inode_count * superblock.inode_size;
-    const uint32_t data_start = free_bitmap_start + superblock.block_count / 8;
-    const uint8_t dentries_per_block = superblock.block_size / sizeof(struct dentry);
+uint64_t load_word(const uint8_t* data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
 
-    INODE_TABLE_START = inode_table_start;
-    FREE_BITMAP_START = free_bitmap_start;
-    DATA_START = data_start;
-    DENTRIES_PER_BLOCK = dentries_per_block;
+#if defined(__x86_64__)
 
-    superblock_loaded = true;
-}
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 3 * CRC32C_LANE_SIZE) {
+        uint64_t lanes[3] = {crc, 0, 0};
+        for (int i = 0; i < CRC32C_LANE_SIZE; i += 8) {
+            lanes[0] = _mm_crc32_u64(lanes[0], load_word(data + i));
+            lanes[1] = _mm_crc32_u64(lanes[1], load_word(data + CRC32C_LANE_SIZE + i));
+            lanes[2] = _mm_crc32_u64(lanes[2], load_word(data + 2 * CRC32C_LANE_SIZE + i));
+        }
 
-int write_data_to_block_disk(FILE* disk, const int block_number, const void *data, const size_t size) {
-    const auto location = DATA_START + block_number * DEFAULT_BLOCK_SIZE;
-    const auto result = disk_write_at(disk, location, data, size);
+        crc = crc32c_shift_lane(crc32c_shift_lane((uint32_t) lanes[0]) ^ (uint32_t) lanes[1]) ^ (uint32_t) lanes[2];
+        data += 3 * CRC32C_LANE_SIZE;
+        size -= 3 * CRC32C_LANE_SIZE;
+    }
 
-    if (result != 0) {
-        printf("File error: could not write to data block %d\n", block_number);
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
     }
 
-    return result;
+    crc = (uint32_t) crc64;
+    while (size-- > 0) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
 }
 
-int write_data_to_block(const int block_number, const void *data, const size_t size) {
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("File error: Failed to open disk\n");
-        return -1;
-    }
+bool crc32c_hardware_available() {
+    return __builtin_cpu_supports("sse4.2");
+}
 
-    const auto result = write_data_to_block_disk(disk, block_number, data, size);
+#elif defined(__aarch64__)
 
-    fclose(disk);
-    return result;
-}
+__attribute__((target("+crc")))
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 3 * CRC32C_LANE_SIZE) {
+        uint32_t lanes[3] = {crc, 0, 0};
+        for (int i = 0; i < CRC32C_LANE_SIZE; i += 8) {
+            lanes[0] = __crc32cd(lanes[0], load_word(data + i));
+            lanes[1] = __crc32cd(lanes[1], load_word(data + CRC32C_LANE_SIZE + i));
+            lanes[2] = __crc32cd(lanes[2], load_word(data + 2 * CRC32C_LANE_SIZE + i));
+        }
 
-int read_data_from_block_disk(FILE* disk, const int block_number, void* buffer, const size_t size) {
-    const auto location = DATA_START + block_number * DEFAULT_BLOCK_SIZE;
-    const auto result = disk_read_at(disk, location, buffer, size);
+        crc = crc32c_shift_lane(crc32c_shift_lane(lanes[0]) ^ lanes[1]) ^ lanes[2];
+        data += 3 * CRC32C_LANE_SIZE;
+        size -= 3 * CRC32C_LANE_SIZE;
+    }
 
-    if (result != 0) {
-        printf("File error: could not read data from data block %d\n", block_number);
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        size -= 8;
     }
 
-    return result;
+    while (size-- > 0) crc = __crc32cb(crc, *data++);
+    return crc;
 }
 
-int read_data_from_block(const int block_number, void* buffer, const size_t size) {
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("File error: Failed to open disk\n");
-        return -1;
-    }
+bool crc32c_hardware_available() {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
 
-    const auto result = read_data_from_block_disk(disk, block_number, buffer, size);
-    fclose(disk);
+#else
 
-    return result;
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+    return crc32c_software(crc, data, size);
 }
 
-int read_inode_disk(FILE* disk, const int inode_number, struct inode* destination) {
-    const uint32_t location = INODE_TABLE_START + inode_number * sizeof(struct inode);
-    const auto result = disk_read_at(disk, location, destination, sizeof(struct inode));
+bool crc32c_hardware_available() {
+    return false;
+}
 
-    if (result != 0) {
-        printf("File error: could not read inode %d\n", inode_number);
+#endif
+
+void init_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & -(crc & 1));
+        crc32c_tables[0][i] = crc;
     }
 
-    return result;
-}
+    // Table n gives the CRC of a byte followed by n zero bytes
+    for (int table = 1; table < 8; table++) {
+        for (int i = 0; i < 256; i++) {
+            const auto previous = crc32c_tables[table - 1][i];
+            crc32c_tables[table][i] = (previous >> 8) ^ crc32c_tables[0][previous & 0xff];
+        }
+    }
 
-int read_inode(const int inode_number, struct inode* destination) {
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("File error: Failed to open disk\n");
-        return -1;
+    // Advancing a CRC over zero bytes is linear, so it can be done one byte of the CRC at a time
+    constexpr uint8_t zeros[CRC32C_LANE_SIZE] = {0};
+    for (int byte = 0; byte < 4; byte++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            crc32c_lane_shift_tables[byte][i] = crc32c_software(i << (8 * byte), zeros, sizeof(zeros));
+        }
     }
 
-    const auto result = read_inode_disk(disk, inode_number, destination);
-    fclose(disk);
+    crc32c_update = crc32c_hardware_available() ? crc32c_hardware : crc32c_software;
+}
 
-    return result;
+uint32_t crc32c(const void* data, const size_t size) {
+    pthread_once(&crc32c_once, init_crc32c);
+    return ~crc32c_update(~0u, data, size);
 }
 
-int write_inode_disk(FILE* disk, const int inode_number, const struct inode* inode) {
-    const uint32_t location = INODE_TABLE_START + inode_number * sizeof(struct inode);
-    const auto result = disk_write_at(disk, location, inode, sizeof(struct inode));
+// CRC32C with 0 reserved to mean "no checksum"
+uint32_t compute_checksum(const void* data, const size_t size) {
+    const auto checksum = crc32c(data, size);
+    return checksum == 0 ? 1 : checksum;
+}
 
-    if (result != 0) {
-        printf("File error: could not write to inode %d\n", inode_number);
-    }
+// The checksums cover every field before them, but not the padding in front of them
+uint32_t superblock_checksum(const struct superblock* sb) {
+    return compute_checksum(sb, offsetof(struct superblock, stripe_unit) + sizeof(sb->stripe_unit));
+}
 
-    return result;
+uint32_t inode_checksum(const struct inode* inode) {
+    return compute_checksum(inode, offsetof(struct inode, is_used) + sizeof(inode->is_used));
 }
 
-int write_inode(const int inode_number, const struct inode* inode) {
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        return -1;
+// Reports a checksum mismatch in the given structure (number is -1 for the superblock)
+// Returns -1 if the policy says the read should fail
+int report_checksum_mismatch(const char* structure, const int number) {
+    if (number == -1) {
+        printf("Checksum error: %s is corrupt\n", structure);
+    } else {
+        printf("Checksum error: %s %d is corrupt\n", structure, number);
     }
-    
-    const uint32_t location = INODE_TABLE_START + inode_number * sizeof(struct inode);
-    const auto result = disk_write_at(disk, location, inode, sizeof(struct inode));
-    fclose(disk);
 
-    return result;
+    return checksum_policy == CHECKSUM_VERIFY_STRICT ? -1 : 0;
 }
 
-int set_data_block_status_disk(FILE* disk, const int block_number, const int status) {
-    const int byte = block_number / 8;
-    const int bit = block_number % 8;
-    const uint8_t mask = 128 >> bit;
+int verify_inode_checksum(const int inode_number, const struct inode* inode) {
+    if (checksum_policy == CHECKSUM_VERIFY_OFF || inode->checksum == 0) return 0;
+    if (inode_checksum(inode) == inode->checksum) return 0;
 
-    const auto location = FREE_BITMAP_START + byte;
-    uint8_t current_bitmap_byte;
+    return report_checksum_mismatch("inode", inode_number);
+}
+
+// Returns -1 if the given disk does not exist
+int get_superblock(const char* disk, struct superblock* destination) {
+    FILE* file = open_disk(disk, "r");
+    if (!file) {
+        return -1;
+    }
+
+    const auto result = disk_read_at(file, 0, destination, sizeof(struct superblock));
+    fclose(file);
 
-    auto result = disk_read_at(disk, location, &current_bitmap_byte, sizeof(current_bitmap_byte));
     if (result != 0) {
-        printf("File error: could not read byte %d of free bitmap table\n", byte);
+        printf("Error reading superblock\n");
         return result;
     }
 
-    if (status == DATA_BLOCK_USED) {
-        current_bitmap_byte |= mask;
-    } else {
-        current_bitmap_byte &= ~mask;
+    // The superblock is always checked, it says where everything else on the disk is
+    if (superblock_checksum(destination) != destination->checksum && report_checksum_mismatch("superblock", -1) != 0) {
+        return -2;
     }
 
-    result = disk_write_at(disk, location, &current_bitmap_byte, sizeof(current_bitmap_byte));
-    if (result != 0) {
-        printf("File error: could not write to byte %d of free bitmap table\n", byte);
-    }
+    return 0;
+}
+
+// Set when the free space summary changed in memory but not yet on disk
+// It is written once at the end of the command instead of after every allocation
+bool superblock_dirty = false;
+
+int write_superblock_disk(FILE* disk) {
+    superblock.checksum = superblock_checksum(&superblock);
+    const auto result = disk_write_at(disk, 0, &superblock, sizeof(struct superblock));
+    if (result != 0) printf("File error: could not write superblock to the disk\n");
+    else superblock_dirty = false;
 
     return result;
 }
 
-// Updates the free bitmap table to indicate if a certain block is used (1) or unused (0)
-int set_data_block_status(const int block_number, const int status) {
-    FILE *disk = fopen(DEFAULT_DISK_NAME, "r+b");
+int write_superblock() {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
     if (!disk) {
         printf("Error: Failed to open disk\n");
         return -1;
     }
-    
-    const auto result = set_data_block_status_disk(disk, block_number, status);
 
+    const auto result = write_superblock_disk(disk);
     fclose(disk);
+
     return result;
 }
 
-int find_next_free_data_block_disk(FILE* disk) {
-    const auto location = FREE_BITMAP_START;
-    const int num_bytes_to_check = superblock.block_size / 8;
-    constexpr uint8_t mask = 1 << 7;
+int calculate_block_count(const int total_size, const int block_size, const int inode_count) {
+    const auto data_size = total_size - sizeof(struct superblock) - inode_count * sizeof(struct inode);
+    // Every data block also needs a corresponding bit in the bitmap and an entry in the block info region
+    // Up to IO_BUFFER_ALIGNMENT bytes go to padding before the data region
+    const int block_count = floor((double) (data_size - IO_BUFFER_ALIGNMENT) / (block_size + 0.125 + sizeof(struct block_info)));
+    // The bitmap is made of whole bytes, so keep the count a multiple of 8
+    return block_count / 8 * 8;
+}
 
-    if (fseek(disk, (long) location, SEEK_SET) != 0) {
-        printf("File error: failed to seek to beginning of free bitmap table\n");
-        return -1;
-    }
-    uint8_t current_bitmap_byte;
-    for (int byte = 0; byte < num_bytes_to_check; byte++) {
-        if (disk_read(disk, &current_bitmap_byte, 1) != 0) {
-            printf("Failed to read byte %d of free bitmap table\n", byte);
-            return -1;
-        }
+// Calculates the disk structure based on the current superblock
+void calculate_disk_structure() {
+    constexpr uint32_t inode_table_start = sizeof(struct superblock);
+    const uint32_t free_bitmap_start = inode_table_start +
+        superblock.inode_count * superblock.inode_size;
+    const uint32_t block_info_start = free_bitmap_start + superblock.block_count / 8;
+    const uint32_t block_info_end = block_info_start + superblock.block_count * sizeof(struct block_info);
+    // Data blocks on member 0 start on a sector boundary, like those of the other members, so direct I/O can move
+    // them without padding and never shares a sector with the block info region
+    const uint32_t data_start = (block_info_end + IO_BUFFER_ALIGNMENT - 1) / IO_BUFFER_ALIGNMENT * IO_BUFFER_ALIGNMENT;
+    const uint8_t dentries_per_block = superblock.block_size / sizeof(struct dentry);
 
-        for (int bit = 0; bit < 8; bit++) {
-            if ((current_bitmap_byte & mask) == DATA_BLOCK_FREE) {
-                return byte * 8 + bit;
-            }
+    INODE_TABLE_START = inode_table_start;
+    FREE_BITMAP_START = free_bitmap_start;
+    BLOCK_INFO_START = block_info_start;
+    DATA_START = data_start;
+    DENTRIES_PER_BLOCK = dentries_per_block;
 
-            current_bitmap_byte <<= 1;
+    superblock_loaded = true;
+}
+
+// ARENA
+// Scratch memory for one command: dentry lists, bitmaps and tables sized by the disk. Allocations are carved out
+// of chunks in order and all given back at once after the command, the chunks are kept for the next command
+// Recursive code gives back what it used with arena_mark and arena_release
+// Only the main thread allocates from the arena
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    alignas(ARENA_ALIGNMENT) uint8_t data[];
+};
+
+struct arena_mark {
+    struct arena_chunk* chunk;
+    size_t used;
+};
+
+struct arena_chunk* arena_first = nullptr;
+struct arena_chunk* arena_current = nullptr;
+
+void* arena_alloc(const size_t size) {
+    const size_t aligned_size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    if (!arena_current || arena_current->size - arena_current->used < aligned_size) {
+        // Move on to the next chunk, or put a new one in front of it if it is too small
+        auto next = arena_current ? arena_current->next : arena_first;
+        if (!next || next->size < aligned_size) {
+            const size_t chunk_size = MAX(ARENA_CHUNK_SIZE, aligned_size);
+            struct arena_chunk* chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+            if (!chunk) return nullptr;
+
+            chunk->next = next;
+            chunk->size = chunk_size;
+            if (arena_current) {
+                arena_current->next = chunk;
+            } else {
+                arena_first = chunk;
+            }
+            next = chunk;
         }
+
+        next->used = 0;
+        arena_current = next;
     }
 
-    // No free data blocks exist
-    return -1;
+    void* memory = arena_current->data + arena_current->used;
+    arena_current->used += aligned_size;
+    return memory;
 }
 
-// Finds the first data block that is unused as specified by the bitmap
-// Returns -1 if no free data blocks exist
-int find_next_free_data_block() {
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        return -1;
-    }
+void* arena_calloc(const size_t count, const size_t size) {
+    void* memory = arena_alloc(count * size);
+    if (memory) memset(memory, 0, count * size);
+    return memory;
+}
 
-    const auto result = find_next_free_data_block_disk(disk);
+struct arena_mark arena_mark() {
+    return (struct arena_mark) {arena_current, arena_current ? arena_current->used : 0};
+}
 
-    fclose(disk);
-    return result;
+// Gives back everything allocated since the mark was taken
+void arena_release(const struct arena_mark mark) {
+    arena_current = mark.chunk;
+    if (arena_current) arena_current->used = mark.used;
 }
 
-// Finds the first inode that is not being used
+// Gives back everything, runs after every command
+void arena_reset() {
+    arena_current = nullptr;
+}
+
+// BUFFER POOL
+// Block buffers that are aligned well enough for O_DIRECT, big enough to pad one block out to whole sectors
+// Released buffers are kept for reuse, the pool is shared by every thread
+
+#define IO_BUFFER_SIZE (((DEFAULT_BLOCK_SIZE + IO_BUFFER_ALIGNMENT - 1) / IO_BUFFER_ALIGNMENT + 1) * IO_BUFFER_ALIGNMENT)
+#define MAX_POOLED_IO_BUFFERS 32
+
+struct io_buffer_pool {
+    pthread_mutex_t lock;
+    void* buffers[MAX_POOLED_IO_BUFFERS];
+    int num_buffers;
+};
+
+struct io_buffer_pool io_buffer_pool = {PTHREAD_MUTEX_INITIALIZER};
+
+void* acquire_io_buffer() {
+    void* buffer = nullptr;
+
+    pthread_mutex_lock(&io_buffer_pool.lock);
+    if (io_buffer_pool.num_buffers > 0) buffer = io_buffer_pool.buffers[--io_buffer_pool.num_buffers];
+    pthread_mutex_unlock(&io_buffer_pool.lock);
+
+    return buffer ? buffer : aligned_alloc(IO_BUFFER_ALIGNMENT, IO_BUFFER_SIZE);
+}
+
+void release_io_buffer(void* buffer) {
+    if (!buffer) return;
+
+    pthread_mutex_lock(&io_buffer_pool.lock);
+    if (io_buffer_pool.num_buffers < MAX_POOLED_IO_BUFFERS) {
+        io_buffer_pool.buffers[io_buffer_pool.num_buffers++] = buffer;
+        buffer = nullptr;
+    }
+    pthread_mutex_unlock(&io_buffer_pool.lock);
+
+    free(buffer);
+}
+
+void release_io_buffers(uint8_t** buffers, const int num_buffers) {
+    for (int i = 0; i < num_buffers; i++) release_io_buffer(buffers[i]);
+}
+
+// VOLUME
+// A volume is made of stripe_members image files. Member 0 is the disk itself and holds all of the metadata,
+// member n > 0 is the file "<disk>.<n>" and holds nothing but data blocks. Making the member files symlinks
+// puts them on different devices
+// Data blocks are dealt out to the members round robin, stripe_unit consecutive blocks at a time
+// Data blocks are read and written through one file descriptor per member, so every member can be kept busy
+// by its own thread. Each member has a long-lived worker fed through its own queue, started the first time a
+// batch spans several members and stopped when the volume is closed
+// With direct I/O on, the members are opened with O_DIRECT and data blocks bypass the host page cache. The
+// metadata regions are still read and written through the buffered disk
+
+#define MAX_STRIPE_MEMBERS 8
+
+struct volume_member {
+    int fd;
+    uint32_t data_start; // Offset of the member's first data block within its file
+    int block_count; // Number of data blocks stored on the member
+    uint32_t direct_alignment; // Sector size every direct transfer is padded to, 0 if the member isn't opened with O_DIRECT
+    uint32_t host_block_size; // Allocation unit of the host filesystem, the smallest hole it can punch
+};
+
+struct volume_member volume_members[MAX_STRIPE_MEMBERS];
+int num_open_members = 0; // 0 while no volume is open
+
+// Mount option, set with the 'direct' argument or command
+bool direct_io = false;
+
+struct block_location {
+    int member;
+    off_t offset; // Within the member's file
+};
+
+void get_member_file_name(const char* disk_name, const int member, char* destination, const size_t size) {
+    if (member == 0) {
+        snprintf(destination, size, "%s", disk_name);
+    } else {
+        snprintf(destination, size, "%s.%d", disk_name, member);
+    }
+}
+
+// Finds the member a data block is stored on and where in the member's file it is
+struct block_location locate_data_block(const int block_number) {
+    const int stripe = block_number / superblock.stripe_unit;
+    const int member = stripe % superblock.stripe_members;
+    const int block_in_member = stripe / superblock.stripe_members * superblock.stripe_unit +
+        block_number % superblock.stripe_unit;
+
+    return (struct block_location) {member,
+        volume_members[member].data_start + (off_t) block_in_member * superblock.block_size};
+}
+
+// Finds the data block stored at a position within a member's data blocks, the inverse of locate_data_block
+int get_data_block_number(const int member, const int block_in_member) {
+    const int stripe = block_in_member / superblock.stripe_unit * superblock.stripe_members + member;
+    return stripe * superblock.stripe_unit + block_in_member % superblock.stripe_unit;
+}
+
+int get_member_block_count(const int member) {
+    const int stripe_width = superblock.stripe_members * superblock.stripe_unit;
+
+    int block_count = 0;
+    for (int first_block = member * superblock.stripe_unit; first_block < superblock.block_count; first_block += stripe_width) {
+        block_count += MIN(superblock.stripe_unit, superblock.block_count - first_block);
+    }
+
+    return block_count;
+}
+
+// Every member's share of a batch is handed to the member's worker, the batch is done once remaining reaches 0
+struct member_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int remaining;
+};
+
+struct member_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signalled when a share is queued or the worker has to stop
+    struct member_queue* queue; // The share waiting to be worked through, nullptr while idle
+    bool started;
+    bool stop;
+};
+
+struct member_worker member_workers[MAX_STRIPE_MEMBERS];
+
+void stop_member_workers() {
+    for (int member = 0; member < MAX_STRIPE_MEMBERS; member++) {
+        auto worker = &member_workers[member];
+        if (!worker->started) continue;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = true;
+        pthread_cond_signal(&worker->changed);
+        pthread_mutex_unlock(&worker->lock);
+
+        pthread_join(worker->thread, nullptr);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->changed);
+        *worker = (struct member_worker) {};
+    }
+}
+
+void close_volume() {
+    // The workers may still hold the file descriptors
+    stop_member_workers();
+    for (int i = 0; i < num_open_members; i++) close(volume_members[i].fd);
+    num_open_members = 0;
+}
+
+// Finds the offset alignment O_DIRECT needs for an open file, falling back to one that suits any device
+uint32_t get_direct_io_alignment(const int fd) {
+#ifdef STATX_DIOALIGN
+    struct statx file_stat;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &file_stat) == 0 && (file_stat.stx_mask & STATX_DIOALIGN) &&
+        file_stat.stx_dio_offset_align > 0 && IO_BUFFER_ALIGNMENT % file_stat.stx_dio_offset_align == 0 &&
+        file_stat.stx_dio_mem_align > 0 && IO_BUFFER_ALIGNMENT % file_stat.stx_dio_mem_align == 0) {
+        return file_stat.stx_dio_offset_align;
+    }
+#endif
+
+    return IO_BUFFER_ALIGNMENT;
+}
+
+// Opens every member of the volume described by the superblock, with O_DIRECT if direct I/O is on
+int open_volume(const char* disk_name) {
+    close_volume();
+    if (superblock.stripe_members < 1 || superblock.stripe_members > MAX_STRIPE_MEMBERS || superblock.stripe_unit < 1) return -1;
+
+#ifdef O_DIRECT
+    const int flags = O_RDWR | (direct_io ? O_DIRECT : 0);
+#else
+    if (direct_io) {
+        printf("Error: Direct I/O is not supported on this platform\n");
+        return -1;
+    }
+    const int flags = O_RDWR;
+#endif
+
+    for (int member = 0; member < superblock.stripe_members; member++) {
+        char name[MAX_ARG_LEN + 8];
+        get_member_file_name(disk_name, member, name, sizeof(name));
+
+        const int fd = open(name, flags);
+        if (fd == -1) {
+            if (direct_io) {
+                printf("Error: Failed to open volume member %s for direct I/O\n", name);
+            } else {
+                printf("Error: Failed to open volume member %s\n", name);
+            }
+            close_volume();
+            return -1;
+        }
+
+        struct stat member_stat;
+        const uint32_t host_block_size = fstat(fd, &member_stat) == 0 && member_stat.st_blksize > 0
+            ? member_stat.st_blksize : DEFAULT_BLOCK_SIZE;
+
+        volume_members[member] = (struct volume_member) {fd, member == 0 ? DATA_START : 0, get_member_block_count(member),
+            direct_io ? get_direct_io_alignment(fd) : 0, host_block_size};
+        num_open_members++;
+    }
+
+    return 0;
+}
+
+// Returns the number of bytes transferred, which is only less than size if a read reaches the end of the file
+ssize_t transfer_all(const int fd, void* buffer, const size_t size, const off_t position, const bool is_write) {
+    size_t bytes_done = 0;
+    while (bytes_done < size) {
+        const ssize_t result = is_write
+            ? pwrite(fd, (const uint8_t*) buffer + bytes_done, size - bytes_done, position + (off_t) bytes_done)
+            : pread(fd, (uint8_t*) buffer + bytes_done, size - bytes_done, position + (off_t) bytes_done);
+        if (result < 0 || (result == 0 && is_write)) return -1;
+        if (result == 0) break;
+
+        bytes_done += result;
+    }
+
+    return (ssize_t) bytes_done;
+}
+
+// O_DIRECT transfers have to start and end on sector boundaries, from a buffer that is aligned in memory
+// Anything else goes through a pooled buffer that covers the whole sectors the range touches, so partial
+// sectors are read before they are written back
+// Writes to the last data block of the disk can grow it by up to a sector, the padding reads back as zeros
+int transfer_direct(const struct volume_member* member, const off_t position, void* buffer, const size_t size,
+    const bool is_write) {
+    const off_t alignment = member->direct_alignment;
+    const off_t start = position / alignment * alignment;
+    const off_t end = (position + (off_t) size + alignment - 1) / alignment * alignment;
+
+    if (start == position && end == position + (off_t) size && (uintptr_t) buffer % IO_BUFFER_ALIGNMENT == 0) {
+        return transfer_all(member->fd, buffer, size, position, is_write) == (ssize_t) size ? 0 : -1;
+    }
+
+    uint8_t* padded = acquire_io_buffer();
+    if (!padded) return -1;
+
+    const size_t padded_size = end - start;
+    int result = 0;
+    if (!is_write || start != position || end != position + (off_t) size) {
+        // Whatever lies past the end of the file reads as zeros
+        const auto bytes_read = transfer_all(member->fd, padded, padded_size, start, false);
+        if (bytes_read < 0 || (!is_write && bytes_read < position - start + (off_t) size)) {
+            result = -1;
+        } else {
+            memset(padded + bytes_read, 0, padded_size - bytes_read);
+        }
+    }
+
+    if (result == 0) {
+        if (is_write) {
+            memcpy(padded + (position - start), buffer, size);
+            result = transfer_all(member->fd, padded, padded_size, start, true) == (ssize_t) padded_size ? 0 : -1;
+        } else {
+            memcpy(buffer, padded + (position - start), size);
+        }
+    }
+
+    release_io_buffer(padded);
+    return result;
+}
+
+// Reads or writes part of a data block without counting the I/O, so it can be called from any thread
+int transfer_block_data(const int block_number, const size_t offset, void* buffer, const size_t size, const bool is_write) {
+    if (num_open_members == 0) return -1;
+
+    const auto location = locate_data_block(block_number);
+    const auto member = &volume_members[location.member];
+    const auto position = location.offset + (off_t) offset;
+
+    if (member->direct_alignment) return transfer_direct(member, position, buffer, size, is_write);
+
+    return transfer_all(member->fd, buffer, size, position, is_write) == (ssize_t) size ? 0 : -1;
+}
+
+// Data block I/O is counted as if the volume was one disk, with every block at its place in the data region
+void count_data_block_io(const int block_number, const size_t size, const bool is_write) {
+    const uint32_t location = DATA_START + block_number * superblock.block_size;
+    count_disk_seek(location);
+    count_disk_transfer(location, size, is_write);
+}
+
+// DURABILITY
+// Commands write in an order that keeps the image consistent at every barrier: data blocks before the inode
+// pointing at them, an inode before the dentry naming it, and the dentry is removed before its inode and blocks
+// are freed. What a barrier does depends on the mode the disk is mounted with
+// strict: every barrier fsyncs the image files, and every command ends with one
+// batched: only whole commands are committed, once batch_operations commands have run or batch_interval_ms
+// has passed since the last commit, whichever comes first. A background thread commits an idle shell
+// none: nothing is fsynced, for scratch images
+
+enum durability_mode {
+    DURABILITY_NONE,
+    DURABILITY_BATCHED,
+    DURABILITY_STRICT,
+    NUM_DURABILITY_MODES
+};
+
+const char* const DURABILITY_MODE_NAMES[NUM_DURABILITY_MODES] = {"none", "batched", "strict"};
+
+#define DEFAULT_BATCH_INTERVAL_MS 100
+#define DEFAULT_BATCH_OPERATIONS 64
+
+// Mount option, set with the 'strict', 'batched' or 'none' argument or the 'durability' command
+enum durability_mode durability_mode = DURABILITY_NONE;
+int batch_interval_ms = DEFAULT_BATCH_INTERVAL_MS;
+int batch_operations = DEFAULT_BATCH_OPERATIONS;
+
+// Held while a command runs, so the committer thread never syncs half of one
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+int uncommitted_operations = 0;
+uint64_t last_commit_ns = 0;
+uint64_t num_syncs = 0;
+bool committer_running = false;
+
+uint64_t monotonic_now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+// Pushes everything written so far to stable storage, disk is flushed first if it isn't nullptr
+int sync_volume(FILE* disk) {
+    TRACE_SCOPE("sync_volume", "durability");
+
+    int result = 0;
+    if (disk && fflush(disk) != 0) result = -1;
+
+    // Every member holds data blocks, member 0 holds the metadata as well
+    for (int member = 0; member < num_open_members; member++) {
+        if (fdatasync(volume_members[member].fd) != 0) result = -1;
+    }
+
+    num_syncs++;
+    unsynced_writes = false;
+    uncommitted_operations = 0;
+    last_commit_ns = monotonic_now_ns();
+    return result;
+}
+
+// Everything written before the barrier reaches stable storage before anything written after it
+// disk is the command's open disk, if it has one
+void write_barrier(FILE* disk) {
+    if (durability_mode == DURABILITY_STRICT && unsynced_writes) sync_volume(disk);
+}
+
+// Commits a batch that has waited too long, checked by the committer thread every batch interval
+void* run_committer(void*) {
+    while (true) {
+        const struct timespec interval = {batch_interval_ms / 1000, (long) (batch_interval_ms % 1000) * 1000000};
+        nanosleep(&interval, nullptr);
+
+        pthread_mutex_lock(&commit_lock);
+        if (durability_mode == DURABILITY_BATCHED && unsynced_writes &&
+            monotonic_now_ns() - last_commit_ns >= (uint64_t) batch_interval_ms * 1000000) {
+            sync_volume(nullptr);
+        }
+        pthread_mutex_unlock(&commit_lock);
+    }
+
+    return nullptr;
+}
+
+// Starts a new batch, and the committer thread if it isn't running yet
+void start_committer() {
+    last_commit_ns = monotonic_now_ns();
+    if (committer_running || durability_mode != DURABILITY_BATCHED) return;
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, run_committer, nullptr) != 0) {
+        printf("Couldn't start the batch committer, batches are only committed by later commands\n");
+        return;
+    }
+    pthread_detach(thread);
+    committer_running = true;
+}
+
+// Runs after every command, with commit_lock held
+// The free space summary the command changed is written first, so it is part of the same commit
+// Only commands that wrote something count towards a batch
+void commit_command() {
+    if (superblock_dirty) write_superblock();
+
+    const bool wrote = command_wrote;
+    command_wrote = false;
+    if (durability_mode == DURABILITY_NONE || !wrote) return;
+
+    uncommitted_operations++;
+    if (durability_mode == DURABILITY_STRICT || uncommitted_operations >= batch_operations ||
+        monotonic_now_ns() - last_commit_ns >= (uint64_t) batch_interval_ms * 1000000) {
+        sync_volume(nullptr);
+    }
+}
+
+// RECORDING
+// While recording, the shell appends every command it runs to a workload log: when the command started relative to
+// the start of the recording, how long it took, what it returned and the line as it was typed. The 'record' command
+// itself is left out. bench/nanofs_replay.c runs a log again against a fresh or copied disk
+// A log is plain text, one command per line, lines starting with # are comments
+
+FILE* record_log = nullptr;
+char record_log_name[MAX_ARG_LEN + 1];
+uint64_t record_start_ns = 0;
+int num_recorded_commands = 0;
+
+int start_recording(const char* log_name) {
+    FILE* log = fopen(log_name, "w");
+    if (!log) {
+        printf("Could not create workload log %s\n", log_name);
+        return -1;
+    }
+
+    if (record_log) fclose(record_log);
+    record_log = log;
+    snprintf(record_log_name, sizeof(record_log_name), "%s", log_name);
+    record_start_ns = monotonic_now_ns();
+    num_recorded_commands = 0;
+
+    const auto now = time(nullptr);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(record_log, "# NanoFS workload recorded %s\n", date);
+    // Host paths in the commands are relative to where the shell ran, the replay resolves them against it
+    char host_directory[PATH_MAX];
+    if (getcwd(host_directory, sizeof(host_directory))) fprintf(record_log, "# host_directory %s\n", host_directory);
+    fprintf(record_log, "# offset_ns latency_ns result command\n");
+    fflush(record_log);
+
+    return 0;
+}
+
+void stop_recording() {
+    if (!record_log) return;
+
+    fclose(record_log);
+    record_log = nullptr;
+}
+
+// Every line is flushed, so the log is complete up to the last command if the program is killed
+void record_command(const char* line, const uint64_t start_ns, const uint64_t duration_ns, const int result) {
+    fprintf(record_log, "%llu %llu %d %s\n", (unsigned long long) (start_ns - record_start_ns),
+        (unsigned long long) duration_ns, result, line);
+    fflush(record_log);
+    num_recorded_commands++;
+}
+
+// DISCARD
+// Freed data blocks are punched out of the image files, so the host only stores the blocks that are in use
+// Blocks freed by a command are collected and punched in one batch once the command is done, blocks that sit
+// next to each other in a member's file become one range. 'trim' punches every free block, including ones
+// that were freed while discards were off
+
+uint8_t* pending_discards = nullptr; // Bitmap of the blocks freed since the last batch
+int num_pending_discards = 0;
+bool inline_discard = true;
+
+void free_pending_discards() {
+    free(pending_discards);
+    pending_discards = nullptr;
+    num_pending_discards = 0;
+}
+
+// Called whenever a block changes status, a block that is allocated again before the batch runs is left alone
+void mark_block_for_discard(const int block_number, const bool freed) {
+    if (!inline_discard) return;
+    if (!pending_discards) {
+        pending_discards = calloc(superblock.block_count / 8, 1);
+        if (!pending_discards) return;
+    }
+
+    const uint8_t mask = 128 >> (block_number % 8);
+    const bool pending = pending_discards[block_number / 8] & mask;
+    if (freed && !pending) {
+        pending_discards[block_number / 8] |= mask;
+        num_pending_discards++;
+    } else if (!freed && pending) {
+        pending_discards[block_number / 8] &= ~mask;
+        num_pending_discards--;
+    }
+}
+
+int compare_block_locations(const void* a, const void* b) {
+    const struct block_location* first = a;
+    const struct block_location* second = b;
+    if (first->member != second->member) return first->member - second->member;
+
+    return (first->offset > second->offset) - (first->offset < second->offset);
+}
+
+// Punches holes where the blocks are stored, blocks that are contiguous in a member's file are punched together
+// Returns the number of ranges punched, or -1 if the host can't punch holes
+int punch_data_blocks(const int* blocks, const int num_blocks) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    struct block_location* locations = arena_alloc(num_blocks * sizeof(struct block_location));
+    if (!locations) return -1;
+
+    for (int i = 0; i < num_blocks; i++) locations[i] = locate_data_block(blocks[i]);
+    qsort(locations, num_blocks, sizeof(struct block_location), compare_block_locations);
+
+    int num_ranges = 0;
+    for (int first = 0; first < num_blocks;) {
+        int end = first + 1;
+        while (end < num_blocks && locations[end].member == locations[first].member &&
+            locations[end].offset == locations[end - 1].offset + superblock.block_size) {
+            end++;
+        }
+
+        TRACE_SCOPE("punch_hole", "block_io");
+        const off_t length = (off_t) (end - first) * superblock.block_size;
+        if (fallocate(volume_members[locations[first].member].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            locations[first].offset, length) != 0) {
+            return -1;
+        }
+
+        num_ranges++;
+        first = end;
+    }
+
+    return num_ranges;
+#else
+    (void) blocks;
+    (void) num_blocks;
+    return -1;
+#endif
+}
+
+// Adds the free blocks that share a host block with the given one, a host block is only released once all of
+// it is a hole, and punching a block that is already free never loses anything
+void add_free_neighbours(const int block_number, const uint8_t* free_bitmap, uint8_t* selected) {
+    const auto location = locate_data_block(block_number);
+    const auto member = &volume_members[location.member];
+    const off_t host_block_size = member->host_block_size;
+
+    const off_t window_start = location.offset / host_block_size * host_block_size;
+    const off_t window_end = (location.offset + superblock.block_size + host_block_size - 1) / host_block_size * host_block_size;
+    const int first = window_start > member->data_start ? (int) ((window_start - member->data_start) / superblock.block_size) : 0;
+    const int last = MIN(member->block_count - 1, (int) ((window_end - 1 - member->data_start) / superblock.block_size));
+
+    for (int block_in_member = first; block_in_member <= last; block_in_member++) {
+        const int neighbour = get_data_block_number(location.member, block_in_member);
+        if (neighbour >= superblock.block_count || (free_bitmap[neighbour / 8] & (128 >> (neighbour % 8)))) continue;
+
+        selected[neighbour / 8] |= 128 >> (neighbour % 8);
+    }
+}
+
+// Punches the blocks freed since the last batch, runs after every command
+int discard_pending_blocks() {
+    if (num_pending_discards == 0 || num_open_members == 0) return 0;
+
+    const size_t bitmap_size = superblock.block_count / 8;
+    uint8_t* free_bitmap = arena_alloc(bitmap_size);
+    uint8_t* selected = arena_alloc(bitmap_size);
+    int* blocks = arena_alloc(superblock.block_count * sizeof(int));
+    if (!free_bitmap || !selected || !blocks) return -1;
+
+    // Read straight from the disk, the command is over so this isn't counted towards its I/O
+    const int fd = open(DEFAULT_DISK_NAME, O_RDONLY);
+    const bool have_bitmap = fd != -1 && pread(fd, free_bitmap, bitmap_size, FREE_BITMAP_START) == (ssize_t) bitmap_size;
+    if (fd != -1) close(fd);
+
+    memcpy(selected, pending_discards, bitmap_size);
+    for (int i = 0; i < superblock.block_count && have_bitmap; i++) {
+        if (pending_discards[i / 8] & (128 >> (i % 8))) add_free_neighbours(i, free_bitmap, selected);
+    }
+
+    int num_blocks = 0;
+    for (int i = 0; i < superblock.block_count; i++) {
+        if (selected[i / 8] & (128 >> (i % 8))) blocks[num_blocks++] = i;
+    }
+    memset(pending_discards, 0, superblock.block_count / 8);
+    num_pending_discards = 0;
+
+    if (punch_data_blocks(blocks, num_blocks) == -1) {
+        printf("The host can't punch holes in the disk, inline discard is now off\n");
+        inline_discard = false;
+        free_pending_discards();
+        return -1;
+    }
+
+    return 0;
+}
+
+// Records the checksum of a data block in memory and in the block info region
+// The block's generation follows its checksum, so both are written at once
+int set_block_checksum_disk(FILE* disk, const int block_number, const uint32_t checksum) {
+    if (block_checksums) block_checksums[block_number] = checksum;
+
+    const uint32_t fields[] = {checksum, superblock.generation};
+    const uint32_t location = BLOCK_INFO_START + block_number * sizeof(struct block_info) +
+        offsetof(struct block_info, checksum);
+    const auto result = disk_write_at(disk, location, fields, sizeof(fields));
+
+    if (result != 0) {
+        printf("File error: could not write checksum of data block %d\n", block_number);
+    }
+
+    return result;
+}
+
+// Replaces the contents of a data block, everything past size is zeroed
+// The data goes to the block's volume member, disk is only used to record the block's checksum
+int write_data_to_block_disk(FILE* disk, const int block_number, const void *data, const size_t size) {
+    TRACE_SCOPE("write_block", "block_io");
+
+    // The whole block is written so that its checksum covers known contents
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
+    memcpy(block, data, size);
+    memset(block + size, 0, DEFAULT_BLOCK_SIZE - size);
+
+    count_data_block_io(block_number, DEFAULT_BLOCK_SIZE, true);
+    auto result = transfer_block_data(block_number, 0, block, DEFAULT_BLOCK_SIZE, true);
+
+    if (result != 0) {
+        printf("File error: could not write to data block %d\n", block_number);
+    } else {
+        result = set_block_checksum_disk(disk, block_number, compute_checksum(block, DEFAULT_BLOCK_SIZE));
+    }
+
+    release_io_buffer(block);
+    return result;
+}
+
+int write_data_to_block(const int block_number, const void *data, const size_t size) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = write_data_to_block_disk(disk, block_number, data, size);
+
+    fclose(disk);
+    return result;
+}
+
+// Returns whether reading the block should verify its checksum
+bool should_verify_block(const int block_number) {
+    return checksum_policy != CHECKSUM_VERIFY_OFF && block_checksums && block_checksums[block_number] != 0;
+}
+
+// Reads size bytes starting offset bytes into a data block
+// The data comes from the block's volume member, disk isn't used
+int read_data_from_block_at_disk(FILE* disk, const int block_number, const size_t offset, void* buffer, const size_t size) {
+    TRACE_SCOPE("read_block", "block_io");
+
+    if (!should_verify_block(block_number)) {
+        count_data_block_io(block_number, size, false);
+        const auto result = transfer_block_data(block_number, offset, buffer, size, false);
+        if (result != 0) printf("File error: could not read data from data block %d\n", block_number);
+
+        return result;
+    }
+
+    // The checksum covers the whole block, so all of it has to be read to verify it
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
+
+    int result = 0;
+    count_data_block_io(block_number, DEFAULT_BLOCK_SIZE, false);
+    if (transfer_block_data(block_number, 0, block, DEFAULT_BLOCK_SIZE, false) != 0) {
+        printf("File error: could not read data from data block %d\n", block_number);
+        result = -1;
+    } else if (compute_checksum(block, DEFAULT_BLOCK_SIZE) != block_checksums[block_number] &&
+        report_checksum_mismatch("data block", block_number) != 0) {
+        result = -1;
+    } else {
+        memcpy(buffer, block + offset, size);
+    }
+
+    release_io_buffer(block);
+    return result;
+}
+
+int read_data_from_block_disk(FILE* disk, const int block_number, void* buffer, const size_t size) {
+    return read_data_from_block_at_disk(disk, block_number, 0, buffer, size);
+}
+
+int read_data_from_block(const int block_number, void* buffer, const size_t size) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = read_data_from_block_disk(disk, block_number, buffer, size);
+    fclose(disk);
+
+    return result;
+}
+
+// Overwrites size bytes starting offset bytes into a data block, the rest of the block is kept
+int write_data_to_block_at_disk(FILE* disk, const int block_number, const size_t offset, const void* data, const size_t size) {
+    // The rest of the block is needed to update the checksum
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
+    if (read_data_from_block_disk(disk, block_number, block, DEFAULT_BLOCK_SIZE) != 0) {
+        release_io_buffer(block);
+        return -1;
+    }
+    memcpy(block + offset, data, size);
+
+    // Direct I/O would have to read the range's sectors again to write part of them, the whole block is at hand
+    const size_t write_offset = direct_io ? 0 : offset;
+    const size_t write_size = direct_io ? DEFAULT_BLOCK_SIZE : size;
+
+    TRACE_SCOPE("write_block", "block_io");
+    count_data_block_io(block_number, write_size, true);
+    auto result = transfer_block_data(block_number, write_offset, block + write_offset, write_size, true);
+    if (result != 0) {
+        printf("File error: could not write to data block %d\n", block_number);
+    } else {
+        result = set_block_checksum_disk(disk, block_number, compute_checksum(block, DEFAULT_BLOCK_SIZE));
+    }
+
+    release_io_buffer(block);
+    return result;
+}
+
+// One data block of a batch, data always points to a whole block
+struct block_request {
+    int block_number;
+    uint8_t* data; // Zero padded past size when writing
+    size_t size; // Bytes of the block that are wanted, or that were written
+    uint32_t checksum; // Of the block's new contents when writing, of what was read when verifying, 0 otherwise
+    int result;
+};
+
+struct member_queue {
+    struct block_request* requests; // The whole batch, the queue picks out the requests for its member
+    int num_requests;
+    int member;
+    bool is_write;
+    struct member_batch* batch; // Told when the queue is worked through, nullptr if it runs on the calling thread
+};
+
+#define MAX_VECTORED_BLOCKS 64
+
+// Bytes of the block a request moves, reads that are verified read the whole block
+// Direct reads of whole blocks into pooled buffers need no padding
+size_t get_request_transfer_size(const struct block_request* request, const bool is_write) {
+    if (is_write || direct_io || should_verify_block(request->block_number)) return DEFAULT_BLOCK_SIZE;
+    return request->size;
+}
+
+void finish_block_request(struct block_request* request, const bool is_write, const int result) {
+    request->result = result;
+    if (is_write) {
+        request->checksum = compute_checksum(request->data, DEFAULT_BLOCK_SIZE);
+    } else {
+        const bool verify = should_verify_block(request->block_number);
+        request->checksum = verify && result == 0 ? compute_checksum(request->data, DEFAULT_BLOCK_SIZE) : 0;
+    }
+}
+
+// Transfers a run of requests for blocks that follow each other in the member's file with a single call
+// Falls back to one transfer per block if the call comes up short
+void transfer_block_run(const struct member_queue* queue, const int* indices, const int num_indices, const off_t position) {
+    struct iovec vectors[MAX_VECTORED_BLOCKS];
+    size_t total_size = 0;
+    for (int i = 0; i < num_indices; i++) {
+        const auto request = &queue->requests[indices[i]];
+        vectors[i] = (struct iovec) {request->data, get_request_transfer_size(request, queue->is_write)};
+        total_size += vectors[i].iov_len;
+    }
+
+    const int fd = volume_members[queue->member].fd;
+    const ssize_t result = queue->is_write
+        ? pwritev(fd, vectors, num_indices, position)
+        : preadv(fd, vectors, num_indices, position);
+
+    for (int i = 0; i < num_indices; i++) {
+        const auto request = &queue->requests[indices[i]];
+        const int block_result = result == (ssize_t) total_size ? 0
+            : transfer_block_data(request->block_number, 0, request->data, vectors[i].iov_len, queue->is_write);
+        finish_block_request(request, queue->is_write, block_result);
+    }
+}
+
+void* run_member_queue(void* argument) {
+    const struct member_queue* queue = argument;
+
+    int indices[queue->num_requests];
+    int num_indices = 0;
+    for (int i = 0; i < queue->num_requests; i++) {
+        if (locate_data_block(queue->requests[i].block_number).member == queue->member) indices[num_indices++] = i;
+    }
+
+    // Requests for blocks that follow each other in the member's file are merged into one transfer
+    // O_DIRECT transfers are padded one block at a time instead
+    const bool can_merge = volume_members[queue->member].direct_alignment == 0;
+    for (int first = 0; first < num_indices;) {
+        const auto position = locate_data_block(queue->requests[indices[first]].block_number).offset;
+
+        int end = first + 1;
+        while (can_merge && end < num_indices && end - first < MAX_VECTORED_BLOCKS &&
+            get_request_transfer_size(&queue->requests[indices[end - 1]], queue->is_write) == DEFAULT_BLOCK_SIZE &&
+            locate_data_block(queue->requests[indices[end]].block_number).offset ==
+            position + (off_t) (end - first) * DEFAULT_BLOCK_SIZE) {
+            end++;
+        }
+
+        TRACE_SCOPE(queue->is_write ? "queued_write" : "queued_read", "block_io");
+        if (end - first > 1) {
+            transfer_block_run(queue, indices + first, end - first, position);
+        } else {
+            const auto request = &queue->requests[indices[first]];
+            const size_t size = get_request_transfer_size(request, queue->is_write);
+            finish_block_request(request, queue->is_write,
+                transfer_block_data(request->block_number, 0, request->data, size, queue->is_write));
+        }
+
+        first = end;
+    }
+
+    return nullptr;
+}
+
+// Waits for shares of batches for its member until the volume is closed
+void* run_member_worker(void* argument) {
+    auto worker = (struct member_worker*) argument;
+
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (!worker->queue && !worker->stop) pthread_cond_wait(&worker->changed, &worker->lock);
+        if (!worker->queue) break;
+
+        auto queue = worker->queue;
+        pthread_mutex_unlock(&worker->lock);
+        run_member_queue(queue);
+
+        // The worker is idle again before the batch is reported done, so the next batch can be queued right away
+        pthread_mutex_lock(&worker->lock);
+        worker->queue = nullptr;
+        pthread_mutex_unlock(&worker->lock);
+
+        auto batch = queue->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->remaining == 0) pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return nullptr;
+}
+
+// Hands a share of a batch to its member's worker, starting the worker if it isn't running yet
+// Returns false if the worker couldn't be started, the share is then up to the caller
+bool queue_member_share(struct member_queue* queue) {
+    auto worker = &member_workers[queue->member];
+    if (!worker->started) {
+        pthread_mutex_init(&worker->lock, nullptr);
+        pthread_cond_init(&worker->changed, nullptr);
+        if (pthread_create(&worker->thread, nullptr, run_member_worker, worker) != 0) {
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->changed);
+            return false;
+        }
+        worker->started = true;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    worker->queue = queue;
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+
+    return true;
+}
+
+// Reads or writes a batch of data blocks, every volume member involved works through its share on its own worker
+// Checksums are checked or recorded once all members are done, disk is used to record them
+// Without a disk the checksums of written blocks are left in the requests for the caller to record
+int transfer_data_blocks_disk(FILE* disk, struct block_request* requests, const int num_requests, const bool is_write) {
+    TRACE_SCOPE(is_write ? "write_blocks" : "read_blocks", "block_io");
+
+    bool member_used[MAX_STRIPE_MEMBERS] = {false};
+    int num_members_used = 0;
+    for (int i = 0; i < num_requests; i++) {
+        const int member = locate_data_block(requests[i].block_number).member;
+        if (!member_used[member]) num_members_used++;
+        member_used[member] = true;
+    }
+
+    struct member_batch batch = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    struct member_queue queues[MAX_STRIPE_MEMBERS];
+    int local_members[MAX_STRIPE_MEMBERS];
+    int num_local_members = 0;
+    for (int member = 0; member < superblock.stripe_members; member++) {
+        if (!member_used[member]) continue;
+
+        // A single member gains nothing from a worker, and a worker that fails to start leaves its share to this thread
+        queues[member] = (struct member_queue) {requests, num_requests, member, is_write, &batch};
+        pthread_mutex_lock(&batch.lock);
+        batch.remaining++;
+        pthread_mutex_unlock(&batch.lock);
+        if (num_members_used == 1 || !queue_member_share(&queues[member])) {
+            pthread_mutex_lock(&batch.lock);
+            batch.remaining--;
+            pthread_mutex_unlock(&batch.lock);
+            local_members[num_local_members++] = member;
+        }
+    }
+    for (int i = 0; i < num_local_members; i++) run_member_queue(&queues[local_members[i]]);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.remaining > 0) pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    // Blocks that directly follow the previous block of the batch on the same member don't need a seek
+    off_t next_offsets[MAX_STRIPE_MEMBERS];
+    for (int member = 0; member < MAX_STRIPE_MEMBERS; member++) next_offsets[member] = -1;
+
+    int result = 0;
+    for (int i = 0; i < num_requests; i++) {
+        const auto request = &requests[i];
+        const bool verified = !is_write && request->checksum != 0;
+        const size_t size = get_request_transfer_size(request, is_write);
+        const auto location = locate_data_block(request->block_number);
+        const uint32_t logical_location = DATA_START + request->block_number * superblock.block_size;
+
+        if (location.offset != next_offsets[location.member]) count_disk_seek(logical_location);
+        count_disk_transfer(logical_location, size, is_write);
+        next_offsets[location.member] = size == DEFAULT_BLOCK_SIZE ? location.offset + DEFAULT_BLOCK_SIZE : -1;
+
+        if (request->result != 0) {
+            printf("File error: could not %s data block %d\n", is_write ? "write to" : "read data from", request->block_number);
+            result = -1;
+        } else if (is_write) {
+            if (disk && set_block_checksum_disk(disk, request->block_number, request->checksum) != 0) result = -1;
+        } else if (verified && request->checksum != block_checksums[request->block_number] &&
+            report_checksum_mismatch("data block", request->block_number) != 0) {
+            request->result = -1;
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+int read_inode_disk(FILE* disk, const int inode_number, struct inode* destination) {
+    const uint32_t location = INODE_TABLE_START + inode_number * sizeof(struct inode);
+    const auto result = disk_read_at(disk, location, destination, sizeof(struct inode));
+
+    if (result != 0) {
+        printf("File error: could not read inode %d\n", inode_number);
+        return result;
+    }
+
+    return verify_inode_checksum(inode_number, destination);
+}
+
+int read_inode(const int inode_number, struct inode* destination) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = read_inode_disk(disk, inode_number, destination);
+    fclose(disk);
+
+    return result;
+}
+
+// Keeps the free inode summary in sync, called by whoever allocates or frees an inode since only they know which it is
+void update_free_inode_summary(const int inode_number, const bool used) {
+    if (used) {
+        superblock.free_inode_count--;
+        if (inode_number == superblock.first_free_inode) superblock.first_free_inode = inode_number + 1;
+    } else {
+        superblock.free_inode_count++;
+        if (inode_number < superblock.first_free_inode) superblock.first_free_inode = inode_number;
+    }
+    superblock_dirty = true;
+}
+
+int write_inode_disk(FILE* disk, const int inode_number, const struct inode* inode) {
+    const uint32_t location = INODE_TABLE_START + inode_number * sizeof(struct inode);
+
+    struct inode checksummed_inode = *inode;
+    checksummed_inode.generation = superblock.generation;
+    checksummed_inode.checksum = inode_checksum(&checksummed_inode);
+    const auto result = disk_write_at(disk, location, &checksummed_inode, sizeof(struct inode));
+
+    if (result != 0) {
+        printf("File error: could not write to inode %d\n", inode_number);
+    }
+
+    return result;
+}
+
+int write_inode(const int inode_number, const struct inode* inode) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = write_inode_disk(disk, inode_number, inode);
+    fclose(disk);
+
+    return result;
+}
+
+int read_block_info_disk(FILE* disk, const int block_number, struct block_info* destination) {
+    const uint32_t location = BLOCK_INFO_START + block_number * sizeof(struct block_info);
+    const auto result = disk_read_at(disk, location, destination, sizeof(struct block_info));
+
+    if (result != 0) {
+        printf("File error: could not read block info of data block %d\n", block_number);
+    }
+
+    return result;
+}
+
+int write_block_info_disk(FILE* disk, const int block_number, const struct block_info* info) {
+    if (block_checksums) block_checksums[block_number] = info->checksum;
+
+    struct block_info stamped_info = *info;
+    stamped_info.generation = superblock.generation;
+    const uint32_t location = BLOCK_INFO_START + block_number * sizeof(struct block_info);
+    const auto result = disk_write_at(disk, location, &stamped_info, sizeof(struct block_info));
+
+    if (result != 0) {
+        printf("File error: could not write block info of data block %d\n", block_number);
+    }
+
+    return result;
+}
+
+// 32-bit FNV-1a, 0 is reserved to mean "no hash"
+uint32_t hash_block(const uint8_t* data, const size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+void dedup_index_insert(const uint32_t hash, const int block_number) {
+    if (!dedup_index) return;
+
+    const uint32_t mask = dedup_index_capacity - 1;
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        if (dedup_index[slot].block_number < 0) {
+            dedup_index[slot].hash = hash;
+            dedup_index[slot].block_number = block_number;
+            return;
+        }
+    }
+}
+
+void dedup_index_remove(const uint32_t hash, const int block_number) {
+    if (!dedup_index) return;
+
+    const uint32_t mask = dedup_index_capacity - 1;
+    for (uint32_t slot = hash & mask; dedup_index[slot].block_number != DEDUP_ENTRY_EMPTY; slot = (slot + 1) & mask) {
+        if (dedup_index[slot].hash == hash && dedup_index[slot].block_number == block_number) {
+            dedup_index[slot].block_number = DEDUP_ENTRY_DELETED;
+            return;
+        }
+    }
+}
+
+void free_dedup_index() {
+    free(dedup_index);
+    dedup_index = nullptr;
+    dedup_index_capacity = 0;
+}
+
+// Builds the in-memory dedup index from the hashes stored in the block info region
+int load_dedup_index() {
+    free_dedup_index();
+
+    // Keep the table at most half full so probe sequences stay short
+    uint32_t capacity = 1;
+    while (capacity < 2u * superblock.block_count) capacity <<= 1;
+
+    dedup_index = malloc(capacity * sizeof(struct dedup_entry));
+    if (!dedup_index) {
+        printf("Error: Failed to allocate memory for dedup index\n");
+        return -1;
+    }
+    dedup_index_capacity = capacity;
+    for (uint32_t i = 0; i < capacity; i++) dedup_index[i].block_number = DEDUP_ENTRY_EMPTY;
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        free_dedup_index();
+        return -1;
+    }
+
+    struct block_info* infos = arena_alloc(superblock.block_count * sizeof(struct block_info));
+    if (!infos || disk_read_at(disk, BLOCK_INFO_START, infos, superblock.block_count * sizeof(struct block_info)) != 0) {
+        printf("File error: could not read block info region\n");
+        fclose(disk);
+        free_dedup_index();
+        return -1;
+    }
+    fclose(disk);
+
+    for (int i = 0; i < superblock.block_count; i++) {
+        if (infos[i].hash != 0 && infos[i].reference_count > 0) dedup_index_insert(infos[i].hash, i);
+    }
+
+    return 0;
+}
+
+void free_block_checksums() {
+    free(block_checksums);
+    block_checksums = nullptr;
+}
+
+// Copies the data block checksums from the block info region into memory
+int load_block_checksums() {
+    free_block_checksums();
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct block_info* infos = arena_alloc(superblock.block_count * sizeof(struct block_info));
+    if (!infos || disk_read_at(disk, BLOCK_INFO_START, infos, superblock.block_count * sizeof(struct block_info)) != 0) {
+        printf("File error: could not read block info region\n");
+        fclose(disk);
+        return -1;
+    }
+    fclose(disk);
+
+    block_checksums = malloc(superblock.block_count * sizeof(uint32_t));
+    if (!block_checksums) {
+        printf("Error: Failed to allocate memory for block checksums\n");
+        return -1;
+    }
+    for (int i = 0; i < superblock.block_count; i++) block_checksums[i] = infos[i].checksum;
+
+    return 0;
+}
+
+int set_data_block_status_disk(FILE* disk, const int block_number, const int status) {
+    const int byte = block_number / 8;
+    const int bit = block_number % 8;
+    const uint8_t mask = 128 >> bit;
+
+    const auto location = FREE_BITMAP_START + byte;
+    uint8_t current_bitmap_byte;
+
+    auto result = disk_read_at(disk, location, &current_bitmap_byte, sizeof(current_bitmap_byte));
+    if (result != 0) {
+        printf("File error: could not read byte %d of free bitmap table\n", byte);
+        return result;
+    }
+
+    // Keep the free block summary in sync when the block's status actually changes
+    const bool was_used = current_bitmap_byte & mask;
+    if (status == DATA_BLOCK_USED && !was_used) {
+        superblock.free_block_count--;
+        if (block_number == superblock.first_free_block) superblock.first_free_block = block_number + 1;
+    } else if (status == DATA_BLOCK_FREE && was_used) {
+        superblock.free_block_count++;
+        if (block_number < superblock.first_free_block) superblock.first_free_block = block_number;
+    }
+    mark_block_for_discard(block_number, status == DATA_BLOCK_FREE);
+
+    if (status == DATA_BLOCK_USED) {
+        current_bitmap_byte |= mask;
+    } else {
+        current_bitmap_byte &= ~mask;
+    }
+
+    if (was_used != (status == DATA_BLOCK_USED)) superblock_dirty = true;
+
+    result = disk_write_at(disk, location, &current_bitmap_byte, sizeof(current_bitmap_byte));
+    if (result != 0) {
+        printf("File error: could not write to byte %d of free bitmap table\n", byte);
+        return result;
+    }
+
+    // A newly allocated block has a single owner, a freed block has none
+    // Either way its old contents are no longer available for deduplication
+    struct block_info info;
+    result = read_block_info_disk(disk, block_number, &info);
+    if (result != 0) return result;
+
+    if (info.hash != 0) dedup_index_remove(info.hash, block_number);
+    info.hash = 0;
+    info.reference_count = status == DATA_BLOCK_USED ? 1 : 0;
+    // Whatever is left in a freed block is garbage, so there is nothing to verify when it's allocated again
+    if (status == DATA_BLOCK_FREE) info.checksum = 0;
+
+    return write_block_info_disk(disk, block_number, &info);
+}
+
+// Updates the free bitmap table to indicate if a certain block is used (1) or unused (0)
+int set_data_block_status(const int block_number, const int status) {
+    FILE *disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+    
+    const auto result = set_data_block_status_disk(disk, block_number, status);
+
+    fclose(disk);
+    return result;
+}
+
+// Adds a reference to a block that is already in use
+int acquire_data_block_disk(FILE* disk, const int block_number) {
+    struct block_info info;
+    auto result = read_block_info_disk(disk, block_number, &info);
+    if (result != 0) return result;
+
+    info.reference_count++;
+    return write_block_info_disk(disk, block_number, &info);
+}
+
+// Drops a reference to a block, freeing it once nothing references it anymore
+// Returns the number of remaining references, or -1 on error
+int release_data_block_disk(FILE* disk, const int block_number) {
+    struct block_info info;
+    if (read_block_info_disk(disk, block_number, &info) != 0) return -1;
+
+    if (info.reference_count <= 1) {
+        if (set_data_block_status_disk(disk, block_number, DATA_BLOCK_FREE) != 0) return -1;
+        return 0;
+    }
+
+    info.reference_count--;
+    if (write_block_info_disk(disk, block_number, &info) != 0) return -1;
+
+    return info.reference_count;
+}
+
+int find_next_free_data_block_disk(FILE* disk) {
+    TRACE_SCOPE("find_free_data_block", "allocation");
+
+    // Nothing to search for on a full disk
+    if (superblock.free_block_count == 0) return -1;
+
+    // Every block before the first free hint is in use, so the search can start there
+    const int first_byte = superblock.first_free_block / 8;
+    const auto location = FREE_BITMAP_START + first_byte;
+    const int num_bytes_to_check = superblock.block_count / 8;
+    constexpr uint8_t mask = 1 << 7;
+
+    if (disk_seek(disk, location) != 0) {
+        printf("File error: failed to seek to beginning of free bitmap table\n");
+        return -1;
+    }
+    uint8_t current_bitmap_byte;
+    for (int byte = first_byte; byte < num_bytes_to_check; byte++) {
+        if (disk_read(disk, &current_bitmap_byte, 1) != 0) {
+            printf("Failed to read byte %d of free bitmap table\n", byte);
+            return -1;
+        }
+
+        for (int bit = 0; bit < 8; bit++) {
+            if ((current_bitmap_byte & mask) == DATA_BLOCK_FREE) {
+                return byte * 8 + bit;
+            }
+
+            current_bitmap_byte <<= 1;
+        }
+    }
+
+    // No free data blocks exist
+    return -1;
+}
+
+// Finds the first data block that is unused as specified by the bitmap
+// Returns -1 if no free data blocks exist
+int find_next_free_data_block() {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = find_next_free_data_block_disk(disk);
+
+    fclose(disk);
+    return result;
+}
+
+// Looks for an in-use data block whose contents are identical to data (a full block)
+// Returns -1 if no such block exists
+int find_duplicate_data_block_disk(FILE* disk, const uint32_t hash, const uint8_t* data) {
+    if (!dedup_index) return -1;
+
+    uint8_t* candidate = acquire_io_buffer();
+    if (!candidate) return -1;
+
+    int duplicate = -1;
+    const uint32_t mask = dedup_index_capacity - 1;
+    for (uint32_t slot = hash & mask; dedup_index[slot].block_number != DEDUP_ENTRY_EMPTY; slot = (slot + 1) & mask) {
+        if (dedup_index[slot].block_number < 0 || dedup_index[slot].hash != hash) continue;
+
+        // Equal hashes do not guarantee equal contents, so compare the actual bytes
+        const int block_number = dedup_index[slot].block_number;
+        if (read_data_from_block_disk(disk, block_number, candidate, superblock.block_size) != 0) break;
+        if (memcmp(candidate, data, superblock.block_size) == 0) {
+            duplicate = block_number;
+            break;
+        }
+    }
+
+    release_io_buffer(candidate);
+    return duplicate;
+}
+
+// Makes sure the block behind the given block pointer can be modified in place
+// Blocks shared with other files are copied to a fresh block first (copy-on-write)
+// The shared block keeps its reference until the inode pointing at the copy is written, so it is handed back
+// through replaced_block for the caller to release afterwards, replaced_block is set to 0 when nothing was copied
+// Returns the block number that should be written to, or -1 on error
+int prepare_block_for_write_disk(FILE* disk, struct inode* inode, const int pointer_index, int* replaced_block) {
+    const int block_number = inode->block_pointers[pointer_index];
+    *replaced_block = 0;
+
+    struct block_info info;
+    if (read_block_info_disk(disk, block_number, &info) != 0) return -1;
+
+    if (info.reference_count > 1) {
+        const int new_block_number = find_next_free_data_block_disk(disk);
+        if (new_block_number == -1) {
+            printf("No free data blocks in disk, unable to copy shared data block %d\n", block_number);
+            return -1;
+        }
+
+        uint8_t* data = acquire_io_buffer();
+        if (!data) return -1;
+
+        if (read_data_from_block_disk(disk, block_number, data, superblock.block_size) != 0) {
+            release_io_buffer(data);
+            return -1;
+        }
+        set_data_block_status_disk(disk, new_block_number, DATA_BLOCK_USED);
+        const auto result = write_data_to_block_disk(disk, new_block_number, data, superblock.block_size);
+        release_io_buffer(data);
+        if (result != 0) {
+            set_data_block_status_disk(disk, new_block_number, DATA_BLOCK_FREE);
+            return -1;
+        }
+
+        inode->block_pointers[pointer_index] = new_block_number;
+        *replaced_block = block_number;
+
+        if (verbose) printf("Copied shared data block %d to data block %d\n", block_number, new_block_number);
+        return new_block_number;
+    }
+
+    // The block's contents are about to change, so it can no longer be matched by its old hash
+    if (info.hash != 0) {
+        dedup_index_remove(info.hash, block_number);
+        info.hash = 0;
+        if (write_block_info_disk(disk, block_number, &info) != 0) return -1;
+    }
+
+    return block_number;
+}
+
+// TAIL PACKING
+// With tail packing on, the last partial block of a file is stored as a slice of a fragment block shared with other
+// files instead of in a block of its own, so a directory of small files fits in a handful of blocks. A fragment
+// block's reference count is the number of inodes whose tail is in it
+// Slices are placed by scanning the inode table for the slices in use, the first fragment with a gap that fits is
+// taken and a new one is started otherwise. A fragment that is less than a quarter full once a slice leaves it is
+// repacked: its slices move into the gaps of other fragments, and the block is freed once it is empty
+// 'write' stores its data as a slice directly, everything else that changes a file unpacks its tail into a block of
+// its own first and packs it again after. Packed tails are read whether or not packing is on
+
+#define SPARSE_FRAGMENT_BYTES (DEFAULT_BLOCK_SIZE / 4)
+
+struct tail_slice {
+    int block_number;
+    int offset;
+    int length;
+};
+
+int get_tail_length(const struct inode* inode) {
+    return inode->tail_block != 0 ? inode->file_size % superblock.block_size : 0;
+}
+
+bool tail_packing_enabled() {
+    return superblock.flags & SUPERBLOCK_FLAG_PACK_TAILS;
+}
+
+// Reads the whole inode table into the arena, returns nullptr on error
+struct inode* read_inode_table_disk(FILE* disk) {
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    if (!inodes || disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) != 0) {
+        printf("File error: could not read the inode table\n");
+        return nullptr;
+    }
+
+    return inodes;
+}
+
+int compare_tail_slices(const void* a, const void* b) {
+    const struct tail_slice* x = a;
+    const struct tail_slice* y = b;
+    if (x->block_number != y->block_number) return x->block_number - y->block_number;
+    return x->offset - y->offset;
+}
+
+// Lists the slices of every packed file in inodes, sorted by block and offset
+// Files that share a tail list the same slice more than once
+int collect_tail_slices(const struct inode* inodes, struct tail_slice* slices) {
+    int num_slices = 0;
+    for (int i = 1; i < superblock.inode_count; i++) {
+        if (!inodes[i].is_used || inodes[i].tail_block == 0) continue;
+
+        slices[num_slices++] = (struct tail_slice) {inodes[i].tail_block, inodes[i].tail_offset, get_tail_length(&inodes[i])};
+    }
+    qsort(slices, num_slices, sizeof(struct tail_slice), compare_tail_slices);
+
+    return num_slices;
+}
+
+// Finds the first gap of at least length bytes in a fragment other than excluded_block
+// Returns the fragment's block number and sets offset, or returns -1 if no fragment has room
+int find_tail_space(const struct inode* inodes, const int length, const int excluded_block, int* offset) {
+    struct tail_slice* slices = arena_alloc(superblock.inode_count * sizeof(struct tail_slice));
+    if (!slices) return -1;
+    const int num_slices = collect_tail_slices(inodes, slices);
+
+    for (int first = 0; first < num_slices;) {
+        const int block_number = slices[first].block_number;
+        int end = 0, gap_offset = -1;
+        int i = first;
+        for (; i < num_slices && slices[i].block_number == block_number; i++) {
+            if (gap_offset == -1 && slices[i].offset - end >= length) gap_offset = end;
+            end = MAX(end, slices[i].offset + slices[i].length);
+        }
+        if (gap_offset == -1 && superblock.block_size - end >= length) gap_offset = end;
+
+        if (gap_offset != -1 && block_number != excluded_block) {
+            *offset = gap_offset;
+            return block_number;
+        }
+        first = i;
+    }
+
+    return -1;
+}
+
+// Puts length bytes of data in a slice for the inode's tail and adds the inode's reference to its fragment
+// The inode's tail fields are set, writing the inode is up to the caller
+// Returns the fragment's block number, or -1 on error
+int store_file_tail_disk(FILE* disk, const struct inode* inodes, struct inode* inode, const void* data, const int length) {
+    int offset = 0;
+    auto block_number = find_tail_space(inodes, length, 0, &offset);
+
+    if (block_number == -1) {
+        block_number = find_next_free_data_block_disk(disk);
+        if (block_number == -1) {
+            printf("No free data blocks in disk, unable to start a fragment block\n");
+            return -1;
+        }
+
+        set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+        if (write_data_to_block_disk(disk, block_number, data, length) != 0) return -1;
+    } else {
+        if (acquire_data_block_disk(disk, block_number) != 0 ||
+            write_data_to_block_at_disk(disk, block_number, offset, data, length) != 0) return -1;
+    }
+
+    inode->tail_block = block_number;
+    inode->tail_offset = offset;
+    return block_number;
+}
+
+// Moves the slices of a fragment into other fragments, as long as they fit
+// Every file sharing a slice is pointed at its new place before the fragment gives up their references
+int repack_fragment_disk(FILE* disk, const int block_number) {
+    struct inode* inodes = read_inode_table_disk(disk);
+    if (!inodes) return -1;
+
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
+    if (read_data_from_block_disk(disk, block_number, block, superblock.block_size) != 0) {
+        release_io_buffer(block);
+        return -1;
+    }
+
+    int num_moved = 0, num_references = 0;
+    int* moved_inodes = arena_alloc(superblock.inode_count * sizeof(int));
+    for (int i = 1; i < superblock.inode_count && moved_inodes; i++) {
+        if (!inodes[i].is_used || inodes[i].tail_block != block_number) continue;
+
+        const int old_offset = inodes[i].tail_offset;
+        const int length = get_tail_length(&inodes[i]);
+        int offset;
+        const int target = find_tail_space(inodes, length, block_number, &offset);
+        if (target == -1) break;
+
+        if (write_data_to_block_at_disk(disk, target, offset, block + old_offset, length) != 0) break;
+
+        // Files sharing the slice move with it
+        for (int j = i; j < superblock.inode_count; j++) {
+            if (!inodes[j].is_used || inodes[j].tail_block != block_number || inodes[j].tail_offset != old_offset) continue;
+
+            acquire_data_block_disk(disk, target);
+            inodes[j].tail_block = target;
+            inodes[j].tail_offset = offset;
+            moved_inodes[num_references++] = j;
+        }
+        num_moved++;
+    }
+    release_io_buffer(block);
+    if (num_references == 0) return 0;
+
+    write_barrier(disk);
+    for (int i = 0; i < num_references; i++) write_inode_disk(disk, moved_inodes[i], &inodes[moved_inodes[i]]);
+    write_barrier(disk);
+
+    int remaining = 0;
+    for (int i = 0; i < num_references; i++) remaining = release_data_block_disk(disk, block_number);
+
+    if (verbose) {
+        printf("Repacked %d tail(s) out of fragment block %d%s\n", num_moved, block_number,
+            remaining == 0 ? ", which is now free" : "");
+    }
+    return 0;
+}
+
+// Drops an inode's reference to the fragment its tail was in, once the inode no longer points at it
+// A fragment that is left mostly empty is repacked
+int release_file_tail_disk(FILE* disk, const int block_number) {
+    const auto remaining = release_data_block_disk(disk, block_number);
+    if (remaining <= 0) return remaining;
+
+    struct inode* inodes = read_inode_table_disk(disk);
+    if (!inodes) return -1;
+
+    int used_bytes = 0;
+    struct tail_slice* slices = arena_alloc(superblock.inode_count * sizeof(struct tail_slice));
+    if (!slices) return -1;
+    const int num_slices = collect_tail_slices(inodes, slices);
+    int end = 0;
+    for (int i = 0; i < num_slices; i++) {
+        if (slices[i].block_number != block_number) continue;
+
+        // Shared slices only count once
+        used_bytes += MAX(0, slices[i].offset + slices[i].length - MAX(end, slices[i].offset));
+        end = MAX(end, slices[i].offset + slices[i].length);
+    }
+
+    if (used_bytes < SPARSE_FRAGMENT_BYTES) return repack_fragment_disk(disk, block_number);
+    return remaining;
+}
+
+// Moves a packed tail back into a block of its own, so the file can be changed like any other
+int unpack_file_tail_disk(FILE* disk, const int inode_number, struct inode* inode) {
+    if (inode->tail_block == 0) return 0;
+
+    const int length = get_tail_length(inode);
+    const int pointer_index = inode->file_size / superblock.block_size;
+    uint8_t* data = acquire_io_buffer();
+    if (!data) return -1;
+
+    int block_number = -1;
+    if (read_data_from_block_at_disk(disk, inode->tail_block, inode->tail_offset, data, length) == 0) {
+        block_number = find_next_free_data_block_disk(disk);
+        if (block_number == -1) printf("No free data blocks in disk, unable to unpack tail of inode %d\n", inode_number);
+    }
+    if (block_number != -1) {
+        set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+        if (write_data_to_block_disk(disk, block_number, data, length) != 0) block_number = -1;
+    }
+    release_io_buffer(data);
+    if (block_number == -1) return -1;
+
+    const int fragment = inode->tail_block;
+    inode->block_pointers[pointer_index] = block_number;
+    inode->tail_block = 0;
+    inode->tail_offset = 0;
+    write_barrier(disk);
+    if (write_inode_disk(disk, inode_number, inode) != 0) return -1;
+    write_barrier(disk);
+
+    return release_file_tail_disk(disk, fragment) < 0 ? -1 : 0;
+}
+
+// Moves the last partial block of a file into a fragment, if packing is on and the block isn't shared
+// An empty file gives up its first block instead
+int pack_file_tail_disk(FILE* disk, const int inode_number, struct inode* inode) {
+    const int length = inode->file_size % superblock.block_size;
+    const int pointer_index = inode->file_size / superblock.block_size;
+    if (!tail_packing_enabled() || inode->tail_block != 0 || (length == 0 && inode->file_size != 0)) return 0;
+
+    const int block_number = inode->block_pointers[pointer_index];
+    if (block_number == 0) return 0;
+
+    if (inode->file_size == 0) {
+        inode->block_pointers[0] = 0;
+        write_barrier(disk);
+        if (write_inode_disk(disk, inode_number, inode) != 0) return -1;
+        write_barrier(disk);
+        return release_data_block_disk(disk, block_number) < 0 ? -1 : 0;
+    }
+
+    struct block_info info;
+    if (read_block_info_disk(disk, block_number, &info) != 0) return -1;
+    if (info.reference_count > 1) return 0;
+
+    uint8_t* data = acquire_io_buffer();
+    struct inode* inodes = read_inode_table_disk(disk);
+    if (!data || !inodes || read_data_from_block_disk(disk, block_number, data, length) != 0 ||
+        store_file_tail_disk(disk, inodes, inode, data, length) == -1) {
+        if (data) release_io_buffer(data);
+        return -1;
+    }
+    release_io_buffer(data);
+
+    inode->block_pointers[pointer_index] = 0;
+    write_barrier(disk);
+    if (write_inode_disk(disk, inode_number, inode) != 0) return -1;
+    write_barrier(disk);
+
+    return release_data_block_disk(disk, block_number) < 0 ? -1 : 0;
+}
+
+// Finds the first inode that is not being used
 // Returns -1 if all inodes are being used
 int find_next_free_inode() {
+    TRACE_SCOPE("find_free_inode", "allocation");
+
+    if (superblock.free_inode_count == 0) return -1;
+
     // Start checking at inode 1 because inode 0 is always the root node
-    for (int i = 1; i < DEFAULT_INODE_COUNT; i++) {
+    // Every inode before the first free hint is in use
+    for (int i = MAX(1, superblock.first_free_inode); i < superblock.inode_count; i++) {
+        struct inode inode;
+        read_inode(i, &inode);
+
+        if (!inode.is_used) return i;
+    }
+
+    return -1;
+}
+
+// Returns the number of dentries in the specified directory
+int get_num_dentries(const int directory_number) {
+    struct inode directory_inode;
+    read_inode(directory_number, &directory_inode);
+    return (int) (directory_inode.file_size / sizeof(struct dentry));
+}
+
+// Recounts free data blocks and inodes from the bitmap and inode table and updates the superblock's summary
+// Returns 1 if the summary was out of date, 0 if it was correct, -1 on error
+int recalculate_free_space_summary() {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    uint8_t* bitmap = arena_alloc(superblock.block_count / 8);
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    if (!bitmap || !inodes ||
+        disk_read_at(disk, FREE_BITMAP_START, bitmap, superblock.block_count / 8) != 0 ||
+        disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) != 0) {
+        printf("File error: could not read free bitmap and inode table\n");
+        fclose(disk);
+        return -1;
+    }
+
+    struct superblock summary = superblock;
+    summary.free_block_count = 0;
+    summary.first_free_block = superblock.block_count;
+    for (int i = superblock.block_count - 1; i >= 0; i--) {
+        if (bitmap[i / 8] & (128 >> (i % 8))) continue;
+
+        summary.free_block_count++;
+        summary.first_free_block = i;
+    }
+
+    summary.free_inode_count = 0;
+    summary.first_free_inode = superblock.inode_count;
+    for (int i = superblock.inode_count - 1; i >= 1; i--) {
+        if (inodes[i].is_used) continue;
+
+        summary.free_inode_count++;
+        summary.first_free_inode = i;
+    }
+
+    const bool changed = memcmp(&summary, &superblock, sizeof(summary)) != 0;
+    if (changed) {
+        superblock = summary;
+        write_superblock_disk(disk);
+    }
+
+    fclose(disk);
+    return changed ? 1 : 0;
+}
+
+// Finds all the dentries in the specified directory, the list lives in the arena
+struct dentry* get_dentries(const int directory_number, int* num_dentries) {
+    TRACE_SCOPE("get_dentries", "directory");
+    struct inode directory_inode;
+    read_inode(directory_number, &directory_inode);
+
+    int num_dentries_remaining = (int) (directory_inode.file_size / sizeof(struct dentry));
+    if (num_dentries) {
+        *num_dentries = num_dentries_remaining;
+    }
+
+    struct dentry* dentries = arena_alloc(num_dentries_remaining * sizeof(struct dentry));
+    if (!dentries) {
+        printf("Error: Failed to allocate memory for dentries\n");
+        return nullptr;
+    }
+
+    int dentries_read = 0;
+    int blocks_read = 0;
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return nullptr;
+    }
+
+    // Acquire all dentries
+    while (num_dentries_remaining > 0) {
+        // Either read 4 dentries, or read the number left if less than 4
+        int dentries_to_read = DENTRIES_PER_BLOCK;
+        if (num_dentries_remaining < dentries_to_read) dentries_to_read = num_dentries_remaining;
+
+        read_data_from_block_disk(disk, directory_inode.block_pointers[blocks_read],
+            &dentries[dentries_read], sizeof(struct dentry) * dentries_to_read);
+
+        dentries_read += dentries_to_read;
+        num_dentries_remaining -= dentries_to_read;
+        blocks_read++;
+    }
+
+    fclose(disk);
+    return dentries;
+}
+
+#define MAX_DENTRIES_PER_BLOCK (DEFAULT_BLOCK_SIZE / sizeof(struct dentry))
+
+// Walks the dentries of a directory one data block at a time, without reading the whole directory up front
+struct directory_iterator {
+    FILE* disk;
+    bool owns_disk; // The iterator opened the disk itself and closes it when done
+    struct inode directory_inode;
+    int num_dentries;
+    int next_dentry; // Index of the dentry that the next call to next_dentry returns
+    struct dentry block[MAX_DENTRIES_PER_BLOCK]; // Dentries of the data block next_dentry is in
+};
+
+// Starts iterating over the given directory, uses disk if it isn't nullptr
+int open_directory(struct directory_iterator* iterator, FILE* disk, const int directory_number) {
+    iterator->owns_disk = disk == nullptr;
+    if (!disk) {
+        disk = open_disk(DEFAULT_DISK_NAME, "rb");
+        if (!disk) {
+            printf("File error: Failed to open disk\n");
+            return -1;
+        }
+    }
+
+    iterator->disk = disk;
+    iterator->next_dentry = 0;
+
+    if (read_inode_disk(disk, directory_number, &iterator->directory_inode) != 0) {
+        if (iterator->owns_disk) fclose(disk);
+        return -1;
+    }
+    iterator->num_dentries = (int) (iterator->directory_inode.file_size / sizeof(struct dentry));
+
+    return 0;
+}
+
+// Returns the next dentry in the directory, or nullptr once every dentry has been returned
+// The dentry is only valid until the next call
+const struct dentry* next_dentry(struct directory_iterator* iterator) {
+    if (iterator->next_dentry >= iterator->num_dentries) return nullptr;
+
+    const int index_in_block = iterator->next_dentry % DENTRIES_PER_BLOCK;
+    if (index_in_block == 0) {
+        TRACE_SCOPE("read_dentry_block", "directory");
+
+        // Either read a full block of dentries, or the number left if that's fewer
+        const int dentries_to_read = MIN(DENTRIES_PER_BLOCK, iterator->num_dentries - iterator->next_dentry);
+        const auto block_number = iterator->directory_inode.block_pointers[iterator->next_dentry / DENTRIES_PER_BLOCK];
+
+        if (read_data_from_block_disk(iterator->disk, block_number, iterator->block,
+            sizeof(struct dentry) * dentries_to_read) != 0) {
+            iterator->num_dentries = 0;
+            return nullptr;
+        }
+    }
+
+    iterator->next_dentry++;
+    return &iterator->block[index_in_block];
+}
+
+void close_directory(struct directory_iterator* iterator) {
+    if (iterator->owns_disk) fclose(iterator->disk);
+}
+
+// NAME FILTERS
+// Every directory that has been looked up in gets a Bloom filter of its names, kept in memory only. Most
+// lookups for a name that isn't there, like the check before every create, are answered without reading
+// any of the directory's blocks
+// A filter is built by scanning the directory on the first lookup and new dentries are added to it. Removed
+// names can't be taken back out, so once half of the names in a filter are gone it is rebuilt on the next lookup
+
+#define NAME_FILTER_BITS 1024 // Under 0.1% false positives for a full directory
+#define NAME_FILTER_HASHES 4
+
+struct name_filter {
+    bool built;
+    uint16_t num_names; // Names added since the filter was built
+    uint16_t num_removed; // Names removed since the filter was built
+    uint64_t bits[NAME_FILTER_BITS / 64];
+};
+
+struct name_filter* name_filters = nullptr; // One per inode, nullptr until the first lookup
+
+// Forgets every filter, for when the disk is replaced or repaired
+void free_name_filters() {
+    free(name_filters);
+    name_filters = nullptr;
+}
+
+// The filter of a directory that was removed or created from scratch has to be built again
+void forget_name_filter(const int directory) {
+    if (name_filters) name_filters[directory].built = false;
+}
+
+// Two independent hashes of the name, the filter's hashes are combinations of them
+void get_name_hashes(const char* name, uint32_t* first, uint32_t* second) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211ull;
+    }
+
+    *first = (uint32_t) hash;
+    *second = (uint32_t) (hash >> 32) | 1;
+}
+
+void name_filter_add(struct name_filter* filter, const char* name) {
+    uint32_t first, second;
+    get_name_hashes(name, &first, &second);
+
+    for (uint32_t i = 0; i < NAME_FILTER_HASHES; i++) {
+        const uint32_t bit = (first + i * second) % NAME_FILTER_BITS;
+        filter->bits[bit / 64] |= 1ull << (bit % 64);
+    }
+    filter->num_names++;
+}
+
+bool name_filter_may_contain(const struct name_filter* filter, const char* name) {
+    uint32_t first, second;
+    get_name_hashes(name, &first, &second);
+
+    for (uint32_t i = 0; i < NAME_FILTER_HASHES; i++) {
+        const uint32_t bit = (first + i * second) % NAME_FILTER_BITS;
+        if (!(filter->bits[bit / 64] & (1ull << (bit % 64)))) return false;
+    }
+
+    return true;
+}
+
+// Returns the directory's filter, building it first if needed, or nullptr if it couldn't be built
+struct name_filter* get_name_filter(const int directory) {
+    if (directory < 0 || directory >= superblock.inode_count) return nullptr;
+
+    if (!name_filters) {
+        name_filters = calloc(superblock.inode_count, sizeof(struct name_filter));
+        if (!name_filters) return nullptr;
+    }
+
+    auto filter = &name_filters[directory];
+    if (filter->built && filter->num_removed * 2 <= filter->num_names) return filter;
+
+    TRACE_SCOPE("build_name_filter", "directory");
+    memset(filter, 0, sizeof(*filter));
+
+    struct directory_iterator iterator;
+    if (open_directory(&iterator, nullptr, directory) != 0) return nullptr;
+
+    const struct dentry* dentry;
+    while ((dentry = next_dentry(&iterator)) != nullptr) name_filter_add(filter, dentry->name);
+    // A failed read ends the iteration early, so the filter would be missing names
+    filter->built = iterator.next_dentry == iterator.num_dentries;
+    close_directory(&iterator);
+
+    return filter->built ? filter : nullptr;
+}
+
+// Only filters that are already built are kept up to date, the rest pick the name up when they are built
+void name_filter_dentry_added(const int directory, const char* name) {
+    if (name_filters && name_filters[directory].built) name_filter_add(&name_filters[directory], name);
+}
+
+void name_filter_dentry_removed(const int directory) {
+    if (name_filters && name_filters[directory].built) name_filters[directory].num_removed++;
+}
+
+// Adds the specified dentry to the specified directory
+int create_dentry(const struct dentry* dentry, const int directory) {
+    struct inode dir_inode;
+    read_inode(directory, &dir_inode);
+
+    // The number of dentries the cwd currently has determines where the next one goes
+    const int num_dentries = (int) (dir_inode.file_size / sizeof(struct dentry));
+    if (num_dentries / DENTRIES_PER_BLOCK >= NUM_BLOCK_POINTERS) {
+        printf("Directory inode %d is full\n", directory);
+        return -1;
+    }
+
+    int block_number = dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK];
+
+    if (num_dentries % DENTRIES_PER_BLOCK == 0) {
+        // New data block must be allocated for the new dentry to be created
+        block_number = find_next_free_data_block();
+        if (block_number == -1) {
+            return -1;
+        }
+
+        dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK] = block_number;
+        // printf("Block pointer %d set to %d\n", num_dentries / DENTRIES_PER_BLOCK, block_number);
+        set_data_block_status(block_number, DATA_BLOCK_USED);
+
+        if (verbose) printf("Allocated new data block %d for directory, inode %d\n", block_number, directory);
+    }
+    dir_inode.file_size += sizeof(struct dentry);
+
+    const size_t offset = (num_dentries % DENTRIES_PER_BLOCK) * sizeof(struct dentry);
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const auto result = write_data_to_block_at_disk(disk, block_number, offset, dentry, sizeof(struct dentry));
+
+    if (result != 0) {
+        printf("File error: failed to write dentry to data block %d\n", block_number);
+        fclose(disk);
+        return result;
+    }
+
+    // set_data_block_status(block_number, DATA_BLOCK_USED);
+    write_inode(directory, &dir_inode);
+    name_filter_dentry_added(directory, dentry->name);
+
+    fclose(disk);
+    return 0;
+}
+
+// Adds the specified dentry to the cwd
+int create_dentry_cwd(const struct dentry* dentry) {
+    return create_dentry(dentry, current_working_directory);
+}
+
+// Removes the specified dentry from the specified directory
+int remove_dentry(const int dir_inode_number, const int dentry_number) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode dir_inode;
+    read_inode_disk(disk, dir_inode_number, &dir_inode);
+    const int num_dentries = (int) (dir_inode.file_size / sizeof(struct dentry));
+
+    // Remove corresponding dentry from this directory
+    // Do this by overwriting corresponding dentry with the last dentry in the directory
+    // Only the last dentry is read, so removal costs the same no matter how large the directory is
+    // Only needed if the dentry to be removed is NOT the last dentry in the list
+    if (dentry_number != num_dentries - 1) {
+        struct dentry last_dentry;
+        const auto last_block_number = dir_inode.block_pointers[(num_dentries - 1) / DENTRIES_PER_BLOCK];
+        const size_t last_offset = ((num_dentries - 1) % DENTRIES_PER_BLOCK) * sizeof(struct dentry);
+
+        if (read_data_from_block_at_disk(disk, last_block_number, last_offset, &last_dentry, sizeof(struct dentry)) != 0) {
+            printf("File error: failed to read dentry from data block %d\n", last_block_number);
+            fclose(disk);
+            return -1;
+        }
+
+        const auto block_number = dir_inode.block_pointers[(dentry_number / DENTRIES_PER_BLOCK)];
+        const size_t offset = (dentry_number % DENTRIES_PER_BLOCK) * sizeof(struct dentry);
+
+        const auto result = write_data_to_block_at_disk(disk, block_number, offset, &last_dentry, sizeof(struct dentry));
+
+        if (result != 0) {
+            printf("File error: failed to write dentry to data block %d\n", block_number);
+            fclose(disk);
+            return result;
+        }
+    }
+
+    dir_inode.file_size -= sizeof(struct dentry);
+    // Set last data block as free if the last dentry was just copied out of it
+    int freed_block_number = 0;
+    if (num_dentries % DENTRIES_PER_BLOCK == 1) {
+        freed_block_number = dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK];
+        // Clear the pointer so removing the directory later doesn't free the block a second time
+        dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK] = 0;
+    }
+
+    write_inode_disk(disk, dir_inode_number, &dir_inode);
+    name_filter_dentry_removed(dir_inode_number);
+
+    if (freed_block_number != 0) {
+        write_barrier(disk);
+        set_data_block_status_disk(disk, freed_block_number, DATA_BLOCK_FREE);
+
+        if (verbose) printf("Data block %d for directory %d is now free\n", freed_block_number, dir_inode_number);
+    }
+
+    fclose(disk);
+    return 0;
+}
+
+// Returns the index of the given file's dentry within the given directory and copies the dentry into found
+// Returns -1 if the file does not exist
+int get_dentry_number_of_file(const int directory_number, const char* filename, const int expected_file_type,
+    struct dentry* found) {
+    // Without a filter the directory is simply scanned
+    const auto filter = get_name_filter(directory_number);
+    if (filter && !name_filter_may_contain(filter, filename)) return -1;
+
+    struct directory_iterator iterator;
+    if (open_directory(&iterator, nullptr, directory_number) != 0) return -1;
+
+    // Stop reading the directory as soon as the file is found
+    int dentry_number = -1;
+    const struct dentry* dentry;
+    while ((dentry = next_dentry(&iterator)) != nullptr) {
+        if (strcmp(dentry->name, filename) == 0 && dentry->file_type == expected_file_type) {
+            dentry_number = iterator.next_dentry - 1;
+            *found = *dentry;
+            break;
+        }
+    }
+
+    close_directory(&iterator);
+    return dentry_number;
+}
+
+// Returns the inode number of the given file within the given directory
+// Returns -1 if the file does not exist
+int get_inode_number_of_file(const int directory_number, const char* filename, const int expected_file_type) {
+    struct dentry dentry;
+    if (get_dentry_number_of_file(directory_number, filename, expected_file_type, &dentry) == -1) return -1;
+
+    return dentry.inode_number;
+}
+
+// If path is dir/dir/.../file, sets 'last' to 'file'
+char* get_last_of_path(char* path) {
+    char* last = strrchr(path, '/');
+
+    if (last != nullptr) {
+        return last + 1;
+    }
+
+    return path;
+}
+
+char* get_all_except_last_of_path(char* path) {
+    char* last_slash = strrchr(path, '/');
+    if (last_slash != nullptr) {
+        *last_slash = '\0';
+        return path;
+    }
+
+    return "";
+}
+
+// Follows a path (dir/dir/dir/...) to find the inode number of the file/directory at the end
+// Returns 0 if reach the end, 1 if reach the directory before the final file, -1 otherwise
+int get_inode_number_of_path(const char path[MAX_PATH_LEN], const int expected_file_type, int* result) {
+    TRACE_SCOPE("get_inode_number_of_path", "lookup");
+    auto current_directory = current_working_directory;
+
+    // Follow the path to get to the final directory/file
+    char copied_path[MAX_PATH_LEN];
+    strcpy(copied_path, path);
+    auto dir = strtok(copied_path, "/");
+
+    while (dir != nullptr) {
+        // Find the next directory in the path to see if we've reached the end of the path
+        const auto next_dir = strtok(nullptr, "/");
+        const int current_expected_file_type = (next_dir == nullptr) ? expected_file_type : TYPE_DIRECTORY;
+
+        const auto inode_number = get_inode_number_of_file(current_directory, dir, current_expected_file_type);
+        if (inode_number == -1) {
+            if (next_dir != nullptr) {
+                // One of the directories in the middle of the path does not exist
+                printf("Directory %s does not exist\n", dir);
+                return -1;
+            }
+
+            // The file does not exist, but the directory that should contain it does
+            *result = current_directory;
+            return 1;
+        }
+
+        current_directory = inode_number;
+        dir = next_dir;
+    }
+
+    *result = current_directory;
+    return 0;
+}
+
+// Creates the data-only member files of a striped volume, filled with empty data blocks
+int create_member_files(const char* disk_name) {
+    // Members past the new count are left over from a volume that had more of them
+    for (int member = superblock.stripe_members; member < MAX_STRIPE_MEMBERS; member++) {
+        char name[MAX_ARG_LEN + 8];
+        get_member_file_name(disk_name, member, name, sizeof(name));
+        remove(name);
+    }
+
+    for (int member = 1; member < superblock.stripe_members; member++) {
+        char name[MAX_ARG_LEN + 8];
+        get_member_file_name(disk_name, member, name, sizeof(name));
+
+        const int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        const off_t size = (off_t) get_member_block_count(member) * superblock.block_size;
+        if (fd == -1 || ftruncate(fd, size) != 0) {
+            printf("Failed to create volume member: %s\n", name);
+            if (fd != -1) close(fd);
+            return -1;
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+int run_command_init(const char* disk_name, const int stripe_members, const int stripe_unit) {
+    const auto block_count = calculate_block_count(DEFAULT_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+
+    // The root directory's inode and data block get marked as used below
+    const struct superblock sb = {DEFAULT_SIZE, 1, DEFAULT_BLOCK_SIZE, block_count, sizeof(struct inode), DEFAULT_INODE_COUNT,
+        0, block_count, DEFAULT_INODE_COUNT - 1, 0, 1, stripe_members, stripe_unit};
+    superblock = sb;
+    superblock.checksum = superblock_checksum(&superblock);
+    calculate_disk_structure();
+    free_dedup_index();
+    free_name_filters();
+
+    // Nothing has been written to any data block yet
+    free_block_checksums();
+    free_pending_discards();
+    block_checksums = calloc(block_count, sizeof(uint32_t));
+
+    FILE *disk = open_disk(disk_name, "w+b");
+    if (disk == nullptr) {
+        printf("Failed to open disk: %s\n", disk_name);
+        return 1;
+    }
+
+    // Write superblock to the beginning of the disk
+    if (disk_write(disk, &superblock, sizeof(struct superblock)) != 0) {
+        fclose(disk);
+        printf("File error: could not write superblock to the disk\n");
+        return -1;
+    }
+
+    // Create root inode (always inode 0)
+    struct inode root_inode = {superblock.generation};
+    root_inode.file_size = sizeof(struct dentry) * 2;
+    root_inode.block_pointers[0] = 0;
+    root_inode.is_used = true;
+    root_inode.checksum = inode_checksum(&root_inode);
+
+    if (disk_write(disk, &root_inode, sizeof(struct inode)) != 0) {
+        fclose(disk);
+        printf("File error: could not write root inode to the disk\n");
+        return -1;
+    }
+
+    // Write blank inodes to the disk next, everything starts out in the first generation
+    const struct inode inode = {superblock.generation};
+    for (int i = 0; i < DEFAULT_INODE_COUNT - 1; i++) {
+        if (disk_write(disk, &inode, sizeof(struct inode)) != 0) {
+            fclose(disk);
+            printf("File error: could not write inode %d to the disk\n", i);
+            return -1;
+        }
+    }
+
+    // Write blank bytes for free space bitmap
+    uint8_t bitmap[block_count / 8];
+    memset(bitmap, 0, block_count / 8);
+    if (disk_write(disk, &bitmap, sizeof(bitmap)) != 0) {
+        fclose(disk);
+        printf("File error: could not write free block bitmap to the disk\n");
+        return -1;
+    }
+
+    // Write blank block info entries, no block is referenced yet
+    const struct block_info info = {0, 0, superblock.generation, 0};
+    for (int i = 0; i < block_count; i++) {
+        if (disk_write(disk, &info, sizeof(struct block_info)) != 0) {
+            fclose(disk);
+            printf("File error: could not write block info %d to the disk\n", i);
+            return -1;
+        }
+    }
+
+    // The data blocks stored on the disk itself start out as one hole, which reads as empty blocks
+    // Data blocks are written through the volume from here on
+    fflush(disk);
+    if (ftruncate(fileno(disk), DATA_START + (off_t) get_member_block_count(0) * DEFAULT_BLOCK_SIZE) != 0) {
+        fclose(disk);
+        printf("File error: could not size the disk for its data blocks\n");
+        return -1;
+    }
+    if (create_member_files(disk_name) != 0 || open_volume(disk_name) != 0) {
+        fclose(disk);
+        superblock_loaded = false;
+        return -1;
+    }
+
+    // Initialize root directory's data block
+    const struct dentry entries[] = {
+        {0, TYPE_DIRECTORY, "."},
+        {0, TYPE_DIRECTORY, ".."}
+    };
+    write_data_to_block_disk(disk, 0, entries, sizeof(entries));
+    set_data_block_status_disk(disk, 0, DATA_BLOCK_USED);
+    // The disk is still open, so the summary that counts the root's block goes out with it
+    write_superblock_disk(disk);
+
+    current_working_directory = 0;
+
+    if (verbose) printf("Initialized NanoFS system: %s\n", disk_name);
+    if (verbose && stripe_members > 1) {
+        printf("Data blocks are striped over %d files, %d block(s) at a time\n", stripe_members, stripe_unit);
+    }
+
+    fclose(disk);
+    return 0;
+}
+
+#define LS_BATCH_SIZE 32
+
+struct ls_entry {
+    struct dentry dentry;
+    int position; // Position of the dentry within the batch, in directory order
+    struct inode inode;
+};
+
+int compare_ls_entries_by_inode(const void* a, const void* b) {
+    return ((const struct ls_entry*) a)->dentry.inode_number - ((const struct ls_entry*) b)->dentry.inode_number;
+}
+
+int compare_ls_entries_by_position(const void* a, const void* b) {
+    return ((const struct ls_entry*) a)->position - ((const struct ls_entry*) b)->position;
+}
+
+// Reads the inodes of a batch of entries in inode number order
+// Runs of consecutive inode numbers are read from the inode table in one go
+int read_ls_batch_inodes(FILE* disk, struct ls_entry* entries, const int num_entries) {
+    qsort(entries, num_entries, sizeof(struct ls_entry), compare_ls_entries_by_inode);
+
+    int run_start = 0;
+    while (run_start < num_entries) {
+        // Find the end of the run, entries with the same inode number (. and ..) share one read
+        int run_end = run_start + 1;
+        while (run_end < num_entries &&
+            entries[run_end].dentry.inode_number - entries[run_end - 1].dentry.inode_number <= 1) {
+            run_end++;
+        }
+
+        const int first_inode = entries[run_start].dentry.inode_number;
+        const int num_inodes = entries[run_end - 1].dentry.inode_number - first_inode + 1;
+        struct inode inodes[num_inodes];
+
+        if (disk_read_at(disk, INODE_TABLE_START + first_inode * sizeof(struct inode), inodes, sizeof(inodes)) != 0) {
+            printf("File error: could not read inodes %d to %d\n", first_inode, first_inode + num_inodes - 1);
+            return -1;
+        }
+
+        for (int i = run_start; i < run_end; i++) {
+            const auto inode = &inodes[entries[i].dentry.inode_number - first_inode];
+            if (verify_inode_checksum(entries[i].dentry.inode_number, inode) != 0) return -1;
+
+            entries[i].inode = *inode;
+        }
+        run_start = run_end;
+    }
+
+    qsort(entries, num_entries, sizeof(struct ls_entry), compare_ls_entries_by_position);
+    return 0;
+}
+
+void print_ls_batch(const struct ls_entry* entries, const int num_entries) {
+    for (int i = 0; i < num_entries; i++) {
+        printf("%c %6d %4d %s\n", entries[i].dentry.file_type == TYPE_DIRECTORY ? 'd' : '-',
+            entries[i].inode.file_size, entries[i].dentry.inode_number, entries[i].dentry.name);
+    }
+}
+
+// Lists the cwd, with 'ls -l' also showing each entry's type, size and inode
+// The directory is streamed, so only one block of dentries (or one batch for -l) is held in memory
+int run_command_ls(const bool long_format) {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("File error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct directory_iterator iterator;
+    if (open_directory(&iterator, disk, current_working_directory) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    struct ls_entry batch[long_format ? LS_BATCH_SIZE : 1];
+    int batch_size = 0;
+    int result = 0;
+
+    const struct dentry* dentry;
+    while ((dentry = next_dentry(&iterator)) != nullptr) {
+        if (!long_format) {
+            printf("%s ", dentry->name);
+            continue;
+        }
+
+        batch[batch_size].dentry = *dentry;
+        batch[batch_size].position = batch_size;
+        batch_size++;
+
+        if (batch_size == LS_BATCH_SIZE) {
+            // Reading the inodes moves the disk's position, which the iterator doesn't rely on
+            result = read_ls_batch_inodes(disk, batch, batch_size);
+            if (result != 0) break;
+
+            print_ls_batch(batch, batch_size);
+            batch_size = 0;
+        }
+    }
+
+    if (long_format && result == 0 && batch_size > 0) {
+        result = read_ls_batch_inodes(disk, batch, batch_size);
+        if (result == 0) print_ls_batch(batch, batch_size);
+    }
+    if (!long_format) printf("\n");
+
+    close_directory(&iterator);
+    fclose(disk);
+    return result;
+}
+
+// Marks inode as unused and releases all of its data blocks
+void remove_element(const int inode_number, const uint8_t file_type) {
+    struct inode inode;
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return;
+    }
+
+    read_inode(inode_number, &inode);
+
+    const int num_block_pointers = ceil((double) inode.file_size / (double) superblock.block_size);
+
+    if (file_type == TYPE_DIRECTORY) forget_name_filter(inode_number);
+
+    // The inode is freed first, so its blocks are never free while an inode in use still points at them
+    struct inode freed_inode = inode;
+    freed_inode.is_used = 0;
+    write_inode_disk(disk, inode_number, &freed_inode);
+    update_free_inode_summary(inode_number, false);
+    write_barrier(disk);
+
+    // printf("Freeing data blocks for inode %d...\n", inode_number);
+    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+        // Files can have holes, so keep going past unused pointers
+        if (inode.block_pointers[i] == 0) continue;
+        // printf("Freeing data block %d, block pointer %d\n", inode.block_pointers[i], i);
+        // Blocks shared with other files stay in use until their last reference is dropped
+        release_data_block_disk(disk, inode.block_pointers[i]);
+    }
+    if (inode.tail_block != 0) release_file_tail_disk(disk, inode.tail_block);
+
+    fclose(disk);
+}
+
+int run_command_create(char* file_path) {
+    int inode_number_dir;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number_dir);
+
+    // Check if a file with the same name exists in the cwd
+    if (result == 0) {
+        printf("File %s already exists in the current directory\n", file_path);
+        return 1;
+    }
+    if (result == -1) {
+        // Path could not be resolved
+        return -1;
+    }
+
+    // Make sure the disk has a spare inode and data block
+    const auto inode_number = find_next_free_inode();
+
+    if (inode_number == -1) {
+        printf("All inodes are being used, unable to create file\n");
+        return -1;
+    }
+
+    // Packed files get their first slice when they are written
+    const auto data_block_number = tail_packing_enabled() ? 0 : find_next_free_data_block();
+
+    if (data_block_number == -1) {
+        printf("All data blocks are being used, unable to create file\n");
+        return -1;
+    }
+
+    if (data_block_number != 0) set_data_block_status(data_block_number, DATA_BLOCK_USED);
+
+    struct dentry dentry = {inode_number, TYPE_FILE};
+    const char* filename = get_last_of_path(file_path);
+    strcpy(dentry.name, filename);
+    struct inode inode = {0};
+    inode.file_size = 0;
+    inode.block_pointers[0] = data_block_number;
+    inode.is_used = true;
+
+    // The inode has to exist before a dentry can name it
+    write_inode(inode_number, &inode);
+    update_free_inode_summary(inode_number, true);
+    write_barrier(nullptr);
+
+    if (create_dentry(&dentry, inode_number_dir) == -1) {
+        printf("All data blocks are being used, unable to create new dentry\n");
+        remove_element(inode_number, TYPE_FILE);
+        return -1;
+    }
+
+    if (verbose && data_block_number == 0) {
+        printf("Created new file %s, inode %d, its data will be packed\n", file_path, inode_number);
+    } else if (verbose) {
+        printf("Created new file %s, inode %d, data block %d\n", file_path, inode_number, data_block_number);
+    }
+
+    return 0;
+}
+
+// Detaches every block past the first blocks_to_keep from the inode and lists them in released_blocks
+// The blocks are only released once the inode no longer points at them on disk
+int detach_blocks_past_disk(struct inode* inode, const int blocks_to_keep, int* released_blocks) {
+    int num_released_blocks = 0;
+    for (int i = blocks_to_keep; i < NUM_BLOCK_POINTERS; i++) {
+        if (inode->block_pointers[i] == 0) continue;
+
+        released_blocks[num_released_blocks++] = inode->block_pointers[i];
+        inode->block_pointers[i] = 0;
+    }
+
+    return num_released_blocks;
+}
+
+void release_detached_blocks_disk(FILE* disk, const int* released_blocks, const int num_released_blocks, const char* file_path) {
+    for (int i = 0; i < num_released_blocks; i++) {
+        // Blocks shared with other files stay in use until their last reference is dropped
+        if (release_data_block_disk(disk, released_blocks[i]) == 0 && verbose) {
+            printf("Data block %d for file %s is now free\n", released_blocks[i], file_path);
+        }
+    }
+}
+
+// Replaces the contents of a packed file with a new slice, then gives up its old slice and blocks
+int write_packed_file_disk(FILE* disk, const int inode_number, struct inode* inode, const char* content, const int size) {
+    struct inode* inodes = read_inode_table_disk(disk);
+    if (!inodes) return -1;
+
+    const struct inode old_inode = *inode;
+    inode->file_size = size;
+    inode->tail_block = 0;
+    inode->tail_offset = 0;
+    memset(inode->block_pointers, 0, sizeof(inode->block_pointers));
+    if (size > 0 && store_file_tail_disk(disk, inodes, inode, content, size) == -1) return -1;
+
+    write_barrier(disk);
+    if (write_inode_disk(disk, inode_number, inode) != 0) return -1;
+    write_barrier(disk);
+
+    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+        if (old_inode.block_pointers[i] != 0) release_data_block_disk(disk, old_inode.block_pointers[i]);
+    }
+    if (old_inode.tail_block != 0 && release_file_tail_disk(disk, old_inode.tail_block) < 0) return -1;
+
+    return 0;
+}
+
+int run_command_write(char* file_path, const char* content) {
+    int inode_number;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+
+    if (result != 0) {
+        printf("File %s does not exist in the current directory\n", file_path);
+        return 1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode inode;
+    read_inode_disk(disk, inode_number, &inode);
+    const int data_size = (int) strlen(content);
+
+    if (tail_packing_enabled()) {
+        const auto packed = write_packed_file_disk(disk, inode_number, &inode, content, data_size);
+        fclose(disk);
+        if (packed != 0) return -1;
+
+        if (verbose && inode.tail_block != 0) {
+            printf("Wrote %d bytes to file %s, inode %d, packed into data block %d at offset %d\n",
+                data_size, file_path, inode_number, inode.tail_block, inode.tail_offset);
+        } else if (verbose) {
+            printf("Wrote %d bytes to file %s, inode %d\n", data_size, file_path, inode_number);
+        }
+        return 0;
+    }
+
+    // A file that was packed, or emptied while packing was on, has no first block
+    if (unpack_file_tail_disk(disk, inode_number, &inode) != 0) {
+        fclose(disk);
+        return -1;
+    }
+    int replaced_block = 0;
+    if (inode.block_pointers[0] == 0) {
+        const auto block_number = find_next_free_data_block_disk(disk);
+        if (block_number == -1) {
+            printf("No free data blocks in disk\n");
+            fclose(disk);
+            return -1;
+        }
+        set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+        inode.block_pointers[0] = block_number;
+    } else if (prepare_block_for_write_disk(disk, &inode, 0, &replaced_block) == -1) {
+        fclose(disk);
+        return -1;
+    }
+
+    inode.file_size = data_size;
+
+    // The new contents fit in the first block, the rest of a longer file is dropped so growing it again reads zeros
+    // A shared first block that was copied is released along with them
+    int released_blocks[NUM_BLOCK_POINTERS];
+    int num_released_blocks = detach_blocks_past_disk(&inode, 1, released_blocks);
+    if (replaced_block != 0) released_blocks[num_released_blocks++] = replaced_block;
+
+    write_data_to_block_disk(disk, inode.block_pointers[0], content, data_size);
+    write_barrier(disk);
+    write_inode_disk(disk, inode_number, &inode);
+    if (num_released_blocks > 0) write_barrier(disk);
+    release_detached_blocks_disk(disk, released_blocks, num_released_blocks, file_path);
+
+    if (verbose) printf("Wrote %d bytes to file %s, inode %d, data block %d\n",
+        data_size, file_path, inode_number, inode.block_pointers[0]);
+
+    fclose(disk);
+    return 0;
+}
+
+int run_command_read(char* file_path) {
+    int inode_number;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+
+    if (result != 0) {
+        if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
+        return 1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode inode;
+    read_inode_disk(disk, inode_number, &inode);
+    const auto data_size = MIN(inode.file_size, superblock.block_size);
+
+    // Pool buffers have room for more than a block, so there is always space for the terminator
+    char* data = acquire_io_buffer();
+    if (!data) {
+        printf("Error: Failed to allocate block buffer\n");
+        fclose(disk);
+        return -1;
+    }
+    // Files smaller than a block are either packed or in their first block
+    const bool packed = inode.tail_block != 0 && inode.file_size < superblock.block_size;
+    const int block_number = packed ? inode.tail_block : inode.block_pointers[0];
+    if (packed) {
+        read_data_from_block_at_disk(disk, inode.tail_block, inode.tail_offset, data, data_size);
+    } else if (block_number != 0) {
+        read_data_from_block_disk(disk, block_number, data, data_size);
+    } else {
+        memset(data, 0, data_size);
+    }
+    data[data_size] = '\0';
+
+    fclose(disk);
+
+    if (data_size > 0) printf("%s\n", data);
+    release_io_buffer(data);
+
+    if (verbose) printf("Read %d bytes from file %s, inode %d, data block %d\n",
+        data_size, file_path, inode_number, block_number);
+
+    return 0;
+}
+
+int run_command_open(char* file_path) {
+    int inode_number;
+    auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+
+    if (result != 0) {
+        printf("File %s does not exist in the current directory\n", file_path);
+        return 1;
+    }
+
+    struct inode inode;
+    read_inode(inode_number, &inode);
+    const auto data_size = inode.file_size;
+    int bytes_read = 0;
+    const int num_blocks = (data_size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+
+    if (verbose) printf("Copying %s, inode %d, into real filesystem\n", file_path, inode_number);
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    // All of the file's blocks are read as one batch, so blocks on different volume members are read in parallel
+    uint8_t* blocks[NUM_BLOCK_POINTERS];
+    struct block_request requests[NUM_BLOCK_POINTERS];
+    int num_requests = 0;
+    for (int i = 0; i < num_blocks; i++) {
+        const auto block_number = inode.block_pointers[i];
+        const auto bytes_to_read = MIN(data_size - i * DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+
+        blocks[i] = acquire_io_buffer();
+        if (!blocks[i]) {
+            printf("Error: Failed to allocate block buffer\n");
+            release_io_buffers(blocks, i);
+            fclose(disk);
+            return -1;
+        }
+
+        if (block_number == 0) {
+            // Sparse hole, nothing was ever written here
+            memset(blocks[i], 0, bytes_to_read);
+        } else {
+            requests[num_requests++] = (struct block_request) {block_number, blocks[i], bytes_to_read};
+        }
+    }
+    transfer_data_blocks_disk(disk, requests, num_requests, false);
+
+    // A packed tail is a slice of a fragment block, where the file's last block would be
+    const int tail_index = data_size / DEFAULT_BLOCK_SIZE;
+    if (inode.tail_block != 0) {
+        read_data_from_block_at_disk(disk, inode.tail_block, inode.tail_offset, blocks[tail_index], get_tail_length(&inode));
+    }
+    fclose(disk);
+
+    while (bytes_read < data_size) {
+        const auto bytes_to_read = MIN(data_size - bytes_read, DEFAULT_BLOCK_SIZE);
+
+        const auto block_number = inode.block_pointers[bytes_read / superblock.block_size];
+        if (inode.tail_block != 0 && bytes_read / superblock.block_size == tail_index) {
+            if (verbose) printf("Read %d bytes from data block %d at offset %d\n", bytes_to_read, inode.tail_block, inode.tail_offset);
+        } else if (block_number == 0) {
+            if (verbose) printf("Read %d bytes from a hole\n", bytes_to_read);
+        } else {
+            if (verbose) printf("Read %d bytes from data block %d\n", bytes_to_read, block_number);
+        }
+
+        bytes_read += bytes_to_read;
+    }
+
+    // +5 to give enough space for .txt\0
+    char output_file_name[strlen(file_path) + 5];
+    strcpy(output_file_name, file_path);
+    strcat(output_file_name, ".txt");
+
+    FILE* output_file = fopen(output_file_name, "wb");
+    if (!output_file) {
+        printf("Error: Failed to open disk\n");
+        release_io_buffers(blocks, num_blocks);
+        return -1;
+    }
+
+    // Written directly so the real file doesn't show up in the disk's I/O stats
+    result = 0;
+    for (int i = 0; i < num_blocks; i++) {
+        const size_t block_size = MIN(data_size - i * DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+        if (result == 0 && fwrite(blocks[i], 1, block_size, output_file) != block_size) result = -1;
+    }
+    fclose(output_file);
+    release_io_buffers(blocks, num_blocks);
+
+    if (result != 0) {
+        printf("File error: failed to write to real file %s", output_file_name);
+        return result;
+    }
+
+    if (verbose) printf("Finished copying. Wrote %d bytes total to %s\n", bytes_read, output_file_name);
+
+    return 0;
+}
+
+// Stores one block of a file being saved, sharing an existing block if one holds identical contents
+// data must have room for a full block, the bytes past size are zeroed so whole blocks can be compared
+// A block the pointer no longer refers to is handed back through replaced_block, to be released once the inode is written
+// Returns the block number the data ended up in, or -1 on error
+int save_block_deduplicated(FILE* disk, struct inode* inode, const int pointer_index, uint8_t* data, const int size,
+    int* replaced_block) {
+    memset(data + size, 0, superblock.block_size - size);
+    const auto hash = hash_block(data, superblock.block_size);
+    const int old_block_number = inode->block_pointers[pointer_index];
+    *replaced_block = 0;
+
+    const auto duplicate = find_duplicate_data_block_disk(disk, hash, data);
+    if (duplicate != -1) {
+        if (duplicate != old_block_number) {
+            acquire_data_block_disk(disk, duplicate);
+            inode->block_pointers[pointer_index] = duplicate;
+            *replaced_block = old_block_number;
+        }
+
+        if (verbose) printf("Deduplicated %d bytes into shared data block %d\n", size, duplicate);
+        return duplicate;
+    }
+
+    // No identical block exists, so the data needs a block of its own
+    int block_number;
+    if (old_block_number == 0) {
+        block_number = find_next_free_data_block_disk(disk);
+        if (block_number == -1) {
+            printf("No free data blocks in disk\n");
+            return -1;
+        }
+
+        set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+        inode->block_pointers[pointer_index] = block_number;
+    } else {
+        block_number = prepare_block_for_write_disk(disk, inode, pointer_index, replaced_block);
+        if (block_number == -1) return -1;
+    }
+
+    if (write_data_to_block_disk(disk, block_number, data, superblock.block_size) != 0) return -1;
+
+    const struct block_info info = {.hash = hash, .checksum = compute_checksum(data, superblock.block_size), .reference_count = 1};
+    if (write_block_info_disk(disk, block_number, &info) != 0) return -1;
+    dedup_index_insert(hash, block_number);
+
+    if (verbose) printf("Wrote %d bytes to data block %d\n", size, block_number);
+    return block_number;
+}
+
+// Gives back every block a save that failed partway placed in the file, its inode on disk still points at the original ones
+// A block the save shared or allocated differs from the original pointer, so dropping one reference undoes it
+void rollback_saved_blocks_disk(FILE* disk, const struct inode* inode, const struct inode* original_inode) {
+    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+        const int block_number = inode->block_pointers[i];
+        if (block_number != 0 && block_number != original_inode->block_pointers[i]) release_data_block_disk(disk, block_number);
+    }
+}
+
+int run_command_save(char* input_file_path, char* file_path) {
+    FILE* input_file = fopen(input_file_path, "rb");
+    if (!input_file) {
+        printf("Could not open real file %s\n", input_file_path);
+        return 1;
+    }
+
+    // Inputs that can't fit are turned away before the file system is touched
+    struct stat input_stat;
+    if (fstat(fileno(input_file), &input_stat) == 0 && S_ISREG(input_stat.st_mode) && input_stat.st_size > MAX_FILE_SIZE) {
+        printf("File %s is larger than %d bytes, couldn't save file %s.\n", input_file_path, MAX_FILE_SIZE, file_path);
+        fclose(input_file);
+        return -1;
+    }
+
+    int inode_number;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+    if (result != 0) {
+        printf("File %s does not exist in the current directory\n", file_path);
+        fclose(input_file);
+        return 1;
+    }
+
+    // The whole input is read before any block is allocated, so an input that turns out too large
+    // (a pipe has no size to check up front) leaves the file as it was
+    uint8_t* blocks[NUM_BLOCK_POINTERS];
+    int block_sizes[NUM_BLOCK_POINTERS];
+    int num_blocks = 0;
+    int bytes_read = 0;
+    int total_bytes_read = 0;
+
+    do {
+        if (num_blocks == NUM_BLOCK_POINTERS) {
+            if (fgetc(input_file) == EOF) break;
+
+            printf("File %s is larger than %d bytes, couldn't save file %s.\n", input_file_path, MAX_FILE_SIZE, file_path);
+            release_io_buffers(blocks, num_blocks);
+            fclose(input_file);
+            return -1;
+        }
+
+        uint8_t* data = blocks[num_blocks] = acquire_io_buffer();
+        if (!data) {
+            printf("Error: Failed to allocate block buffer\n");
+            release_io_buffers(blocks, num_blocks);
+            fclose(input_file);
+            return -1;
+        }
+
+        bytes_read = (int) fread(data, 1, superblock.block_size, input_file);
+        block_sizes[num_blocks++] = bytes_read;
+        if (bytes_read < superblock.block_size && !feof(input_file)) {
+            printf("Error reading file %s, expected %d bytes, only read %d",
+                input_file_path, superblock.block_size, bytes_read);
+            release_io_buffers(blocks, num_blocks);
+            fclose(input_file);
+            return -1;
+        }
+
+        total_bytes_read += bytes_read;
+    } while (bytes_read == superblock.block_size);
+
+    fclose(input_file);
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        release_io_buffers(blocks, num_blocks);
+        return -1;
+    }
+
+    struct inode inode;
+    if (read_inode_disk(disk, inode_number, &inode) != 0 || unpack_file_tail_disk(disk, inode_number, &inode) != 0) {
+        release_io_buffers(blocks, num_blocks);
+        fclose(disk);
+        return -1;
+    }
+
+    if (verbose) printf("Copying from %s to %s, inode %d\n", input_file_path, file_path, inode_number);
+
+    // Blocks are queued up and written as one batch, so blocks on different volume members are written in parallel
+    struct block_request requests[NUM_BLOCK_POINTERS];
+    int num_requests = 0;
+
+    // Blocks the file stops pointing at are only released once its inode is written
+    // Every pointer can be both rewritten and dropped past the end, so the list has room for both
+    int released_blocks[2 * NUM_BLOCK_POINTERS];
+    int num_released_blocks = 0;
+
+    const struct inode original_inode = inode;
+    bool failed = false;
+    for (int pointer_index = 0; pointer_index < num_blocks; pointer_index++) {
+        uint8_t* data = blocks[pointer_index];
+        const int size = block_sizes[pointer_index];
+
+        if (superblock.flags & SUPERBLOCK_FLAG_DEDUP) {
+            // The trailing empty read of a file that fills its last block holds no data worth sharing
+            if (size == 0 && pointer_index > 0) break;
+
+            const int saved = save_block_deduplicated(disk, &inode, pointer_index, data, size,
+                &released_blocks[num_released_blocks]);
+            if (saved == -1) {
+                printf("Couldn't save file %s.\n", file_path);
+                failed = true;
+                break;
+            }
+
+            if (released_blocks[num_released_blocks] != 0) num_released_blocks++;
+            continue;
+        }
+
+        int block_number = inode.block_pointers[pointer_index];
+        if (block_number == 0) {
+            block_number = find_next_free_data_block_disk(disk);
+
+            if (block_number == -1) {
+                printf("No free data blocks in disk, couldn't save file %s.\n", file_path);
+                failed = true;
+                break;
+            }
+
+            set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+            inode.block_pointers[pointer_index] = block_number;
+        } else {
+            block_number = prepare_block_for_write_disk(disk, &inode, pointer_index, &released_blocks[num_released_blocks]);
+            if (block_number == -1) {
+                printf("Couldn't save file %s.\n", file_path);
+                failed = true;
+                break;
+            }
+            if (released_blocks[num_released_blocks] != 0) num_released_blocks++;
+        }
+        memset(data + size, 0, superblock.block_size - size);
+        requests[num_requests++] = (struct block_request) {block_number, data, size};
+    }
+
+    // The file keeps pointing at its old blocks, so every block it took is given back and the ones it was about to
+    // give up are left alone, a deduplicated save may already have rewritten some of its unshared blocks in place
+    if (failed) {
+        rollback_saved_blocks_disk(disk, &inode, &original_inode);
+        release_io_buffers(blocks, num_blocks);
+        fclose(disk);
+        return -1;
+    }
+
+    transfer_data_blocks_disk(disk, requests, num_requests, true);
+    for (int i = 0; i < num_requests; i++) {
+        if (verbose) printf("Wrote %zu bytes to data block %d\n", requests[i].size, requests[i].block_number);
+    }
+    release_io_buffers(blocks, num_blocks);
+
+    // Blocks past the end of a file that was longer before are dropped, its last block was written zero padded
+    inode.file_size = total_bytes_read;
+    const int blocks_to_keep = MAX(1, (total_bytes_read + superblock.block_size - 1) / superblock.block_size);
+    num_released_blocks += detach_blocks_past_disk(&inode, blocks_to_keep, released_blocks + num_released_blocks);
+
+    write_barrier(disk);
+    write_inode_disk(disk, inode_number, &inode);
+    if (num_released_blocks > 0) write_barrier(disk);
+    release_detached_blocks_disk(disk, released_blocks, num_released_blocks, file_path);
+    pack_file_tail_disk(disk, inode_number, &inode);
+
+    if (verbose) printf("Finished copying. Wrote %d bytes total\n", total_bytes_read);
+
+    fclose(disk);
+    return 0;
+}
+
+// Parses a byte offset or file size argument, returns -1 if it isn't a number between 0 and MAX_FILE_SIZE
+int parse_file_offset(const char* argument) {
+    char* end;
+    const long value = strtol(argument, &end, 10);
+    if (end == argument || *end != '\0' || value < 0 || value > MAX_FILE_SIZE) {
+        printf("Invalid offset or size %s, must be between 0 and %d\n", argument, MAX_FILE_SIZE);
+        return -1;
+    }
+
+    return (int) value;
+}
+
+// Writes size bytes at offset into the file, growing it if the write goes past its end
+// Only the blocks the range touches are written, holes the range falls into get a new block
+// If a block write fails partway, the inode is still written so it covers the blocks that were already written
+int write_file_range_disk(FILE* disk, const int inode_number, struct inode* inode, const int offset,
+    const void* data, const int size) {
+    if (offset + size > MAX_FILE_SIZE) {
+        printf("Writing %d bytes at offset %d would make the file larger than %d bytes\n", size, offset, MAX_FILE_SIZE);
+        return -1;
+    }
+
+    // Holes need a new block and shared blocks a copy, a range the disk can't hold is refused before anything changes
+    int blocks_needed = 0;
+    for (int pointer_index = offset / superblock.block_size; size > 0 &&
+        pointer_index <= (offset + size - 1) / superblock.block_size; pointer_index++) {
+        const int block_number = inode->block_pointers[pointer_index];
+        if (block_number == 0) {
+            blocks_needed++;
+            continue;
+        }
+
+        struct block_info info;
+        if (read_block_info_disk(disk, block_number, &info) != 0) return -1;
+        if (info.reference_count > 1) blocks_needed++;
+    }
+    if (blocks_needed > superblock.free_block_count) {
+        printf("Not enough free data blocks to write %d bytes at offset %d, %d needed and %d free\n", size, offset,
+            blocks_needed, superblock.free_block_count);
+        return -1;
+    }
+
+    int replaced_blocks[NUM_BLOCK_POINTERS];
+    int num_replaced_blocks = 0;
+    int bytes_written = 0;
+    bool failed = false;
+    while (bytes_written < size) {
+        const int position = offset + bytes_written;
+        const int pointer_index = position / superblock.block_size;
+        const int offset_in_block = position % superblock.block_size;
+        const int bytes_to_write = MIN(size - bytes_written, superblock.block_size - offset_in_block);
+        const uint8_t* chunk = (const uint8_t*) data + bytes_written;
+
+        int block_number = inode->block_pointers[pointer_index];
+        if (block_number == 0) {
+            block_number = find_next_free_data_block_disk(disk);
+            if (block_number == -1) {
+                printf("No free data blocks in disk, only wrote %d bytes\n", bytes_written);
+                failed = true;
+                break;
+            }
+
+            // The rest of the new block is part of a hole, so it reads as zeros
+            uint8_t block[DEFAULT_BLOCK_SIZE] = {0};
+            memcpy(block + offset_in_block, chunk, bytes_to_write);
+            set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
+            if (write_data_to_block_disk(disk, block_number, block, offset_in_block + bytes_to_write) != 0) {
+                set_data_block_status_disk(disk, block_number, DATA_BLOCK_FREE);
+                failed = true;
+                break;
+            }
+            inode->block_pointers[pointer_index] = block_number;
+
+            if (verbose) printf("Allocated new data block %d for file, inode %d\n", block_number, inode_number);
+        } else {
+            block_number = prepare_block_for_write_disk(disk, inode, pointer_index, &replaced_blocks[num_replaced_blocks]);
+            if (block_number == -1) {
+                failed = true;
+                break;
+            }
+            if (replaced_blocks[num_replaced_blocks] != 0) num_replaced_blocks++;
+
+            // A copy that failed to take the new bytes still holds the old ones, so the inode can keep it
+            if (write_data_to_block_at_disk(disk, block_number, offset_in_block, chunk, bytes_to_write) != 0) {
+                failed = true;
+                break;
+            }
+        }
+
+        bytes_written += bytes_to_write;
+    }
+
+    inode->file_size = MAX(inode->file_size, offset + bytes_written);
+    write_barrier(disk);
+    if (write_inode_disk(disk, inode_number, inode) != 0) return -1;
+
+    // Shared blocks that were copied keep their reference until the inode points at the copies
+    if (num_replaced_blocks > 0) write_barrier(disk);
+    for (int i = 0; i < num_replaced_blocks; i++) release_data_block_disk(disk, replaced_blocks[i]);
+    return failed ? -1 : 0;
+}
+
+// Writes data at offset into the file, without touching the rest of it
+int run_command_write_at(char* file_path, const int offset, const char* data) {
+    int inode_number;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+
+    if (result != 0) {
+        if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
+        return 1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode inode;
+    if (read_inode_disk(disk, inode_number, &inode) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    // Appending starts wherever the file currently ends
+    const int position = offset == -1 ? inode.file_size : offset;
+    const int size = (int) strlen(data);
+    if (unpack_file_tail_disk(disk, inode_number, &inode) != 0 ||
+        write_file_range_disk(disk, inode_number, &inode, position, data, size) != 0 ||
+        pack_file_tail_disk(disk, inode_number, &inode) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    if (verbose) printf("Wrote %d bytes at offset %d to file %s, inode %d, file is now %d bytes\n",
+        size, position, file_path, inode_number, inode.file_size);
+
+    fclose(disk);
+    return 0;
+}
+
+// Changes the size of a file
+// Shrinking frees every block past the new end, growing leaves a hole that reads as zeros
+// The first block is always kept, so every file has at least one data block
+int run_command_truncate(char* file_path, const int size) {
+    int inode_number;
+    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+
+    if (result != 0) {
+        if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
+        return 1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode inode;
+    if (read_inode_disk(disk, inode_number, &inode) != 0 || unpack_file_tail_disk(disk, inode_number, &inode) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    // The blocks past the end are only released once the inode no longer points at them
+    const int blocks_to_keep = MAX(1, (size + superblock.block_size - 1) / superblock.block_size);
+    int released_blocks[NUM_BLOCK_POINTERS];
+    int num_released_blocks = detach_blocks_past_disk(&inode, blocks_to_keep, released_blocks);
+
+    // Zero the part of the new last block past the end, so growing the file again exposes zeros
+    const int offset_in_block = size % superblock.block_size;
+    const int last_pointer = size / superblock.block_size;
+    if (size < inode.file_size && offset_in_block != 0 && inode.block_pointers[last_pointer] != 0) {
+        const int bytes_to_clear = MIN(inode.file_size - size, superblock.block_size - offset_in_block);
+        const uint8_t zeros[DEFAULT_BLOCK_SIZE] = {0};
+
+        int replaced_block;
+        const int block_number = prepare_block_for_write_disk(disk, &inode, last_pointer, &replaced_block);
+        if (block_number == -1 ||
+            write_data_to_block_at_disk(disk, block_number, offset_in_block, zeros, bytes_to_clear) != 0) {
+            fclose(disk);
+            return -1;
+        }
+        if (replaced_block != 0) released_blocks[num_released_blocks++] = replaced_block;
+    }
+
+    const int old_size = inode.file_size;
+    inode.file_size = size;
+    write_inode_disk(disk, inode_number, &inode);
+    write_barrier(disk);
+
+    release_detached_blocks_disk(disk, released_blocks, num_released_blocks, file_path);
+    pack_file_tail_disk(disk, inode_number, &inode);
+
+    if (verbose) printf("Truncated file %s from %d to %d bytes, inode %d\n", file_path, old_size, size, inode_number);
+
+    fclose(disk);
+    return 0;
+}
+
+int run_command_mkdir(char* dir_path) {
+    int inode_number_dir;
+    const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &inode_number_dir);
+
+    if (result == 0) {
+        printf("Directory %s exists in the current directory\n", dir_path);
+        return 1;
+    }
+    if (result == -1) {
+        // Path could not be resolved
+        return -1;
+    }
+
+    const auto inode_number = find_next_free_inode();
+    if (inode_number == -1) {
+        printf("No free inode exists, unable to create directory %s\n", dir_path);
+        return -1;
+    }
+
+    const auto data_block_number = find_next_free_data_block();
+    if (data_block_number == -1) {
+        printf("No free data block exists, couldn't create directory %s\n", dir_path);
+        return -1;
+    }
+    set_data_block_status(data_block_number, DATA_BLOCK_USED);
+
+    // Default dentries for a directory
+    const struct dentry entries[] = {
+        {inode_number, TYPE_DIRECTORY, "."},
+        {inode_number_dir, TYPE_DIRECTORY, ".."}
+    };
+
+    struct inode inode = {0};
+    inode.file_size = sizeof(entries);
+    inode.block_pointers[0] = data_block_number;
+    inode.is_used = 1;
+
+    // The directory is complete before its parent gets a dentry for it
+    write_data_to_block(data_block_number, entries, sizeof(entries));
+    write_inode(inode_number, &inode);
+    update_free_inode_summary(inode_number, true);
+    forget_name_filter(inode_number);
+    write_barrier(nullptr);
+
+    struct dentry dentry = {inode_number, TYPE_DIRECTORY};
+    const char* dir_name = get_last_of_path(dir_path);
+    strcpy(dentry.name, dir_name);
+    if (create_dentry(&dentry, inode_number_dir) == -1) {
+        printf("All data blocks are being used, unable to create new dentry\n");
+        remove_element(inode_number, TYPE_DIRECTORY);
+        return -1;
+    }
+
+    if (verbose) printf("Created new directory %s, inode %d, data block %d\n",
+        dir_path, inode_number, data_block_number);
+
+    return 0;
+}
+
+int run_command_cd(char directory[MAX_ARG_LEN + 1], const bool print) {
+    int new_directory;
+    const auto result = get_inode_number_of_path(directory, TYPE_DIRECTORY, &new_directory);
+
+    if (result != 0) {
+        // get_inode_number_of_path already prints an error message unless result == 1
+        if (result == 1) printf("Directory %s does not exist\n", directory);
+
+        return -1;
+    }
+
+    current_working_directory = new_directory;
+
+    if (print) printf("Switched to directory %s, inode %d\n", directory, current_working_directory);
+
+    return 0;
+}
+
+int run_command_rm(char* file_path) {
+    const auto filename = get_last_of_path(file_path);
+    const auto dir_path = get_all_except_last_of_path(file_path);
+    int dir_inode = current_working_directory;
+
+    if (strcmp(dir_path, "") != 0) {
+        const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &dir_inode);
+
+        if (result != 0) {
+            if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
+            return 1;
+        }
+    }
+
+    // The lookup stops at the file's dentry and hands back its slot, so the directory is read at most once
+    struct dentry file_dentry;
+    const auto file_dentry_number = get_dentry_number_of_file(dir_inode, filename, TYPE_FILE, &file_dentry);
+    if (file_dentry_number == -1) {
+        printf("File %s does not exist in the current directory\n", filename);
+        return 1;
+    }
+
+    // Nothing can reach the file once its dentry is gone, then all data blocks used by this file are marked free
+    const auto inode_number = file_dentry.inode_number;
+    const auto file_type = file_dentry.file_type;
+    remove_dentry(dir_inode, file_dentry_number);
+    write_barrier(nullptr);
+
+    remove_element(inode_number, file_type);
+
+    if (verbose) {
+        if (strcmp(dir_path, "") != 0) printf("Removed file %s/%s, inode %d\n", dir_path, filename, inode_number);
+        else printf("Removed file %s, inode %d\n", file_path, inode_number);
+    }
+
+    return 0;
+}
+
+// Recursively removes the specified directory and all of its contents
+void remove_directory(const int inode_number) {
+    const auto mark = arena_mark();
+    int num_dentries;
+    const struct dentry* dentries = get_dentries(inode_number, &num_dentries);
+
+    // Start at dentry 2 to skip . and ..
+    for (int i = 2; i < num_dentries; i++) {
+        if (dentries[i].file_type == TYPE_DIRECTORY) {
+            remove_directory(dentries[i].inode_number);
+        } else {
+            remove_element(dentries[i].inode_number, dentries[i].file_type);
+        }
+    }
+
+    remove_element(inode_number, TYPE_DIRECTORY);
+
+    arena_release(mark);
+}
+
+int run_command_rmdir(char* path) {
+    const auto dir_name = get_last_of_path(path);
+    const auto dir_path = get_all_except_last_of_path(path);
+    int dir_inode = current_working_directory;
+
+    if (strcmp(dir_path, "") != 0) {
+        const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &dir_inode);
+
+        if (result != 0) {
+            if (result == 1) printf("Directory %s does not exist in the current directory\n", dir_path);
+            return 1;
+        }
+    }
+
+    struct dentry dir_dentry;
+    const auto dentry_number = get_dentry_number_of_file(dir_inode, dir_name, TYPE_DIRECTORY, &dir_dentry);
+    if (dentry_number == -1) {
+        printf("Directory %s does not exist in the current directory\n", path);
+        return 1;
+    }
+
+    // The tree is unreachable before any of it is freed
+    const auto inode_number = dir_dentry.inode_number;
+    remove_dentry(dir_inode, dentry_number);
+    write_barrier(nullptr);
+
+    remove_directory(inode_number);
+
+    return 0;
+}
+
+// Gives clone the same contents as source by sharing all of source's data blocks
+// Returns the number of data blocks shared
+int share_data_blocks_disk(FILE* disk, const struct inode* source, struct inode* clone) {
+    *clone = *source;
+
+    int shared_blocks = 0;
+    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+        if (source->block_pointers[i] == 0) continue;
+
+        acquire_data_block_disk(disk, source->block_pointers[i]);
+        shared_blocks++;
+    }
+
+    // A packed tail is shared like a block, the fragment counts the clone as one more reference
+    if (source->tail_block != 0) {
+        acquire_data_block_disk(disk, source->tail_block);
+        shared_blocks++;
+    }
+
+    return shared_blocks;
+}
+
+// Creates a file in the given directory that shares the data blocks of an existing file
+// Returns the new inode number, or -1 on error
+int clone_file(const int source_inode_number, const int directory, const char* name) {
+    const auto inode_number = find_next_free_inode();
+    if (inode_number == -1) {
+        printf("All inodes are being used, unable to copy file %s\n", name);
+        return -1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct inode source;
+    struct inode clone;
+    read_inode_disk(disk, source_inode_number, &source);
+    share_data_blocks_disk(disk, &source, &clone);
+    write_inode_disk(disk, inode_number, &clone);
+    update_free_inode_summary(inode_number, true);
+    write_barrier(disk);
+    fclose(disk);
+
+    struct dentry dentry = {inode_number, TYPE_FILE};
+    strcpy(dentry.name, name);
+    if (create_dentry(&dentry, directory) == -1) {
+        printf("All data blocks are being used, unable to create new dentry\n");
+        remove_element(inode_number, TYPE_FILE);
+        return -1;
+    }
+
+    return inode_number;
+}
+
+int run_command_cp(char* source_path, char* destination_path) {
+    int source_inode_number;
+    auto result = get_inode_number_of_path(source_path, TYPE_FILE, &source_inode_number);
+
+    if (result != 0) {
+        if (result == 1) printf("File %s does not exist in the current directory\n", source_path);
+        return 1;
+    }
+
+    int destination_dir;
+    result = get_inode_number_of_path(destination_path, TYPE_FILE, &destination_dir);
+
+    if (result == 0) {
+        printf("File %s already exists in the current directory\n", destination_path);
+        return 1;
+    }
+    if (result == -1) {
+        // Path could not be resolved
+        return -1;
+    }
+
+    const auto inode_number = clone_file(source_inode_number, destination_dir, get_last_of_path(destination_path));
+    if (inode_number == -1) return -1;
+
+    if (verbose) {
         struct inode inode;
-        read_inode(i, &inode);
+        read_inode(inode_number, &inode);
+
+        int shared_blocks = inode.tail_block != 0 ? 1 : 0;
+        for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+            if (inode.block_pointers[i] != 0) shared_blocks++;
+        }
+
+        printf("Copied file %s to %s, inode %d, sharing %d data block(s)\n",
+            source_path, destination_path, inode_number, shared_blocks);
+    }
+
+    return 0;
+}
+
+// Returns true if directory is ancestor or lies somewhere below it
+bool is_same_or_subdirectory(int directory, const int ancestor) {
+    while (directory != ancestor) {
+        // The root directory is its own parent
+        if (directory == 0) return false;
+
+        const auto mark = arena_mark();
+        int num_dentries;
+        const struct dentry* dentries = get_dentries(directory, &num_dentries);
+        if (!dentries) return false;
+
+        // Dentry 1 is always ..
+        directory = dentries[1].inode_number;
+        arena_release(mark);
+    }
+
+    return true;
+}
+
+// Recursively copies the directory tree at source_directory into a new directory called name
+// Directories get new inodes and data blocks, files share their data blocks with the originals
+// Returns the new directory's inode number, or -1 on error
+int clone_directory(const int source_directory, const int parent_directory, const char* name,
+    int* num_directories, int* num_files) {
+    // Read the source's entries before anything is created so the clone never sees itself
+    const auto mark = arena_mark();
+    int num_dentries;
+    const struct dentry* dentries = get_dentries(source_directory, &num_dentries);
+    if (!dentries) return -1;
+
+    const auto inode_number = find_next_free_inode();
+    if (inode_number == -1) {
+        printf("No free inode exists, unable to create directory %s\n", name);
+        return -1;
+    }
+
+    const auto data_block_number = find_next_free_data_block();
+    if (data_block_number == -1) {
+        printf("No free data block exists, couldn't create directory %s\n", name);
+        return -1;
+    }
+    set_data_block_status(data_block_number, DATA_BLOCK_USED);
+
+    const struct dentry entries[] = {
+        {inode_number, TYPE_DIRECTORY, "."},
+        {parent_directory, TYPE_DIRECTORY, ".."}
+    };
+
+    struct inode inode = {0};
+    inode.file_size = sizeof(entries);
+    inode.block_pointers[0] = data_block_number;
+    inode.is_used = 1;
+
+    write_data_to_block(data_block_number, entries, sizeof(entries));
+    write_inode(inode_number, &inode);
+    update_free_inode_summary(inode_number, true);
+    forget_name_filter(inode_number);
+    write_barrier(nullptr);
+
+    struct dentry dentry = {inode_number, TYPE_DIRECTORY};
+    strcpy(dentry.name, name);
+    if (create_dentry(&dentry, parent_directory) == -1) {
+        printf("All data blocks are being used, unable to create new dentry\n");
+        remove_element(inode_number, TYPE_DIRECTORY);
+        return -1;
+    }
+    (*num_directories)++;
+
+    // Start at dentry 2 to skip . and ..
+    for (int i = 2; i < num_dentries; i++) {
+        int result;
+        if (dentries[i].file_type == TYPE_DIRECTORY) {
+            result = clone_directory(dentries[i].inode_number, inode_number, dentries[i].name, num_directories, num_files);
+        } else {
+            result = clone_file(dentries[i].inode_number, inode_number, dentries[i].name);
+            if (result != -1) (*num_files)++;
+        }
+
+        if (result == -1) return -1;
+    }
+
+    arena_release(mark);
+    return inode_number;
+}
+
+int run_command_snapshot(char* source_path, char* destination_path) {
+    int source_directory;
+    auto result = get_inode_number_of_path(source_path, TYPE_DIRECTORY, &source_directory);
+
+    if (result != 0) {
+        if (result == 1) printf("Directory %s does not exist\n", source_path);
+        return 1;
+    }
+
+    int destination_parent;
+    result = get_inode_number_of_path(destination_path, TYPE_DIRECTORY, &destination_parent);
+
+    if (result == 0) {
+        printf("Directory %s exists in the current directory\n", destination_path);
+        return 1;
+    }
+    if (result == -1) {
+        // Path could not be resolved
+        return -1;
+    }
+
+    if (is_same_or_subdirectory(destination_parent, source_directory)) {
+        printf("Cannot create snapshot %s inside of %s\n", destination_path, source_path);
+        return 1;
+    }
+
+    int num_directories = 0;
+    int num_files = 0;
+    const auto inode_number = clone_directory(source_directory, destination_parent,
+        get_last_of_path(destination_path), &num_directories, &num_files);
+    if (inode_number == -1) return -1;
+
+    if (verbose) printf("Created snapshot %s of %s, inode %d, %d director%s and %d file(s)\n",
+        destination_path, source_path, inode_number, num_directories, num_directories == 1 ? "y" : "ies", num_files);
+
+    return 0;
+}
+
+// IMPORT
+// import copies the contents of a host directory into a directory of the disk in one go. The host tree is listed
+// first, then reader threads load the host files into one buffer while this thread picks inodes and data blocks
+// for everything out of in-memory copies of the inode table and free bitmap
+// All data blocks, those of the new directories included, are written as one batch whose neighbouring blocks are
+// merged into single transfers. The free bitmap, block info and inode table changes then each go out as one write,
+// and the dentries in the target directory come last
+// Nothing is written unless the whole tree fits. Imported blocks are not deduplicated
+
+struct import_entry {
+    const char* host_path;
+    char name[sizeof(((struct dentry*) nullptr)->name)];
+    uint8_t file_type;
+    int parent; // Index of the entry of the entry's directory
+    int first_child, next_sibling; // -1 if there is none
+    int num_children;
+    int size; // In bytes, 0 for directories
+    int first_block; // Index of the entry's first block in the batch
+    int num_blocks;
+    int inode_number;
+    int read_result;
+};
+
+// Entry 0 is the target directory, which already exists
+struct import_state {
+    struct import_entry* entries;
+    int num_entries, max_entries;
+    int target_room; // Dentries the target directory can still take
+    int num_blocks; // Data blocks in the batch
+    uint8_t* data; // Contents of the batch, num_blocks blocks
+    _Atomic int next_read; // Entry the next reader thread looks at
+};
+
+// Adds the contents of the host directory of entry parent to the list, every directory is followed by its contents
+int list_import_directory(struct import_state* state, const int parent) {
+    const char* host_path = state->entries[parent].host_path;
+    struct dirent** names;
+    const int num_names = scandir(host_path, &names, nullptr, alphasort);
+    if (num_names < 0) {
+        printf("Could not open real directory %s\n", host_path);
+        return -1;
+    }
+
+    const int room = parent == 0 ? state->target_room : NUM_BLOCK_POINTERS * DENTRIES_PER_BLOCK - 2;
+    int result = 0;
+    int last_child = -1;
+    for (int i = 0; i < num_names && result == 0; i++) {
+        const char* name = names[i]->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        const size_t path_size = strlen(host_path) + strlen(name) + 2;
+        char* path = arena_alloc(path_size);
+        if (!path) {
+            printf("Error: Failed to allocate memory for the host tree\n");
+            result = -1;
+            break;
+        }
+        snprintf(path, path_size, "%s/%s", host_path, name);
+
+        // Links are skipped rather than followed, so the listing can't loop
+        struct stat host_stat;
+        if (lstat(path, &host_stat) != 0) {
+            printf("Could not open real file %s\n", path);
+            result = -1;
+        } else if (!S_ISREG(host_stat.st_mode) && !S_ISDIR(host_stat.st_mode)) {
+            if (verbose) printf("Skipped %s, it is not a regular file or directory\n", path);
+            continue;
+        } else if (strlen(name) > MAX_ARG_LEN) {
+            printf("Name of %s is longer than %d characters\n", path, MAX_ARG_LEN);
+            result = -1;
+        } else if (S_ISREG(host_stat.st_mode) && host_stat.st_size > MAX_FILE_SIZE) {
+            printf("File %s is larger than %d bytes\n", path, MAX_FILE_SIZE);
+            result = -1;
+        } else if (state->entries[parent].num_children == room) {
+            printf("Directory %s has more entries than fit in a directory, %d\n", host_path, room);
+            result = -1;
+        } else if (state->num_entries == state->max_entries) {
+            printf("%s has more entries than there are free inodes, %d\n", state->entries[0].host_path, state->max_entries - 1);
+            result = -1;
+        }
+        if (result != 0) break;
+
+        const int index = state->num_entries++;
+        const auto entry = &state->entries[index];
+        *entry = (struct import_entry) {path, "", S_ISDIR(host_stat.st_mode) ? TYPE_DIRECTORY : TYPE_FILE, parent, -1, -1};
+        entry->size = entry->file_type == TYPE_FILE ? (int) host_stat.st_size : 0;
+        strcpy(entry->name, name);
+
+        if (last_child == -1) {
+            state->entries[parent].first_child = index;
+        } else {
+            state->entries[last_child].next_sibling = index;
+        }
+        last_child = index;
+        state->entries[parent].num_children++;
+
+        if (entry->file_type == TYPE_DIRECTORY) result = list_import_directory(state, index);
+    }
+
+    for (int i = 0; i < num_names; i++) free(names[i]);
+    free(names);
+    return result;
+}
+
+// Reads host files into their place in the batch until every entry has been taken by a reader
+void* run_import_reader(void* argument) {
+    struct import_state* state = argument;
+
+    int index;
+    while ((index = atomic_fetch_add(&state->next_read, 1)) < state->num_entries) {
+        const auto entry = &state->entries[index];
+        if (entry->file_type != TYPE_FILE) continue;
+
+        // A file that changed size since it was listed doesn't fit the blocks picked for it
+        uint8_t* data = state->data + (size_t) entry->first_block * superblock.block_size;
+        FILE* file = fopen(entry->host_path, "rb");
+        entry->read_result = file && fread(data, 1, entry->size, file) == (size_t) entry->size && fgetc(file) == EOF ? 0 : -1;
+        if (file) fclose(file);
+    }
+
+    return nullptr;
+}
+
+// Takes the lowest free block at or after *next in the bitmap copy, returns -1 if there is none
+int take_free_block(uint8_t* free_bitmap, int* next) {
+    for (; *next < superblock.block_count; (*next)++) {
+        const uint8_t mask = 128 >> (*next % 8);
+        if (free_bitmap[*next / 8] & mask) continue;
+
+        free_bitmap[*next / 8] |= mask;
+        return (*next)++;
+    }
+
+    return -1;
+}
+
+// Puts a dentry at its position in the blocks of a directory that are laid out one after the other in data
+void put_import_dentry(uint8_t* data, const int position, const struct dentry* dentry) {
+    memcpy(data + (size_t) (position / DENTRIES_PER_BLOCK) * superblock.block_size +
+        (position % DENTRIES_PER_BLOCK) * sizeof(struct dentry), dentry, sizeof(struct dentry));
+}
+
+// Writes the dentries of the new top level entries into the target directory, after everything they name
+int import_target_dentries(FILE* disk, const struct import_state* state, struct inode* target_inode, const int* new_blocks) {
+    const int target = state->entries[0].inode_number;
+    int position = (int) (target_inode->file_size / sizeof(struct dentry));
+    int num_new_blocks = 0;
+
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
+
+    for (int child = state->entries[0].first_child; child != -1;) {
+        const int pointer_index = position / DENTRIES_PER_BLOCK;
+        if (position % DENTRIES_PER_BLOCK == 0) {
+            memset(block, 0, superblock.block_size);
+            target_inode->block_pointers[pointer_index] = new_blocks[num_new_blocks++];
+        } else if (read_data_from_block_disk(disk, target_inode->block_pointers[pointer_index], block,
+            superblock.block_size) != 0) {
+            release_io_buffer(block);
+            return -1;
+        }
+
+        // Fill the rest of the block before writing it
+        do {
+            const auto entry = &state->entries[child];
+            struct dentry dentry = {entry->inode_number, entry->file_type};
+            strcpy(dentry.name, entry->name);
+            put_import_dentry(block, position % DENTRIES_PER_BLOCK, &dentry);
+
+            name_filter_dentry_added(target, entry->name);
+            position++;
+            child = entry->next_sibling;
+        } while (child != -1 && position % DENTRIES_PER_BLOCK != 0);
+
+        if (write_data_to_block_disk(disk, target_inode->block_pointers[pointer_index], block, superblock.block_size) != 0) {
+            release_io_buffer(block);
+            return -1;
+        }
+    }
+
+    release_io_buffer(block);
+    target_inode->file_size = position * sizeof(struct dentry);
+    return write_inode_disk(disk, target, target_inode);
+}
+
+int run_command_import(char* host_path, char* directory_path) {
+    int target;
+    const auto result = get_inode_number_of_path(directory_path, TYPE_DIRECTORY, &target);
+    if (result != 0) {
+        // get_inode_number_of_path already prints an error message unless result == 1
+        if (result == 1) printf("Directory %s does not exist\n", directory_path);
+        return -1;
+    }
+
+    struct inode target_inode;
+    if (read_inode(target, &target_inode) != 0) return -1;
+    const int target_dentries = (int) (target_inode.file_size / sizeof(struct dentry));
+
+    struct import_state state = {.max_entries = superblock.free_inode_count + 1};
+    state.target_room = NUM_BLOCK_POINTERS * DENTRIES_PER_BLOCK - target_dentries;
+    state.entries = arena_alloc(state.max_entries * sizeof(struct import_entry));
+    if (!state.entries) {
+        printf("Error: Failed to allocate memory for the host tree\n");
+        return -1;
+    }
+    state.entries[0] = (struct import_entry) {host_path, "", TYPE_DIRECTORY, -1, -1, -1, .inode_number = target};
+    state.num_entries = 1;
+
+    if (list_import_directory(&state, 0) != 0) return -1;
+    if (state.num_entries == 1) {
+        if (verbose) printf("Nothing to import from %s\n", host_path);
+        return 0;
+    }
+
+    int num_files = 0;
+    long long num_bytes = 0;
+    for (int i = 1; i < state.num_entries; i++) {
+        const auto entry = &state.entries[i];
+        if (entry->parent == 0 && get_inode_number_of_file(target, entry->name, entry->file_type) != -1) {
+            printf("%s already exists in %s\n", entry->name, directory_path);
+            return 1;
+        }
+
+        // Files own a block even when empty, like files made with create
+        entry->num_blocks = entry->file_type == TYPE_DIRECTORY
+            ? (entry->num_children + 2 + DENTRIES_PER_BLOCK - 1) / DENTRIES_PER_BLOCK
+            : MAX(1, (entry->size + superblock.block_size - 1) / superblock.block_size);
+        entry->first_block = state.num_blocks;
+        state.num_blocks += entry->num_blocks;
+
+        if (entry->file_type == TYPE_FILE) num_files++;
+        num_bytes += entry->size;
+    }
+
+    // The target directory may need new blocks for its dentries as well
+    const int target_blocks = (target_dentries + DENTRIES_PER_BLOCK - 1) / DENTRIES_PER_BLOCK;
+    const int num_target_blocks = (target_dentries + state.entries[0].num_children + DENTRIES_PER_BLOCK - 1) /
+        DENTRIES_PER_BLOCK - target_blocks;
+    const int num_new_blocks = state.num_blocks + num_target_blocks;
+    if (num_new_blocks > superblock.free_block_count) {
+        printf("Not enough free data blocks to import %s, %d needed and %d free\n", host_path,
+            num_new_blocks, superblock.free_block_count);
+        return -1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const size_t bitmap_size = superblock.block_count / 8;
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    uint8_t* free_bitmap = arena_alloc(bitmap_size);
+    struct block_info* infos = arena_alloc(superblock.block_count * sizeof(struct block_info));
+    int* block_numbers = arena_alloc(num_new_blocks * sizeof(int));
+    struct block_request* requests = arena_alloc(state.num_blocks * sizeof(struct block_request));
+    state.data = arena_calloc(state.num_blocks, superblock.block_size);
+    if (!inodes || !free_bitmap || !infos || !block_numbers || !requests || !state.data) {
+        printf("Error: Failed to allocate memory for the import\n");
+        fclose(disk);
+        return -1;
+    }
+
+    // Readers load the host files while the inodes and blocks for them are picked
+    auto num_readers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_readers = MAX(1, MIN(MIN(num_readers, MAX_WORKER_THREADS), num_files));
+    state.next_read = 1;
+
+    pthread_t threads[MAX_WORKER_THREADS];
+    bool started[MAX_WORKER_THREADS] = {false};
+    for (int i = 0; i < num_readers && num_files > 0; i++) {
+        started[i] = pthread_create(&threads[i], nullptr, run_import_reader, &state) == 0;
+    }
+
+    bool loaded = disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) == 0 &&
+        disk_read_at(disk, FREE_BITMAP_START, free_bitmap, bitmap_size) == 0 &&
+        disk_read_at(disk, BLOCK_INFO_START, infos, superblock.block_count * sizeof(struct block_info)) == 0;
+
+    // The lowest free inodes and blocks are taken in order, so everything below next_inode and next_block is in use
+    int next_inode = MAX(1, superblock.first_free_inode);
+    int next_block = superblock.first_free_block;
+    for (int i = 1; i < state.num_entries && loaded; i++) {
+        const auto entry = &state.entries[i];
+
+        while (next_inode < superblock.inode_count && inodes[next_inode].is_used) next_inode++;
+        if (next_inode == superblock.inode_count) {
+            loaded = false;
+            break;
+        }
+        entry->inode_number = next_inode++;
+
+        struct inode inode = {superblock.generation, entry->size, .is_used = 1};
+        if (entry->file_type == TYPE_DIRECTORY) inode.file_size = (entry->num_children + 2) * sizeof(struct dentry);
+        for (int block = 0; block < entry->num_blocks && loaded; block++) {
+            const int index = entry->first_block + block;
+            block_numbers[index] = take_free_block(free_bitmap, &next_block);
+            loaded = block_numbers[index] != -1;
+            inode.block_pointers[block] = block_numbers[index];
+
+            const int size = MIN(superblock.block_size, MAX(0, inode.file_size - block * superblock.block_size));
+            requests[index] = (struct block_request) {block_numbers[index], state.data + (size_t) index * superblock.block_size, size};
+        }
+
+        inode.checksum = inode_checksum(&inode);
+        inodes[entry->inode_number] = inode;
+    }
+    for (int i = state.num_blocks; i < num_new_blocks && loaded; i++) {
+        block_numbers[i] = take_free_block(free_bitmap, &next_block);
+        loaded = block_numbers[i] != -1;
+    }
+    if (!loaded) printf("Error: Failed to pick inodes and data blocks for the import\n");
+
+    // Directories only need the inode numbers of their entries to fill in their dentries
+    for (int i = 1; i < state.num_entries && loaded; i++) {
+        const auto entry = &state.entries[i];
+        if (entry->file_type != TYPE_DIRECTORY) continue;
+
+        uint8_t* data = state.data + (size_t) entry->first_block * superblock.block_size;
+        struct dentry dentry = {entry->inode_number, TYPE_DIRECTORY, "."};
+        put_import_dentry(data, 0, &dentry);
+        dentry = (struct dentry) {state.entries[entry->parent].inode_number, TYPE_DIRECTORY, ".."};
+        put_import_dentry(data, 1, &dentry);
+
+        int position = 2;
+        for (int child = entry->first_child; child != -1; child = state.entries[child].next_sibling) {
+            dentry = (struct dentry) {state.entries[child].inode_number, state.entries[child].file_type};
+            strcpy(dentry.name, state.entries[child].name);
+            put_import_dentry(data, position++, &dentry);
+        }
+    }
+
+    for (int i = 0; i < num_readers; i++) {
+        if (started[i]) pthread_join(threads[i], nullptr);
+    }
+    // Whatever readers that failed to start left behind is read here
+    run_import_reader(&state);
+
+    for (int i = 1; i < state.num_entries && loaded; i++) {
+        if (state.entries[i].file_type == TYPE_FILE && state.entries[i].read_result != 0) {
+            printf("Could not read real file %s\n", state.entries[i].host_path);
+            loaded = false;
+        }
+    }
+    if (!loaded) {
+        fclose(disk);
+        return -1;
+    }
+
+    // The data goes first, then the bitmap and block info that claim it, then the inodes, and the dentries that
+    // make everything reachable last
+    if (transfer_data_blocks_disk(nullptr, requests, state.num_blocks, true) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    int first_block = superblock.block_count, last_block = 0;
+    for (int i = 0; i < num_new_blocks; i++) {
+        const int block_number = block_numbers[i];
+        infos[block_number] = (struct block_info) {0, i < state.num_blocks ? requests[i].checksum : 0, superblock.generation, 1};
+        if (block_checksums) block_checksums[block_number] = infos[block_number].checksum;
+        mark_block_for_discard(block_number, false);
+
+        first_block = MIN(first_block, block_number);
+        last_block = MAX(last_block, block_number);
+    }
+
+    superblock.free_block_count -= num_new_blocks;
+    superblock.first_free_block = next_block;
+    superblock.free_inode_count -= state.num_entries - 1;
+    superblock.first_free_inode = next_inode;
+
+    const int first_inode = state.entries[1].inode_number;
+    const int last_inode = state.entries[state.num_entries - 1].inode_number;
+    bool written = disk_write_at(disk, FREE_BITMAP_START + first_block / 8, free_bitmap + first_block / 8,
+            last_block / 8 - first_block / 8 + 1) == 0 &&
+        disk_write_at(disk, BLOCK_INFO_START + first_block * sizeof(struct block_info), &infos[first_block],
+            (last_block - first_block + 1) * sizeof(struct block_info)) == 0 &&
+        write_superblock_disk(disk) == 0;
+    write_barrier(disk);
+
+    written = written && disk_write_at(disk, INODE_TABLE_START + first_inode * sizeof(struct inode), &inodes[first_inode],
+        (last_inode - first_inode + 1) * sizeof(struct inode)) == 0;
+    write_barrier(disk);
+
+    for (int i = 1; i < state.num_entries; i++) {
+        if (state.entries[i].file_type == TYPE_DIRECTORY) forget_name_filter(state.entries[i].inode_number);
+    }
+    written = written && import_target_dentries(disk, &state, &target_inode, block_numbers + state.num_blocks) == 0;
+
+    fclose(disk);
+    if (!written) {
+        printf("File error: failed to write the imported tree to the disk\n");
+        return -1;
+    }
+
+    if (verbose) printf("Imported %d file(s) and %d director(ies) from %s into %s, %lld bytes in %d data block(s)\n",
+        num_files, state.num_entries - 1 - num_files, host_path, directory_path, num_bytes, num_new_blocks);
+
+    return 0;
+}
+
+// EXPORT
+// export copies a directory tree of the disk into a host directory. The tree is listed and the host directories
+// are made first, then worker threads each take whole files. Blocks of a file that follow each other in a volume
+// member's file are read with a single call, and every worker writes its files to the host from one buffer of
+// MAX_FILE_SIZE bytes
+// Problems are reported once all workers are done
+
+struct export_file {
+    const char* host_path;
+    struct inode inode;
+    int bad_block; // First block whose checksum doesn't match, -1 if none
+    int result;
+};
+
+struct export_state {
+    struct export_file* files;
+    int num_files;
+    _Atomic int next_file; // File the next worker takes
+};
+
+// Makes a host directory, an existing directory is fine
+int make_host_directory(const char* path) {
+    struct stat host_stat;
+    if (mkdir(path, 0755) == 0 || (stat(path, &host_stat) == 0 && S_ISDIR(host_stat.st_mode))) return 0;
+
+    printf("Could not create real directory %s\n", path);
+    return -1;
+}
+
+// Reads every block of a file into data, holes read as zeros
+int read_export_blocks(struct export_file* file, uint8_t* data) {
+    const auto inode = &file->inode;
+    const int num_blocks = (inode->file_size + superblock.block_size - 1) / superblock.block_size;
+
+    for (int first = 0; first < num_blocks;) {
+        const int block_number = inode->block_pointers[first];
+        uint8_t* destination = data + (size_t) first * superblock.block_size;
+        if (block_number == 0) {
+            memset(destination, 0, superblock.block_size);
+            first++;
+            continue;
+        }
+        if (block_number >= superblock.block_count) return -1;
+
+        // O_DIRECT reads are padded one block at a time, like the member queues do
+        const auto location = locate_data_block(block_number);
+        const bool can_merge = volume_members[location.member].direct_alignment == 0;
+        int end = first + 1;
+        while (can_merge && end < num_blocks && inode->block_pointers[end] != 0 &&
+            inode->block_pointers[end] < superblock.block_count) {
+            const auto next = locate_data_block(inode->block_pointers[end]);
+            if (next.member != location.member || next.offset != location.offset + (off_t) (end - first) * superblock.block_size) break;
+            end++;
+        }
+
+        if (transfer_block_data(block_number, 0, destination, (size_t) (end - first) * superblock.block_size, false) != 0) {
+            return -1;
+        }
+
+        for (int i = first; i < end; i++) {
+            const int number = inode->block_pointers[i];
+            const uint8_t* block = data + (size_t) i * superblock.block_size;
+            if (file->bad_block == -1 && should_verify_block(number) &&
+                compute_checksum(block, superblock.block_size) != block_checksums[number]) {
+                file->bad_block = number;
+            }
+        }
+
+        first = end;
+    }
+
+    // The tail is read with the rest of its fragment, so the fragment's checksum can be checked
+    if (inode->tail_block != 0) {
+        if (inode->tail_block >= superblock.block_count ||
+            inode->tail_offset + get_tail_length(inode) > superblock.block_size) return -1;
+
+        uint8_t fragment[DEFAULT_BLOCK_SIZE];
+        if (transfer_block_data(inode->tail_block, 0, fragment, superblock.block_size, false) != 0) return -1;
+        if (file->bad_block == -1 && should_verify_block(inode->tail_block) &&
+            compute_checksum(fragment, superblock.block_size) != block_checksums[inode->tail_block]) {
+            file->bad_block = inode->tail_block;
+        }
+        memcpy(data + (size_t) (inode->file_size / superblock.block_size) * superblock.block_size,
+            fragment + inode->tail_offset, get_tail_length(inode));
+    }
+
+    return 0;
+}
+
+void* run_export_worker(void* argument) {
+    struct export_state* state = argument;
+
+    uint8_t* data = nullptr;
+    int index;
+    while ((index = atomic_fetch_add(&state->next_file, 1)) < state->num_files) {
+        const auto file = &state->files[index];
+        if (!data) data = malloc(MAX_FILE_SIZE);
+        if (!data || read_export_blocks(file, data) != 0) {
+            file->result = -1;
+            continue;
+        }
+
+        // Corrupt files are left out when the checksum policy says the read should fail
+        if (file->bad_block != -1 && checksum_policy == CHECKSUM_VERIFY_STRICT) continue;
+
+        FILE* host_file = fopen(file->host_path, "wb");
+        const bool written = host_file && fwrite(data, 1, file->inode.file_size, host_file) == file->inode.file_size;
+        if (host_file && fclose(host_file) != 0) file->result = -1;
+        if (!written) file->result = -1;
+    }
+
+    free(data);
+    return nullptr;
+}
+
+// The blocks are counted as they would have been read by one thread, so the stats don't depend on the workers
+void count_export_reads(const struct export_file* file) {
+    const int num_blocks = (file->inode.file_size + superblock.block_size - 1) / superblock.block_size;
+    int previous_block = -1;
+    for (int i = 0; i < num_blocks; i++) {
+        const int block_number = file->inode.block_pointers[i];
+        if (block_number == 0 || block_number >= superblock.block_count) continue;
+
+        const uint32_t location = DATA_START + block_number * superblock.block_size;
+        if (block_number != previous_block + 1) count_disk_seek(location);
+        count_disk_transfer(location, superblock.block_size, false);
+        previous_block = block_number;
+    }
+
+    const int tail_block = file->inode.tail_block;
+    if (tail_block != 0 && tail_block < superblock.block_count) {
+        const uint32_t location = DATA_START + tail_block * superblock.block_size;
+        count_disk_seek(location);
+        count_disk_transfer(location, superblock.block_size, false);
+    }
+}
+
+int run_command_export(char* directory_path, char* host_path) {
+    int root;
+    const auto result = get_inode_number_of_path(directory_path, TYPE_DIRECTORY, &root);
+    if (result != 0) {
+        // get_inode_number_of_path already prints an error message unless result == 1
+        if (result == 1) printf("Directory %s does not exist\n", directory_path);
+        return -1;
+    }
+
+    if (make_host_directory(host_path) != 0) return -1;
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    struct export_state state = {arena_alloc(superblock.inode_count * sizeof(struct export_file))};
+    int* stack = arena_alloc(superblock.inode_count * sizeof(int));
+    const char** directory_paths = arena_alloc(superblock.inode_count * sizeof(char*));
+    uint8_t* visited = arena_calloc(superblock.inode_count, 1);
+    if (!state.files || !stack || !directory_paths || !visited) {
+        printf("Error: Failed to allocate memory for the export\n");
+        fclose(disk);
+        return -1;
+    }
+
+    // Directories are made on the host as they are listed, so every parent exists before its entries
+    int stack_size = 0;
+    int num_directories = 0;
+    stack[stack_size++] = root;
+    directory_paths[root] = host_path;
+    visited[root] = 1;
+
+    int listed = 0;
+    while (stack_size > 0 && listed == 0) {
+        const int directory = stack[--stack_size];
+
+        struct directory_iterator iterator;
+        if (open_directory(&iterator, disk, directory) != 0) {
+            listed = -1;
+            break;
+        }
+
+        const struct dentry* dentry;
+        while ((dentry = next_dentry(&iterator)) != nullptr && listed == 0) {
+            // Skip . and ..
+            if (iterator.next_dentry <= 2 || dentry->inode_number >= superblock.inode_count || visited[dentry->inode_number]) continue;
+            visited[dentry->inode_number] = 1;
+
+            const size_t path_size = strlen(directory_paths[directory]) + strlen(dentry->name) + 2;
+            char* path = arena_alloc(path_size);
+            if (!path) {
+                printf("Error: Failed to allocate memory for the export\n");
+                listed = -1;
+                break;
+            }
+            snprintf(path, path_size, "%s/%s", directory_paths[directory], dentry->name);
+
+            if (dentry->file_type == TYPE_DIRECTORY) {
+                listed = make_host_directory(path);
+                directory_paths[dentry->inode_number] = path;
+                stack[stack_size++] = dentry->inode_number;
+                num_directories++;
+                continue;
+            }
+
+            const auto file = &state.files[state.num_files++];
+            *file = (struct export_file) {path, .bad_block = -1};
+            listed = read_inode_disk(disk, dentry->inode_number, &file->inode);
+        }
+
+        close_directory(&iterator);
+    }
+    fclose(disk);
+    if (listed != 0) return -1;
+
+    auto num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = MAX(1, MIN(MIN(num_workers, MAX_WORKER_THREADS), state.num_files));
+
+    pthread_t threads[MAX_WORKER_THREADS];
+    bool started[MAX_WORKER_THREADS] = {false};
+    for (int i = 0; i < num_workers && state.num_files > 0; i++) {
+        started[i] = pthread_create(&threads[i], nullptr, run_export_worker, &state) == 0;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (started[i]) pthread_join(threads[i], nullptr);
+    }
+    // Whatever workers that failed to start left behind is exported here
+    run_export_worker(&state);
+
+    int num_failed = 0;
+    long long num_bytes = 0;
+    for (int i = 0; i < state.num_files; i++) {
+        const auto file = &state.files[i];
+        count_export_reads(file);
+
+        if (file->result != 0) {
+            printf("Could not export %s\n", file->host_path);
+            num_failed++;
+        } else if (file->bad_block != -1 && report_checksum_mismatch("data block", file->bad_block) != 0) {
+            num_failed++;
+        } else {
+            num_bytes += file->inode.file_size;
+        }
+    }
+
+    if (verbose) printf("Exported %d file(s) and %d director(ies) from %s to %s, %lld bytes\n",
+        state.num_files - num_failed, num_directories, directory_path, host_path, num_bytes);
+
+    return num_failed == 0 ? 0 : -1;
+}
+
+// SEND AND RECEIVE
+// Every inode and block info entry records the generation it was last written in. send writes everything that
+// changed after a given generation to a stream file and then starts a new generation, receive applies a stream to
+// another disk with the same layout. A stream holds the inodes and block info entries that changed and the contents
+// of the changed blocks that are in use, so its size follows the amount of change and not the size of the disk
+// A stream of the changes since generation 0 carries the whole disk. A disk only receives the stream that follows
+// what it holds: one sent since the generation before its own, so a fresh disk takes a full stream first, and a
+// disk that receives streams shouldn't be changed in between
+// Streams end with a checksum of everything before it, nothing is applied from a stream that doesn't match
+
+#define STREAM_MAGIC "NANOFSS1"
+
+struct stream_header {
+    char magic[8];
+    uint32_t since; // The stream holds every change made after this generation
+    uint32_t generation; // The generation the changes were sent in
+    uint16_t block_size, block_count, inode_count;
+    uint16_t flags; // Superblock flags of the sending disk
+    uint32_t num_inodes, num_blocks;
+};
+
+struct stream_inode_record {
+    uint32_t inode_number;
+    struct inode inode;
+};
+
+// Followed by the contents of the block if it is in use
+struct stream_block_record {
+    uint32_t block_number;
+    struct block_info info;
+    uint8_t used;
+};
+
+int run_command_send(const char* stream_path, const uint32_t since) {
+    if (since >= superblock.generation) {
+        printf("Generation %u has not been sent yet, the current generation is %u\n", since, superblock.generation);
+        return -1;
+    }
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const size_t bitmap_size = superblock.block_count / 8;
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    uint8_t* bitmap = arena_alloc(bitmap_size);
+    struct block_info* infos = arena_alloc(superblock.block_count * sizeof(struct block_info));
+    if (!inodes || !bitmap || !infos ||
+        disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) != 0 ||
+        disk_read_at(disk, FREE_BITMAP_START, bitmap, bitmap_size) != 0 ||
+        disk_read_at(disk, BLOCK_INFO_START, infos, superblock.block_count * sizeof(struct block_info)) != 0) {
+        printf("File error: could not read the inode table, free bitmap and block info\n");
+        fclose(disk);
+        return -1;
+    }
+
+    struct stream_header header = {STREAM_MAGIC, since, superblock.generation, superblock.block_size,
+        superblock.block_count, superblock.inode_count, superblock.flags};
+    int num_used_blocks = 0;
+    for (int i = 0; i < superblock.inode_count; i++) {
+        if (inodes[i].generation > since) header.num_inodes++;
+    }
+    for (int i = 0; i < superblock.block_count; i++) {
+        if (infos[i].generation <= since) continue;
+
+        header.num_blocks++;
+        if (bitmap[i / 8] & (128 >> (i % 8))) num_used_blocks++;
+    }
+
+    const size_t stream_size = sizeof(header) + header.num_inodes * sizeof(struct stream_inode_record) +
+        header.num_blocks * sizeof(struct stream_block_record) + (size_t) num_used_blocks * superblock.block_size +
+        sizeof(uint32_t);
+    uint8_t* stream = arena_calloc(1, stream_size);
+    struct block_request* requests = arena_alloc(MAX(1, num_used_blocks) * sizeof(struct block_request));
+    if (!stream || !requests) {
+        printf("Error: Failed to allocate memory for the stream\n");
+        fclose(disk);
+        return -1;
+    }
+
+    size_t position = 0;
+    memcpy(stream, &header, sizeof(header));
+    position += sizeof(header);
+
+    for (int i = 0; i < superblock.inode_count; i++) {
+        if (inodes[i].generation <= since) continue;
+
+        struct stream_inode_record record;
+        memset(&record, 0, sizeof(record));
+        record.inode_number = i;
+        record.inode = inodes[i];
+        memcpy(stream + position, &record, sizeof(record));
+        position += sizeof(record);
+    }
+
+    // The contents of the blocks are read straight into their place in the stream
+    int num_requests = 0;
+    for (int i = 0; i < superblock.block_count; i++) {
+        if (infos[i].generation <= since) continue;
+
+        struct stream_block_record record;
+        memset(&record, 0, sizeof(record));
+        record.block_number = i;
+        record.info = infos[i];
+        record.used = (bitmap[i / 8] & (128 >> (i % 8))) != 0;
+        memcpy(stream + position, &record, sizeof(record));
+        position += sizeof(record);
+
+        if (!record.used) continue;
+        requests[num_requests++] = (struct block_request) {i, stream + position, superblock.block_size};
+        position += superblock.block_size;
+    }
+
+    if (transfer_data_blocks_disk(disk, requests, num_requests, false) != 0) {
+        fclose(disk);
+        return -1;
+    }
+
+    const uint32_t checksum = compute_checksum(stream, position);
+    memcpy(stream + position, &checksum, sizeof(checksum));
+
+    FILE* file = fopen(stream_path, "wb");
+    if (!file) {
+        printf("Could not create stream file %s\n", stream_path);
+        fclose(disk);
+        return -1;
+    }
+    const bool written = fwrite(stream, 1, stream_size, file) == stream_size;
+    if (fclose(file) != 0 || !written) {
+        printf("Could not write stream file %s\n", stream_path);
+        fclose(disk);
+        return -1;
+    }
+
+    // Changes from here on belong to the next stream
+    superblock.generation++;
+    const auto result = write_superblock_disk(disk);
+    fclose(disk);
+    if (result != 0) return -1;
+
+    if (verbose) printf("Sent generation %u to %s, %u inode(s) and %u block(s) changed since generation %u, %zu bytes\n",
+        header.generation, stream_path, header.num_inodes, header.num_blocks, since, stream_size);
+
+    return 0;
+}
+
+// Reads a whole stream file into the arena and checks that it belongs to this disk
+// Returns nullptr if it can't be received
+uint8_t* load_stream(const char* stream_path, size_t* stream_size) {
+    FILE* file = fopen(stream_path, "rb");
+    if (!file) {
+        printf("Could not open stream file %s\n", stream_path);
+        return nullptr;
+    }
+
+    uint8_t* stream = nullptr;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+    if (size >= (long) (sizeof(struct stream_header) + sizeof(uint32_t)) && fseek(file, 0, SEEK_SET) == 0) {
+        stream = arena_alloc(size);
+        if (stream && fread(stream, 1, size, file) != (size_t) size) stream = nullptr;
+    }
+    fclose(file);
+
+    uint32_t checksum = 0;
+    if (stream) memcpy(&checksum, stream + size - sizeof(checksum), sizeof(checksum));
+    if (!stream || compute_checksum(stream, size - sizeof(checksum)) != checksum) {
+        printf("Stream file %s is damaged\n", stream_path);
+        return nullptr;
+    }
+
+    struct stream_header header;
+    memcpy(&header, stream, sizeof(header));
+    if (memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) != 0 || header.block_size != superblock.block_size ||
+        header.block_count != superblock.block_count || header.inode_count != superblock.inode_count) {
+        printf("Stream file %s was not sent from a disk with the same layout\n", stream_path);
+        return nullptr;
+    }
+    if (header.since + 1 != superblock.generation) {
+        printf("Stream file %s holds the changes since generation %u, the disk needs those since generation %u\n",
+            stream_path, header.since, superblock.generation - 1);
+        return nullptr;
+    }
+
+    *stream_size = size;
+    return stream;
+}
+
+int run_command_receive(const char* stream_path) {
+    size_t stream_size;
+    const uint8_t* stream = load_stream(stream_path, &stream_size);
+    if (!stream) return -1;
+
+    struct stream_header header;
+    memcpy(&header, stream, sizeof(header));
+
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
+
+    const size_t bitmap_size = superblock.block_count / 8;
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    uint8_t* bitmap = arena_alloc(bitmap_size);
+    struct block_info* infos = arena_alloc(superblock.block_count * sizeof(struct block_info));
+    struct block_request* requests = arena_alloc(MAX(1, header.num_blocks) * sizeof(struct block_request));
+    if (!inodes || !bitmap || !infos || !requests ||
+        disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) != 0 ||
+        disk_read_at(disk, FREE_BITMAP_START, bitmap, bitmap_size) != 0 ||
+        disk_read_at(disk, BLOCK_INFO_START, infos, superblock.block_count * sizeof(struct block_info)) != 0) {
+        printf("File error: could not read the inode table, free bitmap and block info\n");
+        fclose(disk);
+        return -1;
+    }
+
+    // Everything is applied to the copies first, so a stream with a bad record changes nothing
+    const size_t end = stream_size - sizeof(uint32_t);
+    size_t position = sizeof(header);
+    bool valid = true;
+    int first_inode = superblock.inode_count, last_inode = -1;
+    for (uint32_t i = 0; i < header.num_inodes && valid; i++) {
+        struct stream_inode_record record;
+        valid = position + sizeof(record) <= end;
+        if (!valid) break;
+        memcpy(&record, stream + position, sizeof(record));
+        position += sizeof(record);
+
+        valid = record.inode_number < superblock.inode_count;
+        if (!valid) break;
+        inodes[record.inode_number] = record.inode;
+        first_inode = MIN(first_inode, (int) record.inode_number);
+        last_inode = MAX(last_inode, (int) record.inode_number);
+    }
 
-        if (!inode.is_used) return i;
+    int num_requests = 0;
+    int first_block = superblock.block_count, last_block = -1;
+    for (uint32_t i = 0; i < header.num_blocks && valid; i++) {
+        struct stream_block_record record;
+        valid = position + sizeof(record) <= end;
+        if (!valid) break;
+        memcpy(&record, stream + position, sizeof(record));
+        position += sizeof(record);
+
+        const int block_number = (int) record.block_number;
+        valid = block_number < superblock.block_count &&
+            (!record.used || position + superblock.block_size <= end);
+        if (!valid) break;
+
+        infos[block_number] = record.info;
+        if (record.used) {
+            bitmap[block_number / 8] |= 128 >> (block_number % 8);
+            requests[num_requests++] = (struct block_request) {block_number, (uint8_t*) stream + position, superblock.block_size};
+            position += superblock.block_size;
+        } else {
+            bitmap[block_number / 8] &= ~(128 >> (block_number % 8));
+        }
+        first_block = MIN(first_block, block_number);
+        last_block = MAX(last_block, block_number);
+    }
+    if (!valid || position != end) {
+        printf("Stream file %s is damaged\n", stream_path);
+        fclose(disk);
+        return -1;
     }
 
-    return -1;
-}
+    // The data goes first, then the bitmap and block info that claim it, then the inodes pointing at it
+    // The stream's checksums are the ones of the blocks, so the ones of the writes aren't needed
+    if (transfer_data_blocks_disk(nullptr, requests, num_requests, true) != 0) {
+        fclose(disk);
+        return -1;
+    }
 
-// Returns the number of dentries in the specified directory
-int get_num_dentries(const int directory_number) {
-    struct inode directory_inode;
-    read_inode(directory_number, &directory_inode);
-    return (int) (directory_inode.file_size / sizeof(struct dentry));
-}
+    bool written = true;
+    if (last_block != -1) {
+        for (int i = first_block; i <= last_block; i++) {
+            if (block_checksums) block_checksums[i] = infos[i].checksum;
+            mark_block_for_discard(i, !(bitmap[i / 8] & (128 >> (i % 8))));
+        }
 
-// Finds all the dentries in the specified directory
-struct dentry* get_dentries(const int directory_number, int* num_dentries) {
-    struct inode directory_inode;
-    read_inode(directory_number, &directory_inode);
+        written = disk_write_at(disk, FREE_BITMAP_START + first_block / 8, bitmap + first_block / 8,
+                last_block / 8 - first_block / 8 + 1) == 0 &&
+            disk_write_at(disk, BLOCK_INFO_START + first_block * sizeof(struct block_info), &infos[first_block],
+                (last_block - first_block + 1) * sizeof(struct block_info)) == 0;
+        write_barrier(disk);
+    }
 
-    int num_dentries_remaining = (int) (directory_inode.file_size / sizeof(struct dentry));
-    if (num_dentries) {
-        *num_dentries = num_dentries_remaining;
+    if (last_inode != -1) {
+        written = written && disk_write_at(disk, INODE_TABLE_START + first_inode * sizeof(struct inode),
+            &inodes[first_inode], (last_inode - first_inode + 1) * sizeof(struct inode)) == 0;
+        write_barrier(disk);
     }
 
-    struct dentry* dentries = malloc(num_dentries_remaining * sizeof(struct dentry));
-    if (!dentries) {
-        printf("Error: Failed to allocate memory for dentries\n");
-        return nullptr;
+    // The disk moves on to the generation after the stream's, which is where the next stream starts
+    if (written) {
+        superblock.generation = header.generation + 1;
+        superblock.flags = header.flags;
+        written = write_superblock_disk(disk) == 0;
+    }
+    fclose(disk);
+    if (!written) {
+        printf("File error: failed to write the received changes to the disk\n");
+        return -1;
     }
 
-    int dentries_read = 0;
-    int blocks_read = 0;
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("File error: Failed to open disk\n");
-        return nullptr;
+    recalculate_free_space_summary();
+    free_name_filters();
+    if (superblock.flags & SUPERBLOCK_FLAG_DEDUP) {
+        load_dedup_index();
+    } else {
+        free_dedup_index();
     }
+    if (!inodes[current_working_directory].is_used) current_working_directory = 0;
 
-    // Acquire all dentries
-    while (num_dentries_remaining > 0) {
-        // Either read 4 dentries, or read the number left if less than 4
-        int dentries_to_read = DENTRIES_PER_BLOCK;
-        if (num_dentries_remaining < dentries_to_read) dentries_to_read = num_dentries_remaining;
+    if (verbose) printf("Received generation %u from %s, %u inode(s) and %u block(s) changed since generation %u\n",
+        header.generation, stream_path, header.num_inodes, header.num_blocks, header.since);
 
-        read_data_from_block_disk(disk, directory_inode.block_pointers[blocks_read],
-            &dentries[dentries_read], sizeof(struct dentry) * dentries_to_read);
+    return 0;
+}
 
-        dentries_read += dentries_to_read;
-        num_dentries_remaining -= dentries_to_read;
-        blocks_read++;
+// DEFRAG
+// Allocation always takes the lowest free block and inode, so after enough churn the blocks of a file end up
+// scattered over the disk. defrag walks a directory tree, every directory followed by its files and then its
+// subdirectories, and moves the blocks of each file and directory that isn't stored contiguously into one run
+// right after the last run it placed, so a directory's blocks sit next to those of its entries
+// Files also move to the lowest free inode after their directory's inode
+// Directories never have half-empty blocks before their last one, removing a dentry fills its gap with the
+// last dentry and frees the last block once it is empty
+// Blocks shared with other files (cp, snapshot, dedup) are left where they are
+// A run moves at most a budget of blocks and inodes, the next run carries on where the last one stopped
+// A file with more blocks than the budget is still moved when it comes first in a run, so every run makes progress
+
+#define DEFRAG_UNLIMITED_BUDGET INT32_MAX
+
+struct defrag_entry {
+    int inode_number;
+    int directory; // Directory holding the entry's dentry, -1 for the directory defrag started at
+    int position; // Of the dentry within the directory
+    uint8_t file_type;
+};
+
+struct defrag_state {
+    FILE* disk;
+    uint8_t* free_bitmap; // Copy of the free bitmap, kept up to date as blocks move
+    uint8_t* used_inodes; // 1 if the inode is in use
+    int budget; // Blocks and inodes that may still be moved
+    int next_block; // Where the next run of blocks should start
+    int moved_blocks, moved_inodes, moved_elements, skipped_elements;
+};
+
+// Where the last defrag run stopped, -1 if it finished
+int defrag_root = -1;
+int defrag_next_entry = 0;
+int defrag_next_block = 0;
+
+// Lists the tree below root, every directory is followed by its files and then its subdirectories
+// Returns the number of entries, or -1 on error
+int collect_defrag_entries(FILE* disk, const int root, struct defrag_entry* entries) {
+    int num_entries = 0;
+    struct defrag_entry* stack = arena_alloc(superblock.inode_count * sizeof(struct defrag_entry));
+    struct defrag_entry* subdirectories = arena_alloc(superblock.inode_count * sizeof(struct defrag_entry));
+    int stack_size = 0;
+    uint8_t* visited = arena_calloc(superblock.inode_count, 1);
+    if (!stack || !subdirectories || !visited) return -1;
+
+    stack[stack_size++] = (struct defrag_entry) {root, -1, -1, TYPE_DIRECTORY};
+    visited[root] = 1;
+
+    while (stack_size > 0) {
+        const auto directory = stack[--stack_size];
+        entries[num_entries++] = directory;
+
+        struct directory_iterator iterator;
+        if (open_directory(&iterator, disk, directory.inode_number) != 0) return -1;
+
+        int num_subdirectories = 0;
+
+        const struct dentry* dentry;
+        while ((dentry = next_dentry(&iterator)) != nullptr) {
+            const int position = iterator.next_dentry - 1;
+            // Skip . and ..
+            if (position < 2 || dentry->inode_number >= superblock.inode_count || visited[dentry->inode_number]) continue;
+            visited[dentry->inode_number] = 1;
+
+            const struct defrag_entry entry = {dentry->inode_number, directory.inode_number, position, dentry->file_type};
+            if (dentry->file_type == TYPE_DIRECTORY) {
+                subdirectories[num_subdirectories++] = entry;
+            } else {
+                entries[num_entries++] = entry;
+            }
+        }
+        close_directory(&iterator);
+
+        // Pushed in reverse so they are visited in directory order
+        for (int i = num_subdirectories - 1; i >= 0; i--) stack[stack_size++] = subdirectories[i];
     }
 
-    fclose(disk);
-    return dentries;
+    return num_entries;
 }
 
-// Adds the specified dentry to the specified directory
-int create_dentry(const struct dentry* dentry, const int directory) {
-    struct inode dir_inode;
-    read_inode(directory, &dir_inode);
-
-    // The number of dentries the cwd currently has determines where the next one goes
-    const int num_dentries = (int) (dir_inode.file_size / sizeof(struct dentry));
-    int block_number = dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK];
+// Finds count free blocks in a row, preferably starting at or after next_block
+int find_free_block_run(const struct defrag_state* state, const int count) {
+    const int starts[] = {state->next_block, 1};
 
-    if (num_dentries % DENTRIES_PER_BLOCK == 0) {
-        // New data block must be allocated for the new dentry to be created
-        block_number = find_next_free_data_block();
-        if (block_number == -1) {
-            return -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int run_length = 0;
+        for (int block = starts[attempt]; block < superblock.block_count; block++) {
+            const bool is_free = !(state->free_bitmap[block / 8] & (128 >> (block % 8)));
+            run_length = is_free ? run_length + 1 : 0;
+            if (run_length == count) return block - count + 1;
         }
+    }
 
-        dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK] = block_number;
-        // printf("Block pointer %d set to %d\n", num_dentries / DENTRIES_PER_BLOCK, block_number);
-        set_data_block_status(block_number, DATA_BLOCK_USED);
+    return -1;
+}
 
-        if (verbose) printf("Allocated new data block %d for directory, inode %d\n", block_number, directory);
+void defrag_set_block_status(struct defrag_state* state, const int block_number, const int status) {
+    set_data_block_status_disk(state->disk, block_number, status);
+
+    if (status == DATA_BLOCK_USED) {
+        state->free_bitmap[block_number / 8] |= 128 >> (block_number % 8);
+    } else {
+        state->free_bitmap[block_number / 8] &= ~(128 >> (block_number % 8));
     }
-    dir_inode.file_size += sizeof(struct dentry);
+}
 
-    const uint32_t location = DATA_START + block_number * superblock.block_size +
-        (num_dentries % DENTRIES_PER_BLOCK) * sizeof(struct dentry);
+// Moves a file to the lowest free inode after its directory's inode, if that is lower than its own
+// The new inode is written before the dentry points at it, and the old inode is freed last
+int defrag_move_inode(struct defrag_state* state, struct defrag_entry* entry) {
+    int target = -1;
+    for (int i = entry->directory + 1; i < entry->inode_number; i++) {
+        if (!state->used_inodes[i]) {
+            target = i;
+            break;
+        }
+    }
+    if (target == -1) return 0;
 
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
+    struct inode inode;
+    struct inode directory_inode;
+    if (read_inode_disk(state->disk, entry->inode_number, &inode) != 0 ||
+        read_inode_disk(state->disk, entry->directory, &directory_inode) != 0) {
         return -1;
     }
 
-    const auto result = disk_write_at(disk, location, dentry, sizeof(struct dentry));
+    if (write_inode_disk(state->disk, target, &inode) != 0) return -1;
+    update_free_inode_summary(target, true);
+    write_barrier(state->disk);
 
-    if (result != 0) {
-        printf("File error: failed to write dentry to data block %d\n", block_number);
-        return result;
+    const auto block_number = directory_inode.block_pointers[entry->position / DENTRIES_PER_BLOCK];
+    const size_t offset = (entry->position % DENTRIES_PER_BLOCK) * sizeof(struct dentry) + offsetof(struct dentry, inode_number);
+    const uint16_t new_inode_number = target;
+    if (write_data_to_block_at_disk(state->disk, block_number, offset, &new_inode_number, sizeof(new_inode_number)) != 0) {
+        return -1;
     }
 
-    // set_data_block_status(block_number, DATA_BLOCK_USED);
-    write_inode(directory, &dir_inode);
+    write_barrier(state->disk);
+
+    inode.is_used = 0;
+    if (write_inode_disk(state->disk, entry->inode_number, &inode) != 0) return -1;
+    update_free_inode_summary(entry->inode_number, false);
+
+    state->used_inodes[target] = 1;
+    state->used_inodes[entry->inode_number] = 0;
+    entry->inode_number = target;
+    state->moved_inodes++;
+    state->budget--;
 
-    fclose(disk);
     return 0;
 }
 
-// Adds the specified dentry to the cwd
-int create_dentry_cwd(const struct dentry* dentry) {
-    return create_dentry(dentry, current_working_directory);
-}
+// Moves the blocks of an inode into one run, unless they already are in one or some of them are shared
+// The copies are written and the inode points at them before the old blocks are freed
+// Returns 1 if the move doesn't fit in what is left of the budget, -1 on error
+int defrag_move_blocks(struct defrag_state* state, const int inode_number) {
+    struct inode inode;
+    if (read_inode_disk(state->disk, inode_number, &inode) != 0) return -1;
 
-// Removes the specified dentry from the specified directory
-int remove_dentry(const int dir_inode_number, const int dentry_number) {
-    struct inode dir_inode;
-    read_inode(dir_inode_number, &dir_inode);
+    // Holes stay holes, only the blocks that exist have to be in a row
+    int pointers[NUM_BLOCK_POINTERS];
+    int num_blocks = 0;
+    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
+        if (inode.block_pointers[i] != 0) pointers[num_blocks++] = i;
+    }
+    if (num_blocks == 0) return 0;
 
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(dir_inode_number, &num_dentries);
+    const int first_block = inode.block_pointers[pointers[0]];
+    bool contiguous = true;
+    for (int i = 1; i < num_blocks; i++) {
+        if (inode.block_pointers[pointers[i]] != first_block + i) contiguous = false;
+    }
+    if (contiguous) {
+        state->next_block = first_block + num_blocks;
+        return 0;
+    }
 
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        free((void*) dentries);
-        return -1;
+    // Without moving a file past the budget, a run that starts at a large file would never get past it
+    if (num_blocks > state->budget && state->moved_blocks > 0) return 1;
+
+    struct block_info infos[NUM_BLOCK_POINTERS];
+    for (int i = 0; i < num_blocks; i++) {
+        if (read_block_info_disk(state->disk, inode.block_pointers[pointers[i]], &infos[i]) != 0) return -1;
+        if (infos[i].reference_count > 1) {
+            state->skipped_elements++;
+            return 0;
+        }
     }
 
-    // Remove corresponding dentry from this directory
-    // Do this by overwriting corresponding dentry with the last dentry in the directory
-    // Only needed if the dentry to be removed is NOT the last dentry in the list
-    if (dentry_number != num_dentries - 1) {
-        const auto block_number = dir_inode.block_pointers[(dentry_number / DENTRIES_PER_BLOCK)];
-        const uint32_t location = DATA_START + block_number *
-            superblock.block_size + (dentry_number % DENTRIES_PER_BLOCK) * sizeof(struct dentry);
+    const int start = find_free_block_run(state, num_blocks);
+    if (start == -1) {
+        state->skipped_elements++;
+        return 0;
+    }
 
-        const auto result = disk_write_at(disk, location, &dentries[num_dentries - 1], sizeof(struct dentry));
+    uint8_t* block = acquire_io_buffer();
+    if (!block) return -1;
 
-        if (result != 0) {
-            printf("File error: failed to write dentry to data block %d\n", block_number);
-            free((void*) dentries);
-            fclose(disk);
-            return result;
+    int old_blocks[NUM_BLOCK_POINTERS];
+    for (int i = 0; i < num_blocks; i++) {
+        old_blocks[i] = inode.block_pointers[pointers[i]];
+        const int new_block = start + i;
+
+        if (read_data_from_block_disk(state->disk, old_blocks[i], block, superblock.block_size) != 0) {
+            release_io_buffer(block);
+            return -1;
+        }
+        defrag_set_block_status(state, new_block, DATA_BLOCK_USED);
+        if (write_data_to_block_disk(state->disk, new_block, block, superblock.block_size) != 0) {
+            release_io_buffer(block);
+            return -1;
         }
+
+        // Keep the block findable for deduplication
+        if (infos[i].hash != 0) {
+            struct block_info info;
+            if (read_block_info_disk(state->disk, new_block, &info) == 0) {
+                info.hash = infos[i].hash;
+                write_block_info_disk(state->disk, new_block, &info);
+            }
+        }
+
+        inode.block_pointers[pointers[i]] = new_block;
     }
+    release_io_buffer(block);
 
-    dir_inode.file_size -= sizeof(struct dentry);
-    // Set last data block as free if the last dentry was just copied out of it
-    if (num_dentries % DENTRIES_PER_BLOCK == 1) {
-        const auto block_number = dir_inode.block_pointers[num_dentries / DENTRIES_PER_BLOCK];
-        set_data_block_status(block_number, DATA_BLOCK_FREE);
+    write_barrier(state->disk);
+    if (write_inode_disk(state->disk, inode_number, &inode) != 0) return -1;
+    write_barrier(state->disk);
 
-        if (verbose) printf("Data block %d for directory %d is now free\n", block_number, dir_inode_number);
+    for (int i = 0; i < num_blocks; i++) {
+        defrag_set_block_status(state, old_blocks[i], DATA_BLOCK_FREE);
+        if (infos[i].hash != 0) dedup_index_insert(infos[i].hash, start + i);
     }
 
-    write_inode_disk(disk, dir_inode_number, &dir_inode);
+    state->next_block = start + num_blocks;
+    state->moved_blocks += num_blocks;
+    state->moved_elements++;
+    state->budget -= num_blocks;
 
-    free((void*) dentries);
-    fclose(disk);
     return 0;
 }
 
-// Returns the number corresponding to the index of the requested file in a provided list of dentries
-// Returns -1 if the file doesn't exist in the given list of dentries
-int get_dentry_number_of_file(const struct dentry* dentries, const int num_dentries, const char* filename, const int expected_file_type) {
-    for (int i = 0; i < num_dentries; i++) {
-        if (strcmp(dentries[i].name, filename) == 0 && dentries[i].file_type == expected_file_type) {
-            return i;
+int run_command_defrag(char* path, const int budget) {
+    int root = 0;
+    if (path) {
+        const auto result = get_inode_number_of_path(path, TYPE_DIRECTORY, &root);
+        if (result != 0) {
+            // get_inode_number_of_path already prints an error message unless result == 1
+            if (result == 1) printf("Directory %s does not exist\n", path);
+            return -1;
         }
     }
 
-    return -1;
-}
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
+        return -1;
+    }
 
-// Returns the inode number of the given file within the given directory
-// Returns -1 if the file does not exist
-int get_inode_number_of_file(const int directory_number, const char* filename, const int expected_file_type) {
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(directory_number, &num_dentries);
+    uint8_t* free_bitmap = arena_alloc(superblock.block_count / 8);
+    uint8_t* used_inodes = arena_alloc(superblock.inode_count);
+    struct inode* inodes = arena_alloc(superblock.inode_count * sizeof(struct inode));
+    struct defrag_entry* entries = arena_alloc(superblock.inode_count * sizeof(struct defrag_entry));
+
+    int num_entries = -1;
+    if (free_bitmap && used_inodes && inodes && entries &&
+        disk_read_at(disk, FREE_BITMAP_START, free_bitmap, superblock.block_count / 8) == 0 &&
+        disk_read_at(disk, INODE_TABLE_START, inodes, superblock.inode_count * sizeof(struct inode)) == 0) {
+        for (int i = 0; i < superblock.inode_count; i++) used_inodes[i] = inodes[i].is_used;
+        num_entries = collect_defrag_entries(disk, root, entries);
+    }
 
-    const auto dentry_number = get_dentry_number_of_file(&dentries[0], num_dentries, filename, expected_file_type);
-    if (dentry_number == -1) {
-        free((void*) dentries);
+    if (num_entries == -1) {
+        printf("Error: Failed to read the directory tree of %s\n", path ? path : "the disk");
+        fclose(disk);
         return -1;
     }
 
-    const auto inode_number = dentries[dentry_number].inode_number;
+    // Defragmenting a different tree starts over, at the tree's first block
+    if (root != defrag_root || defrag_next_entry >= num_entries) {
+        defrag_root = root;
+        defrag_next_entry = 0;
+        defrag_next_block = inodes[root].block_pointers[0];
+    }
 
-    free((void*) dentries);
-    return inode_number;
-}
+    struct defrag_state state = {disk, free_bitmap, used_inodes, budget, defrag_next_block};
+    int result = 0;
+    int entry = defrag_next_entry;
+    for (; entry < num_entries && result == 0; entry++) {
+        const auto current = &entries[entry];
 
-// If path is dir/dir/.../file, sets 'last' to 'file'
-char* get_last_of_path(char* path) {
-    char* last = strrchr(path, '/');
+        if (current->file_type == TYPE_FILE && current->directory != -1) {
+            if (state.budget < 1) break;
+            if (defrag_move_inode(&state, current) != 0) result = -1;
+        }
 
-    if (last != nullptr) {
-        return last + 1;
+        // The root directory's first block is always block 0
+        if (current->inode_number == 0 || result != 0) continue;
+
+        result = defrag_move_blocks(&state, current->inode_number);
+        if (result == 1) break;
     }
+    fclose(disk);
 
-    return path;
-}
+    if (result == -1) {
+        printf("Error: Defragmentation stopped after moving %d data block(s) and %d inode(s)\n",
+            state.moved_blocks, state.moved_inodes);
+        defrag_root = -1;
+        return -1;
+    }
 
-char* get_all_except_last_of_path(char* path) {
-    char* last_slash = strrchr(path, '/');
-    if (last_slash != nullptr) {
-        *last_slash = '\0';
-        return path;
+    const bool complete = entry >= num_entries;
+    defrag_next_entry = complete ? 0 : entry;
+    defrag_next_block = state.next_block;
+    if (complete) defrag_root = -1;
+
+    if (verbose) {
+        printf("Moved %d data block(s) of %d file(s) and %d inode(s), skipped %d file(s)\n",
+            state.moved_blocks, state.moved_elements, state.moved_inodes, state.skipped_elements);
+        if (complete) {
+            printf("Defragmentation of %s is complete\n", path ? path : "the disk");
+        } else {
+            printf("Stopped at the budget, run defrag again to continue\n");
+        }
     }
 
-    return "";
+    return 0;
 }
 
-// Follows a path (dir/dir/dir/...) to find the inode number of the file/directory at the end
-// Returns 0 if reach the end, 1 if reach the directory before the final file, -1 otherwise
-int get_inode_number_of_path(const char path[249], const int expected_file_type, int* result) {
-    auto current_directory = current_working_directory;
+// FSCK
+// Every member of the volume is memory mapped and the inode table is split into ranges, one per worker thread
+// Workers count how often every data block is referenced, then the counts are compared against
+// the free bitmap and the block info reference counts
+// Checksums are always verified, whatever the checksum policy is
+
+#define FSCK_BAD_TAIL (NUM_BLOCK_POINTERS + 1)
+
+struct fsck_state {
+    const uint8_t* image; // The disk, member 0 of the volume
+    const uint8_t* members[MAX_STRIPE_MEMBERS];
+    size_t member_sizes[MAX_STRIPE_MEMBERS];
+    _Atomic uint32_t* block_references; // References from every used inode
+    _Atomic uint32_t* orphan_block_references; // References from used inodes no directory points to
+    uint8_t* reachable; // 1 if some dentry leads to the inode
+    uint8_t* bad_pointer; // Index + 1 of the first block pointer of the inode that is out of range, 0 if none
+                          // or FSCK_BAD_TAIL if its packed tail is
+    uint8_t* bad_checksum; // 1 if the inode's checksum doesn't match its contents
+    int num_used_inodes;
+};
+
+struct fsck_worker {
+    struct fsck_state* state;
+    int first_inode, end_inode;
+    int num_used_inodes;
+};
+
+void fsck_read_inode(const struct fsck_state* state, const int inode_number, struct inode* destination) {
+    memcpy(destination, state->image + INODE_TABLE_START + inode_number * sizeof(struct inode), sizeof(struct inode));
+}
 
-    // Follow the path to get to the final directory/file
-    char copied_path[249];
-    strcpy(copied_path, path);
-    auto dir = strtok(copied_path, "/");
+const uint8_t* fsck_data_block(const struct fsck_state* state, const int block_number) {
+    const auto location = locate_data_block(block_number);
+    return state->members[location.member] + location.offset;
+}
 
-    while (dir != nullptr) {
-        // Find the next directory in the path to see if we've reached the end of the path
-        const auto next_dir = strtok(nullptr, "/");
-        const int current_expected_file_type = (next_dir == nullptr) ? expected_file_type : TYPE_DIRECTORY;
+void fsck_unmap_volume(struct fsck_state* state) {
+    for (int member = 0; member < superblock.stripe_members; member++) {
+        if (state->members[member]) munmap((void*) state->members[member], state->member_sizes[member]);
+    }
+}
 
-        const auto inode_number = get_inode_number_of_file(current_directory, dir, current_expected_file_type);
-        if (inode_number == -1) {
-            if (next_dir != nullptr) {
-                // One of the directories in the middle of the path does not exist
-                printf("Directory %s does not exist\n", dir);
-                return -1;
+// Maps every member of the volume into memory, after checking that none of them is too small
+int fsck_map_volume(struct fsck_state* state) {
+    for (int member = 0; member < num_open_members; member++) {
+        const auto volume_member = &volume_members[member];
+        struct stat member_stat;
+        if (fstat(volume_member->fd, &member_stat) != 0) {
+            printf("Error: Failed to open volume member %d\n", member);
+            return -1;
+        }
+
+        const uint64_t expected_size = volume_member->data_start + (uint64_t) volume_member->block_count * superblock.block_size;
+        if ((uint64_t) member_stat.st_size < expected_size) {
+            if (member == 0) {
+                printf("Disk is smaller than its superblock says, %lld bytes\n", (long long) member_stat.st_size);
+            } else {
+                printf("Volume member %d is smaller than its superblock says, %lld bytes\n", member, (long long) member_stat.st_size);
             }
+            return -1;
+        }
 
-            // The file does not exist, but the directory that should contain it does
-            *result = current_directory;
-            return 1;
+        const uint8_t* image = mmap(nullptr, member_stat.st_size, PROT_READ, MAP_SHARED, volume_member->fd, 0);
+        if (image == MAP_FAILED) {
+            printf("Error: Failed to map disk into memory\n");
+            return -1;
         }
 
-        current_directory = inode_number;
-        dir = next_dir;
+        state->members[member] = image;
+        state->member_sizes[member] = member_stat.st_size;
     }
 
-    *result = current_directory;
+    state->image = state->members[0];
     return 0;
 }
 
-int run_command_init(const char* disk_name) {
-    const auto block_count = calculate_block_count(DEFAULT_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+void* fsck_scan_inodes(void* argument) {
+    struct fsck_worker* worker = argument;
+    const auto state = worker->state;
 
-    const struct superblock sb = {DEFAULT_SIZE, DEFAULT_BLOCK_SIZE, block_count, sizeof(struct inode), DEFAULT_INODE_COUNT};
-    superblock = sb;
-    calculate_disk_structure();
+    for (int i = worker->first_inode; i < worker->end_inode; i++) {
+        struct inode inode;
+        fsck_read_inode(state, i, &inode);
+        if (inode.checksum != 0 && inode_checksum(&inode) != inode.checksum) state->bad_checksum[i] = 1;
+        if (!inode.is_used) continue;
+
+        worker->num_used_inodes++;
+        for (int pointer = 0; pointer < NUM_BLOCK_POINTERS; pointer++) {
+            const int block_number = inode.block_pointers[pointer];
+            // The root directory's first block is block 0, for every other pointer 0 means unused
+            // Files can have holes, so later pointers still have to be checked
+            if (block_number == 0 && !(i == 0 && pointer == 0)) continue;
+
+            if (block_number >= superblock.block_count) {
+                if (!state->bad_pointer[i]) state->bad_pointer[i] = pointer + 1;
+                break;
+            }
 
-    FILE *disk = fopen(disk_name, "w+b");
-    if (disk == nullptr) {
-        printf("Failed to open disk: %s\n", disk_name);
+            atomic_fetch_add_explicit(&state->block_references[block_number], 1, memory_order_relaxed);
+            if (!state->reachable[i]) {
+                atomic_fetch_add_explicit(&state->orphan_block_references[block_number], 1, memory_order_relaxed);
+            }
+        }
+
+        // A packed tail is one reference to its fragment
+        const int tail_block = inode.tail_block;
+        if (tail_block == 0) continue;
+        if (tail_block >= superblock.block_count || inode.tail_offset + get_tail_length(&inode) > superblock.block_size) {
+            if (!state->bad_pointer[i]) state->bad_pointer[i] = FSCK_BAD_TAIL;
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&state->block_references[tail_block], 1, memory_order_relaxed);
+        if (!state->reachable[i]) {
+            atomic_fetch_add_explicit(&state->orphan_block_references[tail_block], 1, memory_order_relaxed);
+        }
+    }
+
+    return nullptr;
+}
+
+// Walks the directory tree from the root, marking every inode a dentry leads to
+// Returns the number of problems found
+int fsck_walk_directories(const struct fsck_state* state) {
+    int problems = 0;
+    int* stack = arena_alloc(superblock.inode_count * sizeof(int));
+    if (!stack) {
+        printf("Error: Failed to allocate memory for the directory walk\n");
         return 1;
     }
+    int stack_size = 0;
 
-    // Write superblock to the beginning of the disk
-    if (disk_write(disk, &sb, sizeof(struct superblock)) != 0) {
-        fclose(disk);
-        printf("File error: could not write superblock to the disk\n");
+    stack[stack_size++] = 0;
+    state->reachable[0] = 1;
+
+    while (stack_size > 0) {
+        const int directory = stack[--stack_size];
+        struct inode inode;
+        fsck_read_inode(state, directory, &inode);
+
+        const int num_dentries = (int) (inode.file_size / sizeof(struct dentry));
+        if (num_dentries > NUM_BLOCK_POINTERS * DENTRIES_PER_BLOCK) {
+            printf("Directory inode %d: size %d is larger than a directory can be\n", directory, inode.file_size);
+            problems++;
+            continue;
+        }
+
+        for (int i = 2; i < num_dentries; i++) {
+            const int block_number = inode.block_pointers[i / DENTRIES_PER_BLOCK];
+            if (block_number >= superblock.block_count) break; // Reported by the inode scan
+
+            struct dentry dentry;
+            memcpy(&dentry, fsck_data_block(state, block_number) +
+                (i % DENTRIES_PER_BLOCK) * sizeof(struct dentry), sizeof(struct dentry));
+
+            struct inode target;
+            if (dentry.inode_number >= superblock.inode_count ||
+                (fsck_read_inode(state, dentry.inode_number, &target), !target.is_used)) {
+                printf("Directory inode %d: dentry %.*s refers to unused inode %d\n", directory,
+                    (int) sizeof(dentry.name), dentry.name, dentry.inode_number);
+                problems++;
+                continue;
+            }
+
+            if (state->reachable[dentry.inode_number]) continue;
+            state->reachable[dentry.inode_number] = 1;
+
+            if (dentry.file_type == TYPE_DIRECTORY) stack[stack_size++] = dentry.inode_number;
+        }
+    }
+
+    return problems;
+}
+
+int run_command_fsck(const bool repair) {
+    struct fsck_state state = {nullptr};
+    if (fsck_map_volume(&state) != 0) {
+        fsck_unmap_volume(&state);
         return -1;
     }
 
-    // Create root inode (always inode 0)
-    struct inode root_inode = {-1};
-    root_inode.file_size = sizeof(struct dentry) * 2;
-    root_inode.block_pointers[0] = 0;
-    root_inode.is_used = true;
+    const uint8_t* image = state.image;
+    state.block_references = arena_calloc(superblock.block_count, sizeof(*state.block_references));
+    state.orphan_block_references = arena_calloc(superblock.block_count, sizeof(*state.orphan_block_references));
+    state.reachable = arena_calloc(superblock.inode_count, 1);
+    state.bad_pointer = arena_calloc(superblock.inode_count, 1);
+    state.bad_checksum = arena_calloc(superblock.inode_count, 1);
+
+    int problems = fsck_walk_directories(&state);
+
+    // Split the inode table between worker threads
+    auto num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > MAX_WORKER_THREADS) num_workers = MAX_WORKER_THREADS;
+
+    pthread_t threads[MAX_WORKER_THREADS];
+    struct fsck_worker workers[MAX_WORKER_THREADS];
+    const int inodes_per_worker = (superblock.inode_count + num_workers - 1) / num_workers;
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = (struct fsck_worker) {&state, i * inodes_per_worker, MIN((i + 1) * inodes_per_worker, superblock.inode_count)};
+        if (pthread_create(&threads[i], nullptr, fsck_scan_inodes, &workers[i]) != 0) {
+            // Fall back to scanning this range on the current thread
+            fsck_scan_inodes(&workers[i]);
+            threads[i] = 0;
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (threads[i]) pthread_join(threads[i], nullptr);
+        state.num_used_inodes += workers[i].num_used_inodes;
+    }
+
+    int num_orphaned_inodes = 0;
+    for (int i = 0; i < superblock.inode_count; i++) {
+        if (state.bad_checksum[i]) {
+            printf("Inode %d: checksum does not match its contents\n", i);
+            problems++;
+        }
+
+        struct inode inode;
+        fsck_read_inode(&state, i, &inode);
+        if (!inode.is_used) continue;
+
+        if (state.bad_pointer[i] == FSCK_BAD_TAIL) {
+            printf("Inode %d: packed tail at offset %d of data block %d is out of bounds\n",
+                i, inode.tail_offset, inode.tail_block);
+            problems++;
+        } else if (state.bad_pointer[i]) {
+            printf("Inode %d: block pointer %d refers to nonexistent data block %d\n",
+                i, state.bad_pointer[i] - 1, inode.block_pointers[state.bad_pointer[i] - 1]);
+            problems++;
+        }
+        if (!state.reachable[i]) {
+            printf("Inode %d is in use but not reachable from the root directory\n", i);
+            num_orphaned_inodes++;
+            problems++;
+        }
+    }
+
+    int num_used_blocks = 0;
+    uint8_t* bad_block_checksum = arena_calloc(superblock.block_count, 1);
+    const uint8_t* bitmap = image + FREE_BITMAP_START;
+    const struct block_info* infos = (const struct block_info*) (image + BLOCK_INFO_START);
 
-    if (disk_write(disk, &root_inode, sizeof(struct inode)) != 0) {
-        fclose(disk);
-        printf("File error: could not write root inode to the disk\n");
-        return -1;
-    }
+    for (int i = 0; i < superblock.block_count; i++) {
+        const bool marked_used = bitmap[i / 8] & (128 >> (i % 8));
+        const uint32_t references = state.block_references[i];
+        struct block_info info;
+        memcpy(&info, &infos[i], sizeof(info));
 
-    // Write blank inodes to the disk next
-    const struct inode inode = {0};
-    for (int i = 0; i < DEFAULT_INODE_COUNT - 1; i++) {
-        if (disk_write(disk, &inode, sizeof(struct inode)) != 0) {
-            fclose(disk);
-            printf("File error: could not write inode %d to the disk\n", i);
-            return -1;
+        if (references > 0) num_used_blocks++;
+
+        if (marked_used && info.checksum != 0 &&
+            compute_checksum(fsck_data_block(&state, i), superblock.block_size) != info.checksum) {
+            printf("Data block %d: checksum does not match its contents\n", i);
+            bad_block_checksum[i] = 1;
+            problems++;
+        }
+
+        if (references > 0 && !marked_used) {
+            printf("Data block %d is referenced but marked free\n", i);
+            problems++;
+        } else if (references == 0 && marked_used) {
+            printf("Data block %d is in use but not referenced by any inode\n", i);
+            problems++;
+        } else if (references != info.reference_count && marked_used) {
+            // More references than the count means the block was handed out twice
+            printf("Data block %d is referenced %u time(s) but its reference count is %d\n",
+                i, references, info.reference_count);
+            problems++;
         }
     }
 
-    // Write blank bytes for free space bitmap
-    uint8_t bitmap[block_count / 8];
-    memset(bitmap, 0, block_count / 8);
-    if (disk_write(disk, &bitmap, sizeof(bitmap)) != 0) {
-        fclose(disk);
-        printf("File error: could not write free block bitmap to the disk\n");
-        return -1;
+    if (superblock.free_block_count != superblock.block_count - num_used_blocks) {
+        printf("Superblock says %d data blocks are free, but %d are not referenced\n",
+            superblock.free_block_count, superblock.block_count - num_used_blocks);
+        problems++;
+    }
+    if (superblock.free_inode_count != superblock.inode_count - state.num_used_inodes) {
+        printf("Superblock says %d inodes are free, but %d are not in use\n",
+            superblock.free_inode_count, superblock.inode_count - state.num_used_inodes);
+        problems++;
     }
 
-    // Fill the rest of the space with empty data blocks
-    constexpr uint8_t empty_data_block[DEFAULT_BLOCK_SIZE] = {0};
-    for (int i = 0; i < block_count; i++) {
-        if (disk_write(disk, empty_data_block, sizeof(empty_data_block)) != 0) {
+    printf("fsck: %d inodes and %d data blocks in use, %d problem(s) found\n",
+        state.num_used_inodes, num_used_blocks, problems);
+
+    if (repair && problems > 0) {
+        FILE* disk = open_disk(DEFAULT_DISK_NAME, "r+b");
+        if (!disk) {
+            printf("Error: Failed to open disk\n");
+        } else {
+            // Orphaned inodes are freed, so their blocks don't count towards the new bitmap
+            uint8_t* new_bitmap = arena_calloc(superblock.block_count / 8, 1);
+
+            for (int i = 0; i < superblock.block_count; i++) {
+                const uint32_t references = state.block_references[i] - state.orphan_block_references[i];
+                if (references > 0) new_bitmap[i / 8] |= 128 >> (i % 8);
+
+                struct block_info info;
+                memcpy(&info, &infos[i], sizeof(info));
+                // Blocks that change status get a new generation, so the change is sent to replicas
+                const bool status_changed = (references > 0) != ((bitmap[i / 8] & (128 >> (i % 8))) != 0);
+                if (info.reference_count != references || bad_block_checksum[i] || status_changed) {
+                    if (references == 0) {
+                        info.hash = 0;
+                        info.checksum = 0;
+                    } else if (bad_block_checksum[i]) {
+                        // The contents can't be recovered, so accept them as they are
+                        info.checksum = compute_checksum(fsck_data_block(&state, i), superblock.block_size);
+                    }
+                    info.reference_count = references;
+                    write_block_info_disk(disk, i, &info);
+                }
+            }
+            disk_write_at(disk, FREE_BITMAP_START, new_bitmap, superblock.block_count / 8);
+
+            for (int i = 0; i < superblock.inode_count; i++) {
+                struct inode inode;
+                fsck_read_inode(&state, i, &inode);
+
+                // Writing the inode gives it a checksum that matches its current contents
+                const bool orphaned = inode.is_used && !state.reachable[i];
+                if (!orphaned && !state.bad_checksum[i]) continue;
+
+                if (orphaned) inode.is_used = 0;
+                write_inode_disk(disk, i, &inode);
+            }
             fclose(disk);
-            printf("File error: could not write data block %d to the disk\n", i);
-            return -1;
+
+            recalculate_free_space_summary();
+            if (superblock.flags & SUPERBLOCK_FLAG_DEDUP) load_dedup_index();
+            free_name_filters();
+
+            printf("Rebuilt free bitmap, reference counts and checksums, freed %d orphaned inode(s)\n", num_orphaned_inodes);
         }
     }
 
-    // Initialize root directory's data block
-    const struct dentry entries[] = {
-        {0, TYPE_DIRECTORY, "."},
-        {0, TYPE_DIRECTORY, ".."}
-    };
-    write_data_to_block_disk(disk, 0, entries, sizeof(entries));
-    set_data_block_status_disk(disk, 0, DATA_BLOCK_USED);
+    fsck_unmap_volume(&state);
 
-    current_working_directory = 0;
+    return problems > 0 ? 1 : 0;
+}
 
-    if (verbose) printf("Initialized NanoFS system: %s\n", disk_name);
+// TREE WALK
+// du and find walk a directory tree with a pool of worker threads, reading the volume through the same memory
+// mapping fsck uses. Every worker expands directories from the bottom of its own deque, and steals from the
+// top of another worker's deque once its own is empty
+// The dentries of a directory are gathered first, and the inodes they name are then read in inode number order
+// Matches are only turned into paths once the walk is over
+
+#define MAX_DIRECTORY_DENTRIES (NUM_BLOCK_POINTERS * MAX_DENTRIES_PER_BLOCK)
+#define MAX_WALK_PATH_LEN 4096
+
+int max_walk_workers = MAX_WORKER_THREADS; // Walks use at most this many threads, and no more than there are cores
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    int* directories;
+    int top, bottom; // The deque holds directories[top] to directories[bottom - 1]
+};
+
+struct walk_match {
+    int directory;
+    char name[sizeof(((struct dentry*) nullptr)->name)];
+};
+
+struct walk_state {
+    struct fsck_state volume;
+    const char* pattern; // Names find looks for, nullptr for du
+    struct walk_deque deques[MAX_WORKER_THREADS];
+    int num_workers;
+    _Atomic int pending_directories; // Pushed onto a deque but not expanded yet
+    _Atomic uint8_t* visited;
+    struct walk_match* found_directories; // Directory and name every directory was found under
+    struct walk_match* matches;
+    _Atomic int num_matches;
+};
+
+struct walk_worker {
+    struct walk_state* state;
+    int index;
+    long long bytes;
+    int files, directories, blocks;
+};
+
+void walk_push(struct walk_deque* deque, const int directory) {
+    pthread_mutex_lock(&deque->lock);
+    deque->directories[deque->bottom++] = directory;
+    pthread_mutex_unlock(&deque->lock);
+}
 
-    fclose(disk);
-    return 0;
+// The owner takes the directory it pushed last, its subtree is the most likely to still be cached
+bool walk_pop(struct walk_deque* deque, int* directory) {
+    pthread_mutex_lock(&deque->lock);
+    const bool found = deque->bottom > deque->top;
+    if (found) *directory = deque->directories[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
 }
 
-int run_command_ls() {
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(current_working_directory, &num_dentries);
-    if (!dentries) return -1;
+// Thieves take the oldest directory, which usually has the largest subtree left below it
+bool walk_steal(struct walk_state* state, const int thief, int* directory) {
+    for (int i = 1; i < state->num_workers; i++) {
+        auto deque = &state->deques[(thief + i) % state->num_workers];
 
-    for (int i = 0; i < num_dentries; i++) {
-        printf("%s ", dentries[i].name);
+        pthread_mutex_lock(&deque->lock);
+        const bool found = deque->bottom > deque->top;
+        if (found) *directory = deque->directories[deque->top++];
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found) return true;
     }
-    printf("\n");
 
-    free((void*) dentries);
-    return 0;
+    return false;
 }
 
-int run_command_create(char* file_path) {
-    int inode_number_dir;
-    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number_dir);
+int compare_dentries_by_inode(const void* a, const void* b) {
+    return ((const struct dentry*) a)->inode_number - ((const struct dentry*) b)->inode_number;
+}
 
-    // Check if a file with the same name exists in the cwd
-    if (result == 0) {
-        printf("File %s already exists in the current directory\n", file_path);
-        return 1;
-    }
-    if (result == -1) {
-        // Path could not be resolved
-        return -1;
-    }
+void walk_expand_directory(struct walk_worker* worker, const int directory) {
+    const auto state = worker->state;
 
-    // Make sure the disk has a spare inode and data block
-    const auto inode_number = find_next_free_inode();
+    struct inode inode;
+    fsck_read_inode(&state->volume, directory, &inode);
+    const int num_dentries = MIN((int) (inode.file_size / sizeof(struct dentry)), NUM_BLOCK_POINTERS * DENTRIES_PER_BLOCK);
 
-    if (inode_number == -1) {
-        printf("All inodes are being used, unable to create file\n");
-        return -1;
+    // Skip . and ..
+    struct dentry dentries[MAX_DIRECTORY_DENTRIES];
+    int num_children = 0;
+    for (int i = 2; i < num_dentries; i++) {
+        const int block_number = inode.block_pointers[i / DENTRIES_PER_BLOCK];
+        if (block_number >= superblock.block_count) break;
+
+        memcpy(&dentries[num_children++], fsck_data_block(&state->volume, block_number) +
+            (i % DENTRIES_PER_BLOCK) * sizeof(struct dentry), sizeof(struct dentry));
     }
+    qsort(dentries, num_children, sizeof(struct dentry), compare_dentries_by_inode);
 
-    const auto data_block_number = find_next_free_data_block();
+    for (int i = 0; i < num_children; i++) {
+        const auto dentry = &dentries[i];
+        if (dentry->inode_number >= superblock.inode_count) continue;
 
-    if (data_block_number == -1) {
-        printf("All data blocks are being used, unable to create file\n");
-        return -1;
-    }
+        struct inode child;
+        fsck_read_inode(&state->volume, dentry->inode_number, &child);
+        if (!child.is_used) continue;
 
-    set_data_block_status(data_block_number, DATA_BLOCK_USED);
+        if (state->pattern && fnmatch(state->pattern, dentry->name, 0) == 0) {
+            auto match = &state->matches[atomic_fetch_add(&state->num_matches, 1)];
+            match->directory = directory;
+            snprintf(match->name, sizeof(match->name), "%s", dentry->name);
+        }
 
-    struct dentry dentry = {inode_number, TYPE_FILE};
-    const char* filename = get_last_of_path(file_path);
-    strcpy(dentry.name, filename);
-    struct inode inode = {0};
-    inode.file_size = 0;
-    inode.block_pointers[0] = data_block_number;
-    inode.is_used = true;
+        if (dentry->file_type == TYPE_DIRECTORY) {
+            // A damaged image could lead back to a directory that was already walked
+            if (atomic_exchange(&state->visited[dentry->inode_number], 1)) continue;
 
-    if (create_dentry(&dentry, inode_number_dir) == -1) {
-        printf("All data blocks are being used, unable to create new dentry\n");
-        set_data_block_status(data_block_number, DATA_BLOCK_FREE);
-        return -1;
-    }
-    write_inode(inode_number, &inode);
+            auto found = &state->found_directories[dentry->inode_number];
+            found->directory = directory;
+            snprintf(found->name, sizeof(found->name), "%s", dentry->name);
 
-    if (verbose) printf("Created new file %s, inode %d, data block %d\n",
-        file_path, inode_number, data_block_number);
+            worker->directories++;
+            atomic_fetch_add(&state->pending_directories, 1);
+            walk_push(&state->deques[worker->index], dentry->inode_number);
+            continue;
+        }
 
-    return 0;
+        worker->files++;
+        worker->bytes += child.file_size;
+        for (int pointer = 0; pointer < NUM_BLOCK_POINTERS; pointer++) {
+            if (child.block_pointers[pointer] != 0) worker->blocks++;
+        }
+    }
 }
 
-int run_command_write(char* file_path, const char* content) {
-    int inode_number;
-    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+void* run_walk_worker(void* argument) {
+    struct walk_worker* worker = argument;
+    const auto state = worker->state;
 
-    if (result != 0) {
-        printf("File %s does not exist in the current directory\n", file_path);
-        return 1;
-    }
+    // A directory is only done once its subdirectories have been pushed, so nothing is left once the count is 0
+    while (atomic_load(&state->pending_directories) > 0) {
+        int directory;
+        if (!walk_pop(&state->deques[worker->index], &directory) && !walk_steal(state, worker->index, &directory)) {
+            sched_yield();
+            continue;
+        }
 
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        return -1;
+        walk_expand_directory(worker, directory);
+        atomic_fetch_sub(&state->pending_directories, 1);
     }
 
-    struct inode inode;
-    read_inode_disk(disk, inode_number, &inode);
-
-    const int data_size = (int) strlen(content);
-    inode.file_size = data_size;
+    return nullptr;
+}
 
-    write_inode_disk(disk, inode_number, &inode);
-    write_data_to_block_disk(disk, inode.block_pointers[0], content, data_size);
+// Writes the path of directory, starting with root_path for the directory the walk started at
+// Returns the length the path would have had with enough room, like snprintf
+size_t get_walk_path(const struct walk_state* state, const int root, const char* root_path, const int directory,
+    char* destination, const size_t size) {
+    if (directory == root) return snprintf(destination, size, "%s", root_path);
 
-    if (verbose) printf("Wrote %d bytes to file %s, inode %d, data block %d\n",
-        data_size, file_path, inode_number, inode.block_pointers[0]);
+    const auto found = &state->found_directories[directory];
+    const auto length = get_walk_path(state, root, root_path, found->directory, destination, size);
+    if (length >= size) return length;
 
-    fclose(disk);
-    return 0;
+    return length + snprintf(destination + length, size - length, "/%s", found->name);
 }
 
-int run_command_read(char* file_path) {
-    int inode_number;
-    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
 
-    if (result != 0) {
-        if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
-        return 1;
+// Totals of a walk, or the paths it found sorted by name
+struct walk_result {
+    long long bytes;
+    int files, directories, blocks;
+    char** paths;
+    int num_paths;
+};
+
+// Walks the tree below root, finding the names that match pattern if it isn't nullptr
+// The paths found start with root_path and live in the arena
+int walk_tree(const int root, const char* root_path, const char* pattern, struct walk_result* result) {
+    struct walk_state state = {.pattern = pattern};
+    if (fsck_map_volume(&state.volume) != 0) {
+        fsck_unmap_volume(&state.volume);
+        return -1;
     }
 
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
+    auto num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > max_walk_workers) num_workers = max_walk_workers;
+    state.num_workers = num_workers;
+
+    state.visited = arena_calloc(superblock.inode_count, sizeof(*state.visited));
+    state.found_directories = arena_alloc(superblock.inode_count * sizeof(struct walk_match));
+    state.matches = arena_alloc(superblock.inode_count * sizeof(struct walk_match));
+    bool allocated = state.visited && state.found_directories && state.matches;
+    for (int i = 0; i < num_workers && allocated; i++) {
+        state.deques[i] = (struct walk_deque) {PTHREAD_MUTEX_INITIALIZER, arena_alloc(superblock.inode_count * sizeof(int))};
+        allocated = state.deques[i].directories != nullptr;
+    }
+    if (!allocated) {
+        printf("Error: Failed to allocate memory for the tree walk\n");
+        fsck_unmap_volume(&state.volume);
         return -1;
     }
 
-    struct inode inode;
-    read_inode_disk(disk, inode_number, &inode);
-    const auto data_size = MIN(inode.file_size, superblock.block_size);
+    state.visited[root] = 1;
+    state.pending_directories = 1;
+    walk_push(&state.deques[0], root);
+
+    pthread_t threads[MAX_WORKER_THREADS];
+    struct walk_worker workers[MAX_WORKER_THREADS];
+    bool started[MAX_WORKER_THREADS] = {false};
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = (struct walk_worker) {&state, i};
+        // The workers that did start pick up the work of one that didn't
+        started[i] = pthread_create(&threads[i], nullptr, run_walk_worker, &workers[i]) == 0;
+    }
+    if (!started[0]) run_walk_worker(&workers[0]);
+    for (int i = 0; i < num_workers; i++) {
+        if (started[i]) pthread_join(threads[i], nullptr);
+    }
 
-    char data[data_size + 1];
-    read_data_from_block_disk(disk, inode.block_pointers[0], &data, data_size);
-    data[data_size] = '\0';
+    *result = (struct walk_result) {0};
+    for (int i = 0; i < num_workers; i++) {
+        result->bytes += workers[i].bytes;
+        result->files += workers[i].files;
+        result->directories += workers[i].directories;
+        result->blocks += workers[i].blocks;
+    }
 
-    fclose(disk);
+    result->num_paths = state.num_matches;
+    result->paths = arena_alloc((result->num_paths + 1) * sizeof(char*));
+    for (int i = 0; result->paths && i < result->num_paths; i++) {
+        auto path = arena_alloc(MAX_WALK_PATH_LEN);
+        if (!path) {
+            result->paths = nullptr;
+            break;
+        }
 
-    if (data_size > 0) printf("%s\n", data);
+        const auto match = &state.matches[i];
+        const auto length = get_walk_path(&state, root, root_path, match->directory, path, MAX_WALK_PATH_LEN);
+        if (length < MAX_WALK_PATH_LEN) snprintf(path + length, MAX_WALK_PATH_LEN - length, "/%s", match->name);
+        result->paths[i] = path;
+    }
+    fsck_unmap_volume(&state.volume);
 
-    if (verbose) printf("Read %d bytes from file %s, inode %d, data block %d\n",
-        data_size, file_path, inode_number, inode.block_pointers[0]);
+    if (!result->paths) {
+        printf("Error: Failed to allocate memory for the paths found\n");
+        return -1;
+    }
 
+    // Workers find names in whatever order they get to them
+    qsort(result->paths, result->num_paths, sizeof(char*), compare_paths);
     return 0;
 }
 
-int run_command_open(char* file_path) {
-    int inode_number;
-    auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
+// Finds the directory a walk starts at, path or the cwd if path is nullptr
+int get_walk_root(const char* path, int* root) {
+    *root = current_working_directory;
+    if (!path) return 0;
 
+    const auto result = get_inode_number_of_path(path, TYPE_DIRECTORY, root);
     if (result != 0) {
-        printf("File %s does not exist in the current directory\n", file_path);
-        return 1;
-    }
-
-    struct inode inode;
-    read_inode(inode_number, &inode);
-    const auto data_size = inode.file_size;
-    int bytes_read = 0;
-    char data[data_size];
-
-    if (verbose) printf("Copying %s, inode %d, into real filesystem\n", file_path, inode_number);
-
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "rb");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
+        // get_inode_number_of_path already prints an error message unless result == 1
+        if (result == 1) printf("Directory %s does not exist\n", path);
         return -1;
     }
 
-    while (bytes_read < data_size) {
-        const auto bytes_to_read = MIN(data_size - bytes_read, DEFAULT_BLOCK_SIZE);
-
-        const auto block_number = inode.block_pointers[bytes_read / superblock.block_size];
-        read_data_from_block_disk(disk, block_number, &data[bytes_read], bytes_to_read);
+    return 0;
+}
 
-        bytes_read += bytes_to_read;
+int run_command_du(const char* path) {
+    int root;
+    struct walk_result result;
+    const char* root_path = path ? path : ".";
+    if (get_walk_root(path, &root) != 0 || walk_tree(root, root_path, nullptr, &result) != 0) return -1;
 
-        if (verbose) printf("Read %d bytes from data block %d\n", bytes_to_read, block_number);
-    }
+    printf("%lld bytes in %d data block(s), %d file(s) and %d director(ies) under %s\n",
+        result.bytes, result.blocks, result.files, result.directories, root_path);
 
-    fclose(disk);
+    return 0;
+}
 
-    // +5 to give enough space for .txt\0
-    char output_file_name[strlen(file_path) + 5];
-    strcpy(output_file_name, file_path);
-    strcat(output_file_name, ".txt");
+int run_command_find(const char* path, const char* pattern) {
+    int root;
+    struct walk_result result;
+    const char* root_path = path ? path : ".";
+    if (get_walk_root(path, &root) != 0 || walk_tree(root, root_path, pattern, &result) != 0) return -1;
 
-    FILE* output_file = fopen(output_file_name, "wb");
-    if (!output_file) {
-        printf("Error: Failed to open disk\n");
-        return -1;
-    }
+    for (int i = 0; i < result.num_paths; i++) printf("%s\n", result.paths[i]);
+    if (verbose) printf("Found %d match(es) for %s under %s\n", result.num_paths, pattern, root_path);
 
-    result = disk_write_at(output_file, 0, data, data_size);
-    fclose(output_file);
+    return 0;
+}
 
-    if (result != 0) {
-        printf("File error: failed to write to real file %s", output_file_name);
-        return result;
-    }
+int run_command_df() {
+    const int used_blocks = superblock.block_count - superblock.free_block_count;
+    const int used_inodes = superblock.inode_count - superblock.free_inode_count;
 
-    if (verbose) printf("Finished copying. Wrote %d bytes total to %s\n", bytes_read, output_file_name);
+    printf("Data blocks: %d total, %d used, %d free (%d%% used), %d bytes each\n", superblock.block_count,
+        used_blocks, superblock.free_block_count, used_blocks * 100 / superblock.block_count, superblock.block_size);
+    printf("Inodes: %d total, %d used, %d free (%d%% used)\n", superblock.inode_count,
+        used_inodes, superblock.free_inode_count, used_inodes * 100 / superblock.inode_count);
 
     return 0;
 }
 
-int run_command_save(char* input_file_path, char* file_path) {
-    FILE* input_file = fopen(input_file_path, "rb");
-    if (!input_file) {
-        printf("Could not open real file %s\n", input_file_path);
-        return 1;
+int run_command_dedup(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        printf("Deduplication is %s\n", (superblock.flags & SUPERBLOCK_FLAG_DEDUP) ? "on" : "off");
+        return 0;
     }
 
-    int inode_number;
-    const auto result = get_inode_number_of_path(file_path, TYPE_FILE, &inode_number);
-    if (result != 0) {
-        printf("File %s does not exist in the current directory\n", file_path);
+    if (strcmp(command[1], "on") == 0) {
+        if (load_dedup_index() != 0) return -1;
+        superblock.flags |= SUPERBLOCK_FLAG_DEDUP;
+    } else if (strcmp(command[1], "off") == 0) {
+        // Hashes stay in the block info region so the index can be rebuilt when dedup is turned back on
+        free_dedup_index();
+        superblock.flags &= ~SUPERBLOCK_FLAG_DEDUP;
+    } else {
+        printf("Usage: dedup [on|off]\n");
         return 1;
     }
 
-    char data[superblock.block_size];
+    if (write_superblock() != 0) return -1;
 
-    int bytes_read = 0;
-    int total_bytes_read = 0;
+    if (verbose) printf("Deduplication %s\n", (superblock.flags & SUPERBLOCK_FLAG_DEDUP) ? "enabled" : "disabled");
+    return 0;
+}
 
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        return -1;
+// Files written from now on have their last partial block packed into a shared fragment, or get blocks of their own
+// Turning packing off leaves packed files as they are until they are changed
+int run_command_tailpack(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        printf("Tail packing is %s\n", tail_packing_enabled() ? "on" : "off");
+        return 0;
     }
 
-    struct inode inode;
-    read_inode_disk(disk, inode_number, &inode);
-
-    if (verbose) printf("Copying from %s to %s, inode %d\n", input_file_path, file_path, inode_number);
+    if (strcmp(command[1], "on") == 0) {
+        superblock.flags |= SUPERBLOCK_FLAG_PACK_TAILS;
+    } else if (strcmp(command[1], "off") == 0) {
+        superblock.flags &= ~SUPERBLOCK_FLAG_PACK_TAILS;
+    } else {
+        printf("Usage: tailpack [on|off]\n");
+        return 1;
+    }
 
-    do {
-        bytes_read = (int) fread(data, 1, superblock.block_size, input_file);
-        if (bytes_read < superblock.block_size && !feof(input_file)) {
-            printf("Error reading file %s, expected %d bytes, only read %d",
-                input_file_path, superblock.block_size, bytes_read);
-            return -1;
-        }
+    if (write_superblock() != 0) return -1;
 
-        int block_number = inode.block_pointers[total_bytes_read / superblock.block_size];
-        if (block_number == 0) {
-            block_number = find_next_free_data_block_disk(disk);
+    if (verbose) printf("Tail packing %s\n", tail_packing_enabled() ? "enabled" : "disabled");
+    return 0;
+}
 
-            if (block_number == -1) {
-                printf("No free data blocks in disk, couldn't save file %s. Only saved %d bytes.\n", file_path, total_bytes_read);
-                return -1;
-            }
+int run_command_checksum(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        printf("Checksum verification is %s, using %s CRC32C\n", CHECKSUM_POLICY_NAMES[checksum_policy],
+            crc32c_hardware_available() ? "hardware" : "software");
+        return 0;
+    }
 
-            set_data_block_status_disk(disk, block_number, DATA_BLOCK_USED);
-            inode.block_pointers[total_bytes_read / superblock.block_size] = block_number;
+    for (int policy = 0; policy < NUM_CHECKSUM_POLICIES; policy++) {
+        if (strcmp(command[1], CHECKSUM_POLICY_NAMES[policy]) == 0) {
+            checksum_policy = policy;
+            if (verbose) printf("Checksum verification set to %s\n", CHECKSUM_POLICY_NAMES[policy]);
+            return 0;
         }
-        write_data_to_block_disk(disk, block_number, data, bytes_read);
-        if (verbose) printf("Wrote %d bytes to data block %d\n", bytes_read, block_number);
-
-        total_bytes_read += bytes_read;
-    } while (bytes_read == superblock.block_size);
-
-    fclose(input_file);
-
-    inode.file_size = total_bytes_read;
-    write_inode_disk(disk, inode_number, &inode);
-
-    if (verbose) printf("Finished copying. Wrote %d bytes total\n", total_bytes_read);
+    }
 
-    fclose(disk);
-    return 0;
+    printf("Usage: checksum [off|warn|strict]\n");
+    return 1;
 }
 
-int run_command_mkdir(char* dir_path) {
-    int inode_number_dir;
-    const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &inode_number_dir);
+// Turns punching holes for freed blocks after every command on or off, the option lasts until the program exits
+int run_command_discard(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        printf("Inline discard is %s\n", inline_discard ? "on" : "off");
+        return 0;
+    }
 
-    if (result == 0) {
-        printf("Directory %s exists in the current directory\n", dir_path);
+    if (strcmp(command[1], "on") == 0) {
+        inline_discard = true;
+    } else if (strcmp(command[1], "off") == 0) {
+        // Blocks freed from now on are left to 'trim'
+        inline_discard = false;
+        free_pending_discards();
+    } else {
+        printf("Usage: discard [on|off]\n");
         return 1;
     }
-    if (result == -1) {
-        // Path could not be resolved
+
+    if (verbose) printf("Inline discard %s\n", inline_discard ? "enabled" : "disabled");
+    return 0;
+}
+
+// Punches a hole for every free data block, whether or not it was discarded when it was freed
+int run_command_trim() {
+    FILE* disk = open_disk(DEFAULT_DISK_NAME, "rb");
+    if (!disk) {
+        printf("Error: Failed to open disk\n");
         return -1;
     }
 
-    const auto inode_number = find_next_free_inode();
-    if (inode_number == -1) {
-        printf("No free inode exists, unable to create directory %s\n", dir_path);
-        return -1;
+    uint8_t* bitmap = arena_alloc(superblock.block_count / 8);
+    int* free_blocks = arena_alloc(superblock.block_count * sizeof(int));
+    const auto result = bitmap && free_blocks ? disk_read_at(disk, FREE_BITMAP_START, bitmap, superblock.block_count / 8) : -1;
+    fclose(disk);
+    if (result != 0) {
+        printf("File error: could not read the free bitmap\n");
+        return result;
     }
 
-    const auto data_block_number = find_next_free_data_block();
-    if (data_block_number == -1) {
-        printf("No free data block exists, couldn't create directory %s\n", dir_path);
-        return -1;
+    int num_free_blocks = 0;
+    for (int i = 0; i < superblock.block_count; i++) {
+        if (!(bitmap[i / 8] & (128 >> (i % 8)))) free_blocks[num_free_blocks++] = i;
     }
-    set_data_block_status(data_block_number, DATA_BLOCK_USED);
 
-    struct dentry dentry = {inode_number, TYPE_DIRECTORY};
-    const char* dir_name = get_last_of_path(dir_path);
-    strcpy(dentry.name, dir_name);
-    if (create_dentry(&dentry, inode_number_dir) == -1) {
-        printf("All data blocks are being used, unable to create new dentry\n");
-        set_data_block_status(data_block_number, DATA_BLOCK_FREE);
+    // Everything that was waiting for a batch is covered
+    if (pending_discards) memset(pending_discards, 0, superblock.block_count / 8);
+    num_pending_discards = 0;
+
+    const int num_ranges = punch_data_blocks(free_blocks, num_free_blocks);
+    if (num_ranges == -1) {
+        printf("The host can't punch holes in the disk\n");
         return -1;
     }
 
-    // Default dentries for a directory
-    const struct dentry entries[] = {
-        {inode_number, TYPE_DIRECTORY, "."},
-        {inode_number_dir, TYPE_DIRECTORY, ".."}
-    };
+    if (verbose) printf("Trimmed %d free data block(s) in %d range(s)\n", num_free_blocks, num_ranges);
+    return 0;
+}
 
-    struct inode inode = {0};
-    inode.file_size = sizeof(entries);
-    inode.block_pointers[0] = data_block_number;
-    inode.is_used = 1;
+// Shows or switches the durability mode, whatever the old mode left uncommitted is committed first
+int run_command_durability(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        if (durability_mode == DURABILITY_BATCHED) {
+            printf("Durability is batched, committing every %d ms or %d command(s)", batch_interval_ms, batch_operations);
+        } else {
+            printf("Durability is %s", DURABILITY_MODE_NAMES[durability_mode]);
+        }
+        printf(", %llu sync(s) so far\n", (unsigned long long) num_syncs);
+        return 0;
+    }
 
-    write_inode(inode_number, &inode);
+    int mode = 0;
+    while (mode < NUM_DURABILITY_MODES && strcmp(command[1], DURABILITY_MODE_NAMES[mode]) != 0) mode++;
 
-    write_data_to_block(data_block_number, entries, sizeof(entries));
+    const int interval_ms = argc > 2 ? atoi(command[2]) : DEFAULT_BATCH_INTERVAL_MS;
+    const int operations = argc > 3 ? atoi(command[3]) : DEFAULT_BATCH_OPERATIONS;
+    if (mode == NUM_DURABILITY_MODES || (argc > 2 && mode != DURABILITY_BATCHED) || interval_ms < 1 || operations < 1) {
+        printf("Usage: durability [none|strict|batched [interval in ms] [commands]]\n");
+        return 1;
+    }
 
-    if (verbose) printf("Created new directory %s, inode %d, data block %d\n",
-        dir_path, inode_number, data_block_number);
+    // Whatever the old mode left uncommitted is committed before the new one takes over
+    if (durability_mode != DURABILITY_NONE && unsynced_writes) sync_volume(nullptr);
+
+    durability_mode = mode;
+    batch_interval_ms = interval_ms;
+    batch_operations = operations;
+    start_committer();
 
+    if (verbose) printf("Durability set to %s\n", DURABILITY_MODE_NAMES[mode]);
     return 0;
 }
 
-int run_command_cd(char directory[MAX_ARG_LEN + 1], const bool print) {
-    int new_directory;
-    const auto result = get_inode_number_of_path(directory, TYPE_DIRECTORY, &new_directory);
+// Reopens the volume with or without O_DIRECT, the option lasts until the program exits
+int run_command_direct(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        printf("Direct I/O is %s\n", direct_io ? "on" : "off");
+        return 0;
+    }
 
-    if (result != 0) {
-        // get_inode_number_of_path already prints an error message unless result == 1
-        if (result == 1) printf("Directory %s does not exist\n", directory);
+    const bool previous = direct_io;
+    if (strcmp(command[1], "on") == 0) {
+        direct_io = true;
+    } else if (strcmp(command[1], "off") == 0) {
+        direct_io = false;
+    } else {
+        printf("Usage: direct [on|off]\n");
+        return 1;
+    }
 
+    if (open_volume(DEFAULT_DISK_NAME) != 0) {
+        direct_io = previous;
+        open_volume(DEFAULT_DISK_NAME);
         return -1;
     }
 
-    current_working_directory = new_directory;
+    if (verbose) printf("Direct I/O %s\n", direct_io ? "enabled" : "disabled");
+    return 0;
+}
 
-    if (print) printf("Switched to directory %s, inode %d\n", directory, current_working_directory);
+void print_io_stats(const struct io_stats* stats) {
+    for (int region = 0; region < NUM_IO_REGIONS; region++) {
+        const auto r = &stats->regions[region];
+        if (r->seeks == 0 && r->reads == 0 && r->writes == 0) continue;
 
-    return 0;
+        printf("  %s: %llu seeks, %llu reads (%llu bytes), %llu writes (%llu bytes)\n", IO_REGION_NAMES[region],
+            (unsigned long long) r->seeks, (unsigned long long) r->reads, (unsigned long long) r->bytes_read,
+            (unsigned long long) r->writes, (unsigned long long) r->bytes_written);
+    }
 }
 
-// Marks inode as unused and marks all used data blocks as unused
-void remove_element(const int inode_number, const uint8_t file_type) {
-    struct inode inode;
-    FILE* disk = fopen(DEFAULT_DISK_NAME, "r+b");
-    if (!disk) {
-        printf("Error: Failed to open disk\n");
-        return;
+// Prints all I/O counted since the last 'stats', then resets the counters
+int run_command_stats() {
+    if (total_io_stats.opens == 0) {
+        printf("No disk I/O since last reset\n");
+        reset_io_stats();
+        return 0;
     }
 
-    read_inode(inode_number, &inode);
+    printf("total: %llu opens\n", (unsigned long long) total_io_stats.opens);
+    print_io_stats(&total_io_stats);
 
-    const int num_block_pointers = ceil((double) inode.file_size / (double) superblock.block_size);
+    for (int i = 0; i < num_tracked_commands; i++) {
+        const auto stats = &command_io_stats[i].stats;
+        if (stats->opens == 0) continue;
 
-    // printf("Freeing data blocks for inode %d...\n", inode_number);
-    for (int i = 0; i < NUM_BLOCK_POINTERS; i++) {
-        if (inode.block_pointers[i] == 0) break;
-        // printf("Freeing data block %d, block pointer %d\n", inode.block_pointers[i], i);
-        set_data_block_status(inode.block_pointers[i], DATA_BLOCK_FREE);
+        printf("%s: %llu opens\n", command_io_stats[i].command, (unsigned long long) stats->opens);
+        print_io_stats(stats);
     }
-    inode.is_used = 0;
-    write_inode_disk(disk, inode_number, &inode);
 
-    fclose(disk);
+    reset_io_stats();
+    return 0;
 }
 
-int run_command_rm(char* file_path) {
-    const auto filename = get_last_of_path(file_path);
-    const auto dir_path = get_all_except_last_of_path(file_path);
-    int dir_inode = current_working_directory;
+#ifdef NANOFS_TRACE
+// Writes the contents of the trace ring, oldest event first, in Chrome's trace event format
+int dump_trace(const char* file_name) {
+    FILE* file = fopen(file_name, "w");
+    if (!file) {
+        printf("Could not open real file %s\n", file_name);
+        return 1;
+    }
 
-    if (strcmp(dir_path, "") != 0) {
-        const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &dir_inode);
+    const uint64_t end = trace_next_event;
+    const uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
 
-        if (result != 0) {
-            if (result == 1) printf("File %s does not exist in the current directory\n", file_path);
-            return 1;
-        }
+    fprintf(file, "{\"traceEvents\": [");
+    for (auto i = start; i < end; i++) {
+        const auto event = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+        fprintf(file, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+            "\"pid\": 1, \"tid\": %u}", i == start ? "" : ",", event->name, event->category,
+            event->start_ns / 1000.0, event->duration_ns / 1000.0, event->thread_id);
     }
+    fprintf(file, "\n]}\n");
+    fclose(file);
 
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(dir_inode, &num_dentries);
+    if (verbose) printf("Wrote %llu trace events to %s\n", (unsigned long long) (end - start), file_name);
+    return 0;
+}
 
-    const auto file_dentry_number = get_dentry_number_of_file(dentries, num_dentries, filename, TYPE_FILE);
-    if (file_dentry_number == -1) {
-        printf("File %s does not exist in the current directory\n", filename);
-        free((void*) dentries);
-        return 1;
+void print_latency_histograms() {
+    if (num_latency_histograms == 0) {
+        printf("No command latencies recorded\n");
+        return;
     }
 
-    // Mark all data blocks used by this file as free
-    const auto inode_number = dentries[file_dentry_number].inode_number;
-    remove_element(inode_number, dentries[file_dentry_number].file_type);
+    for (int i = 0; i < num_latency_histograms; i++) {
+        const auto histogram = &latency_histograms[i];
+        printf("%s: %llu samples\n", histogram->command, (unsigned long long) histogram->count);
 
-    remove_dentry(dir_inode, file_dentry_number);
+        for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++) {
+            if (histogram->buckets[bucket] == 0) continue;
+            printf("  [%llu, %llu) ns: %llu\n", 1ull << bucket, bucket == 63 ? ~0ull : 1ull << (bucket + 1),
+                (unsigned long long) histogram->buckets[bucket]);
+        }
+    }
+}
+#endif
+
+int run_command_trace(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+#ifdef NANOFS_TRACE
+    if (argc < 2) {
+        printf("Tracing is %s, %llu events recorded\n", tracing_enabled ? "on" : "off",
+            (unsigned long long) trace_next_event);
+        return 0;
+    }
 
-    if (verbose) {
-        if (strcmp(dir_path, "") != 0) printf("Removed file %s/%s, inode %d\n", dir_path, filename, inode_number);
-        else printf("Removed file %s, inode %d\n", file_path, inode_number);
+    if (strcmp(command[1], "on") == 0) {
+        tracing_enabled = true;
+        if (verbose) printf("Tracing enabled\n");
+    } else if (strcmp(command[1], "off") == 0) {
+        tracing_enabled = false;
+        if (verbose) printf("Tracing disabled\n");
+    } else if (strcmp(command[1], "clear") == 0) {
+        trace_next_event = 0;
+        num_latency_histograms = 0;
+        if (verbose) printf("Cleared trace events and latency histograms\n");
+    } else if (strcmp(command[1], "hist") == 0) {
+        print_latency_histograms();
+    } else if (strcmp(command[1], "dump") == 0 && argc > 2) {
+        return dump_trace(command[2]);
+    } else {
+        printf("Usage: trace [on|off|clear|hist|dump <file>]\n");
+        return 1;
     }
 
-    free((void*) dentries);
     return 0;
+#else
+    (void) argc;
+    (void) command;
+    printf("Tracing is not available, rebuild with NANOFS_TRACE\n");
+    return 1;
+#endif
 }
 
-// Recursively removes the specified directory and all of its contents
-void remove_directory(const int inode_number) {
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(inode_number, &num_dentries);
-
-    // Start at dentry 2 to skip . and ..
-    for (int i = 2; i < num_dentries; i++) {
-        if (dentries[i].file_type == TYPE_DIRECTORY) {
-            remove_directory(dentries[i].inode_number);
+int run_command_record(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    if (argc < 2) {
+        if (record_log) {
+            printf("Recording to %s, %d command(s) so far\n", record_log_name, num_recorded_commands);
         } else {
-            remove_element(dentries[i].inode_number, dentries[i].file_type);
+            printf("Recording is off\n");
         }
+        return 0;
     }
 
-    remove_element(inode_number, TYPE_DIRECTORY);
-
-    free((void*) dentries);
-}
-
-int run_command_rmdir(char* path) {
-    const auto dir_name = get_last_of_path(path);
-    const auto dir_path = get_all_except_last_of_path(path);
-    int dir_inode = current_working_directory;
-
-    if (strcmp(dir_path, "") != 0) {
-        const auto result = get_inode_number_of_path(dir_path, TYPE_DIRECTORY, &dir_inode);
-
-        if (result != 0) {
-            if (result == 1) printf("Directory %s does not exist in the current directory\n", dir_path);
+    if (strcmp(command[1], "off") == 0) {
+        if (!record_log) {
+            printf("Recording is off\n");
             return 1;
         }
-    }
-
-    int num_dentries;
-    const struct dentry* dentries = get_dentries(dir_inode, &num_dentries);
 
-    const auto dentry_number = get_dentry_number_of_file(dentries, num_dentries, dir_name, TYPE_DIRECTORY);
-    if (dentry_number == -1) {
-        printf("Directory %s does not exist in the current directory\n", path);
-        free((void*) dentries);
-        return 1;
+        stop_recording();
+        if (verbose) printf("Stopped recording, %d command(s) written to %s\n", num_recorded_commands, record_log_name);
+        return 0;
     }
 
-    remove_directory(dentries[dentry_number].inode_number);
-    remove_dentry(dir_inode, dentry_number);
+    if (start_recording(command[1]) != 0) return -1;
+    if (verbose) printf("Recording commands to %s\n", command[1]);
 
-    free((void*) dentries);
     return 0;
 }
 
 int run_fs_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], const char* disk_name) {
+    // Print and reset disk I/O counters
+    if (strcmp(command[0], "stats") == 0) {
+        return run_command_stats();
+    }
+
+    // Control tracing, inspect command latencies and export the trace
+    if (strcmp(command[0], "trace") == 0) {
+        return run_command_trace(argc, command);
+    }
+
+    // Start or stop logging every command to a workload log, see bench/nanofs_replay.c
+    if (strcmp(command[0], "record") == 0) {
+        return run_command_record(argc, command);
+    }
+
+    start_command_io_stats(command[0]);
+    TRACE_COMMAND_SCOPE(command[0]);
+
     // Initialize a filesystem
     if (strcmp(command[0], "init") == 0) {
-        return run_command_init(disk_name);
+        const int stripe_members = argc > 1 ? atoi(command[1]) : 1;
+        const int stripe_unit = argc > 2 ? atoi(command[2]) : 1;
+        if (stripe_members < 1 || stripe_members > MAX_STRIPE_MEMBERS || stripe_unit < 1) {
+            printf("Usage: init [members (1-%d)] [stripe unit in blocks]\n", MAX_STRIPE_MEMBERS);
+            return -1;
+        }
+
+        return run_command_init(disk_name, stripe_members, stripe_unit);
     }
 
     if (!superblock_loaded) {
@@ -1081,7 +6588,7 @@ int run_fs_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], cons
 
     // List all files and directories in the current working directory
     if (strcmp(command[0], "ls") == 0) {
-        return run_command_ls();
+        return run_command_ls(argc > 1 && strcmp(command[1], "-l") == 0);
     }
 
     // Create a new file in the cwd with name command[1]
@@ -1100,6 +6607,42 @@ int run_fs_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], cons
         }
     }
 
+    // Writes command[3] into file command[1] starting at byte command[2]
+    if (strcmp(command[0], "write-at") == 0) {
+        if (argc < 4) {
+            printf("Usage: write-at <file> <offset> <data>\n");
+            return 1;
+        }
+
+        const int offset = parse_file_offset(command[2]);
+        if (offset == -1) return 1;
+
+        return run_command_write_at(command[1], offset, command[3]);
+    }
+
+    // Adds command[2] to the end of file command[1]
+    if (strcmp(command[0], "append") == 0) {
+        if (argc < 3) {
+            printf("Usage: append <file> <data>\n");
+            return 1;
+        }
+
+        return run_command_write_at(command[1], -1, command[2]);
+    }
+
+    // Sets the size of file command[1] to command[2] bytes
+    if (strcmp(command[0], "truncate") == 0) {
+        if (argc < 3) {
+            printf("Usage: truncate <file> <size>\n");
+            return 1;
+        }
+
+        const int size = parse_file_offset(command[2]);
+        if (size == -1) return 1;
+
+        return run_command_truncate(command[1], size);
+    }
+
     // Prints the contents of command[1] to stdout
     // Assumes that no more than one data block of data is stored in the file
     if (strcmp(command[0], "read") == 0) {
@@ -1138,7 +6681,137 @@ int run_fs_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], cons
         return run_command_cd(command[1], verbose);
     }
 
+    // Copy file command[1] to command[2], sharing its data blocks until either copy is written to
+    if (strcmp(command[0], "cp") == 0) {
+        return run_command_cp(command[1], command[2]);
+    }
+
+    // Copy directory tree command[1] to command[2], sharing all file data blocks
+    if (strcmp(command[0], "snapshot") == 0) {
+        return run_command_snapshot(command[1], command[2]);
+    }
+
+    // Copy the contents of host directory command[1] into directory command[2] on disk
+    if (strcmp(command[0], "import") == 0) {
+        if (argc < 3) {
+            printf("Usage: import <host directory> <directory>\n");
+            return -1;
+        }
+
+        return run_command_import(command[1], command[2]);
+    }
+
+    // Copy directory command[1] on disk into host directory command[2]
+    if (strcmp(command[0], "export") == 0) {
+        if (argc < 3) {
+            printf("Usage: export <directory> <host directory>\n");
+            return -1;
+        }
+
+        return run_command_export(command[1], command[2]);
+    }
+
+    // Write the changes made since generation command[2] (or everything) to stream file command[argc - 1]
+    if (strcmp(command[0], "send") == 0) {
+        const bool incremental = argc > 1 && strcmp(command[1], "--since") == 0;
+        char* end = nullptr;
+        const auto since = incremental && argc > 3 ? strtoul(command[2], &end, 10) : 0;
+        if ((incremental && (argc < 4 || *end != '\0' || since > UINT32_MAX)) || (!incremental && argc < 2)) {
+            printf("Usage: send [--since <generation>] <stream file>\n");
+            return -1;
+        }
+
+        return run_command_send(command[argc - 1], since);
+    }
+
+    // Apply the changes in stream file command[1]
+    if (strcmp(command[0], "receive") == 0) {
+        if (argc < 2) {
+            printf("Usage: receive <stream file>\n");
+            return -1;
+        }
+
+        return run_command_receive(command[1]);
+    }
+
+    // Show how much of the disk is in use
+    if (strcmp(command[0], "df") == 0) {
+        return run_command_df();
+    }
+
+    // Move the blocks of every file and directory under command[1] into contiguous runs
+    // command[2] limits how many blocks and inodes one run moves
+    if (strcmp(command[0], "defrag") == 0) {
+        auto budget = DEFRAG_UNLIMITED_BUDGET;
+        if (argc > 2) {
+            budget = atoi(command[2]);
+            if (budget < 1) {
+                printf("Usage: defrag [path] [budget]\n");
+                return -1;
+            }
+        }
+
+        return run_command_defrag(argc > 1 ? command[1] : nullptr, budget);
+    }
+
+    // Check the disk for consistency, 'fsck repair' also rebuilds the free bitmap
+    if (strcmp(command[0], "fsck") == 0) {
+        return run_command_fsck(argc > 1 && strcmp(command[1], "repair") == 0);
+    }
+
+    // Total the sizes of the files below command[1], or below the cwd
+    if (strcmp(command[0], "du") == 0) {
+        return run_command_du(argc > 1 ? command[1] : nullptr);
+    }
+
+    // List every path below command[1], or below the cwd, whose name matches the pattern after -name
+    if (strcmp(command[0], "find") == 0) {
+        const bool has_path = argc == 4;
+        if ((argc != 3 && argc != 4) || strcmp(command[has_path ? 2 : 1], "-name") != 0) {
+            printf("Usage: find [path] -name <pattern>\n");
+            return -1;
+        }
+
+        return run_command_find(has_path ? command[1] : nullptr, command[argc - 1]);
+    }
+
+    // Turn block deduplication on or off for files written with 'save'
+    if (strcmp(command[0], "dedup") == 0) {
+        return run_command_dedup(argc, command);
+    }
+
+    // Turn packing of small file tails into shared fragment blocks on or off
+    if (strcmp(command[0], "tailpack") == 0) {
+        return run_command_tailpack(argc, command);
+    }
+
+    // Choose what happens when a checksum doesn't match on read
+    if (strcmp(command[0], "checksum") == 0) {
+        return run_command_checksum(argc, command);
+    }
+
+    // Choose how commands are made durable, 'durability batched' also takes the batch interval and size
+    if (strcmp(command[0], "durability") == 0) {
+        return run_command_durability(argc, command);
+    }
+
+    // Read and write data blocks with O_DIRECT, bypassing the host page cache
+    if (strcmp(command[0], "direct") == 0) {
+        return run_command_direct(argc, command);
+    }
+
+    // Turn punching holes for blocks freed by each command on or off
+    if (strcmp(command[0], "discard") == 0) {
+        return run_command_discard(argc, command);
+    }
+
+    // Punch holes for all free data blocks
+    if (strcmp(command[0], "trim") == 0) {
+        return run_command_trim();
+    }
+
     if (strcmp(command[0], "exit") == 0) {
+        if (durability_mode != DURABILITY_NONE && unsynced_writes) sync_volume(nullptr);
         if (verbose) printf("Exiting NanoFS...");
         exit(0);
     }
@@ -1147,17 +6820,91 @@ int run_fs_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], cons
     return 1;
 }
 
-int main(const int argc, char const *argv[]) {
-    if (argc > 1 && strcmp(argv[1], "verbose") == 0) verbose = true;
+// Runs one command the way the shell does, with the batch committer held off and the scratch memory given back after
+int run_shell_command(const int argc, char command[MAX_ARGS][MAX_ARG_LEN + 1], const char* disk_name) {
+    pthread_mutex_lock(&commit_lock);
+    const auto result = run_fs_command(argc, command, disk_name);
+    // Freed blocks are punched out in one batch per command
+    discard_pending_blocks();
+    commit_command();
+    pthread_mutex_unlock(&commit_lock);
+    arena_reset();
 
-    const auto disk_name = DEFAULT_DISK_NAME;
+    return result;
+}
+
+// Splits a command line into its words (args), input is modified
+// Returns the number of args
+int split_command_line(char* input, char args[MAX_ARGS][MAX_ARG_LEN + 1]) {
+    int arg_count = 0;
+    const char *token = strtok(input, " ");
+
+    while (token != nullptr) {
+        if (arg_count == MAX_ARGS) {
+            printf("Too many arguments\n");
+            break;
+        }
+
+        const auto token_length = strlen(token);
+        if (token_length > MAX_ARG_LEN) {
+            printf("Argument too long\n");
+            break;
+        }
+
+        memcpy(args[arg_count], token, token_length);
+        args[arg_count][token_length] = '\0';
+        arg_count++;
+        token = strtok(nullptr, " ");
+    }
+
+    return arg_count;
+}
+
+// Loads the superblock and opens the volume of the given disk, then checks the free space summary
+// Returns -1 if the disk can't be used, commands then ask for an 'init'
+int load_disk(const char* disk_name) {
     if (verbose) printf("Loading superblock for disk %s...\n", disk_name);
     const auto result = get_superblock(disk_name, &superblock);
     if (result == -1) {
         printf("Disk %s does not currently exist, create it using 'init' first.\n", disk_name);
+    } else if (result != 0) {
+        printf("Disk %s could not be loaded, recreate it using 'init'.\n", disk_name);
     } else {
         calculate_disk_structure();
+        if (open_volume(disk_name) != 0) {
+            printf("Disk %s could not be opened, all %d of its image file(s) have to be present.\n", disk_name, superblock.stripe_members);
+            superblock_loaded = false;
+        }
+    }
+    if (!superblock_loaded) return -1;
+
+    load_block_checksums();
+    if (superblock.flags & SUPERBLOCK_FLAG_DEDUP) load_dedup_index();
+
+    // The summary can be stale if the program stopped in the middle of a command
+    if (recalculate_free_space_summary() == 1) printf("Free space summary was out of date and has been corrected\n");
+
+    return 0;
+}
+
+// The benchmark and the replay tool include this file directly and provide their own main
+#ifndef NANOFS_NO_MAIN
+int main(const int argc, char const *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "verbose") == 0) verbose = true;
+        if (strcmp(argv[i], "direct") == 0) direct_io = true;
+
+        for (int mode = 0; mode < NUM_DURABILITY_MODES; mode++) {
+            if (strcmp(argv[i], DURABILITY_MODE_NAMES[mode]) == 0) durability_mode = mode;
+        }
     }
+    start_committer();
+
+    const auto disk_name = DEFAULT_DISK_NAME;
+    load_disk(disk_name);
+
+    // Only count I/O done by commands
+    reset_io_stats();
 
     while (true) {
         printf("nanofs/> ");
@@ -1169,29 +6916,20 @@ int main(const int argc, char const *argv[]) {
         // Remove newline character
         input[strlen(input) - 1] = '\0';
 
-        // Split the input string into words (args)
-        char args[MAX_ARGS][MAX_ARG_LEN + 1];
-        int arg_count = 0;
-        const char *token = strtok(input, " ");
+        // The line is split in place, the recording needs it as it was typed
+        char line[MAX_ARGS * MAX_ARG_LEN];
+        strcpy(line, input);
 
-        while (token != nullptr) {
-            if (arg_count == 5) {
-                printf("Too many arguments\n");
-                break;
-            }
+        char args[MAX_ARGS][MAX_ARG_LEN + 1];
+        const int arg_count = split_command_line(input, args);
 
-            const auto token_length = strlen(token);
-            if (token_length > MAX_ARG_LEN) {
-                printf("Argument too long\n");
-                break;
+        if (arg_count != 0) {
+            const auto start_ns = monotonic_now_ns();
+            const auto result = run_shell_command(arg_count, args, disk_name);
+            if (record_log && strcmp(args[0], "record") != 0) {
+                record_command(line, start_ns, monotonic_now_ns() - start_ns, result);
             }
-
-            strncpy(args[arg_count], token, token_length);
-            args[arg_count][token_length] = '\0';
-            arg_count++;
-            token = strtok(nullptr, " ");
         }
-
-        if (arg_count != 0) run_fs_command(arg_count, args, disk_name);
     }
-}
\ No newline at end of file
+}
+#endif //NANOFS_NO_MAIN
@@ -13,15 +13,34 @@
 
 #define NUM_BLOCK_POINTERS 12
 
+// Superblock flags
+#define SUPERBLOCK_FLAG_DEDUP 0x1 // Blocks saved into files are deduplicated by content hash
+#define SUPERBLOCK_FLAG_PACK_TAILS 0x2 // The last partial block of a file is stored in a shared fragment block
+
 struct superblock {
     uint32_t total_size;
+    uint32_t generation; // Changes are stamped with this generation, every send starts a new one
     uint16_t block_size, block_count, inode_size, inode_count;
+    uint16_t flags;
+    // Free space summary, kept up to date by the allocators and checked when the disk is loaded
+    uint16_t free_block_count, free_inode_count;
+    uint16_t first_free_block; // Every data block before this one is in use
+    uint16_t first_free_inode; // Every inode before this one is in use
+    uint16_t stripe_members; // Number of image files the data blocks are spread over
+    uint16_t stripe_unit; // Number of consecutive data blocks stored on the same member
+    uint32_t checksum; // CRC32C of the fields above
 };
 
 struct inode {
+    uint32_t generation; // Generation of the last change to the inode
     uint16_t file_size; // In bytes
     uint16_t block_pointers[NUM_BLOCK_POINTERS]; // 0 indicates an unused pointer
+    // The last partial block of a packed file is a slice of a fragment block shared with other files
+    // The slice holds what's left of the file after its last full block
+    uint16_t tail_block; // 0 if the file isn't packed
+    uint16_t tail_offset;
     uint8_t is_used; // 0 = not in use
+    uint32_t checksum; // CRC32C of the fields above, 0 if the inode was never written
 };
 
 struct dentry {
@@ -30,7 +49,15 @@ struct dentry {
     char name[253];
 };
 
-uint32_t INODE_TABLE_START, FREE_BITMAP_START, DATA_START;
+// One entry per data block, stored in the block info region
+struct block_info {
+    uint32_t hash; // Content hash of the block, 0 if the block is not in the dedup index
+    uint32_t checksum; // CRC32C of the whole block, 0 if nothing was written to it since it was allocated
+    uint32_t generation; // Generation of the last change to the block or to this entry, kept next to the checksum
+    uint16_t reference_count; // Number of block pointers referencing this block, 0 if free
+};
+
+uint32_t INODE_TABLE_START, FREE_BITMAP_START, BLOCK_INFO_START, DATA_START;
 uint8_t DENTRIES_PER_BLOCK;
 
 #endif //SYSTEM_STRUCTURES_H